@@ -0,0 +1,162 @@
+#include "webdatacapabilitiescache.h"
+#include "qgsapplication.h"
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QSettings>
+
+static const quint32 CACHE_MAGIC = 0x57444343; //WDCC
+static const quint32 CACHE_VERSION = 5;
+
+static QDataStream& operator<<( QDataStream& stream, const WebDataLayerRecord& record )
+{
+  stream << record.name << record.title << record.abstract << record.keywords << record.crs << record.styles;
+  stream << record.hasExtent << record.west << record.south << record.east << record.north << qint32( record.parent );
+  return stream;
+}
+
+static QDataStream& operator>>( QDataStream& stream, WebDataLayerRecord& record )
+{
+  qint32 parent;
+  stream >> record.name >> record.title >> record.abstract >> record.keywords >> record.crs >> record.styles;
+  stream >> record.hasExtent >> record.west >> record.south >> record.east >> record.north >> parent;
+  record.parent = parent;
+  return stream;
+}
+
+WebDataCapabilitiesCache::WebDataCapabilitiesCache()
+{
+  mCacheDir = QgsApplication::qgisSettingsDirPath() + "/cachelayers/capabilities";
+  QDir cacheDirectory( mCacheDir );
+  if ( !cacheDirectory.exists() )
+  {
+    cacheDirectory.mkpath( mCacheDir );
+  }
+}
+
+WebDataCapabilitiesCache::~WebDataCapabilitiesCache()
+{
+}
+
+bool WebDataCapabilitiesCache::load( const QString& url, Entry& entry, bool readRecords ) const
+{
+  QFile cacheFile( filePath( url ) );
+  if ( !cacheFile.open( QIODevice::ReadOnly ) )
+  {
+    return false;
+  }
+
+  QDataStream stream( &cacheFile );
+  stream.setVersion( QDataStream::Qt_5_0 );
+  quint32 magic, version;
+  stream >> magic >> version;
+  if ( magic != CACHE_MAGIC || version != CACHE_VERSION )
+  {
+    return false;
+  }
+
+  stream >> entry.eTag >> entry.lastModified >> entry.fetched >> entry.formats >> entry.version >> entry.maxImageSize;
+  entry.records.clear();
+  if ( readRecords )
+  {
+    qint32 nRecords;
+    stream >> nRecords;
+    entry.records.reserve( nRecords );
+    for ( qint32 i = 0; i < nRecords && stream.status() == QDataStream::Ok; ++i )
+    {
+      WebDataLayerRecord record;
+      stream >> record;
+      entry.records.append( record );
+    }
+  }
+  return ( stream.status() == QDataStream::Ok );
+}
+
+bool WebDataCapabilitiesCache::store( const QString& url, const Entry& entry ) const
+{
+  //write to a temporary file and rename, so readers never see a partly written entry
+  QSaveFile cacheFile( filePath( url ) );
+  if ( !cacheFile.open( QIODevice::WriteOnly ) )
+  {
+    return false;
+  }
+
+  QDataStream stream( &cacheFile );
+  stream.setVersion( QDataStream::Qt_5_0 );
+  stream << CACHE_MAGIC << CACHE_VERSION;
+  stream << entry.eTag << entry.lastModified << entry.fetched << entry.formats << entry.version << entry.maxImageSize;
+  stream << qint32( entry.records.size() );
+  QList<WebDataLayerRecord>::const_iterator recordIt = entry.records.constBegin();
+  for ( ; recordIt != entry.records.constEnd(); ++recordIt )
+  {
+    stream << *recordIt;
+  }
+  return cacheFile.commit();
+}
+
+bool WebDataCapabilitiesCache::touch( const QString& url ) const
+{
+  //only the fetch time is overwritten, the records stay untouched in the file
+  QFile cacheFile( filePath( url ) );
+  if ( !cacheFile.open( QIODevice::ReadWrite ) )
+  {
+    return false;
+  }
+
+  QDataStream stream( &cacheFile );
+  stream.setVersion( QDataStream::Qt_5_0 );
+  quint32 magic, version;
+  QString eTag, lastModified;
+  QDateTime fetched;
+  stream >> magic >> version;
+  if ( magic != CACHE_MAGIC || version != CACHE_VERSION )
+  {
+    return false;
+  }
+  stream >> eTag >> lastModified;
+  qint64 fetchedPos = cacheFile.pos();
+  stream >> fetched;
+  if ( stream.status() != QDataStream::Ok )
+  {
+    return false;
+  }
+
+  QByteArray fetchedData;
+  QDataStream fetchedStream( &fetchedData, QIODevice::WriteOnly );
+  fetchedStream.setVersion( QDataStream::Qt_5_0 );
+  fetchedStream << QDateTime::currentDateTimeUtc();
+  if ( fetchedData.size() != cacheFile.pos() - fetchedPos )
+  {
+    //the stored time has another time spec and size. store() always writes UTC times
+    return false;
+  }
+  return cacheFile.seek( fetchedPos ) && cacheFile.write( fetchedData ) == fetchedData.size();
+}
+
+void WebDataCapabilitiesCache::remove( const QString& url ) const
+{
+  QFile::remove( filePath( url ) );
+}
+
+bool WebDataCapabilitiesCache::isFresh( const Entry& entry )
+{
+  if ( !entry.fetched.isValid() )
+  {
+    return false;
+  }
+  return ( entry.fetched.secsTo( QDateTime::currentDateTimeUtc() ) < timeToLive() );
+}
+
+int WebDataCapabilitiesCache::timeToLive()
+{
+  QSettings s;
+  return s.value( "/NIWA/capabilitiesCacheTTL", 3600 ).toInt();
+}
+
+QString WebDataCapabilitiesCache::filePath( const QString& url ) const
+{
+  QByteArray hash = QCryptographicHash::hash( url.toUtf8(), QCryptographicHash::Md5 ).toHex();
+  return mCacheDir + "/" + QString::fromLatin1( hash ) + ".cache";
+}
@@ -0,0 +1,52 @@
+#ifndef WEBDATACAPABILITIESCACHE_H
+#define WEBDATACAPABILITIESCACHE_H
+
+#include "webdatacapabilitiesparser.h"
+#include <QDateTime>
+
+/**Stores the parsed capabilities of services together with the HTTP validators (ETag / Last-Modified) in the
+  cachelayers/capabilities directory. Allows to send conditional GetCapabilities requests and to reuse the layer
+  records if the server answers with 304 (not modified)*/
+class WebDataCapabilitiesCache
+{
+  public:
+    /**Cached capabilities of a service*/
+    struct Entry
+    {
+      QString eTag;
+      QString lastModified;
+      /**Time of the last download or successful revalidation*/
+      QDateTime fetched;
+      QStringList formats;
+      /**Version of the capabilities document*/
+      QString version;
+      QSize maxImageSize;
+      QList<WebDataLayerRecord> records;
+    };
+
+    WebDataCapabilitiesCache();
+    ~WebDataCapabilitiesCache();
+
+    /**Reads the cache entry for a GetCapabilities url
+      @param readRecords false if only validators and fetch time are needed
+      @return false if there is no (readable) entry*/
+    bool load( const QString& url, Entry& entry, bool readRecords = true ) const;
+    /**Writes the cache entry for a GetCapabilities url*/
+    bool store( const QString& url, const Entry& entry ) const;
+    /**Sets the fetch time of an entry to now (after the server confirmed the cached version). Only the time is
+      rewritten, the records are neither read nor written*/
+    bool touch( const QString& url ) const;
+    void remove( const QString& url ) const;
+
+    /**Returns true if the entry is younger than the time to live*/
+    static bool isFresh( const Entry& entry );
+    /**Time to live of cache entries in seconds (setting /NIWA/capabilitiesCacheTTL)*/
+    static int timeToLive();
+
+  private:
+    QString mCacheDir;
+
+    QString filePath( const QString& url ) const;
+};
+
+#endif // WEBDATACAPABILITIESCACHE_H
@@ -0,0 +1,373 @@
+#include "webdatacapabilitiesparser.h"
+
+WebDataCapabilitiesParser::WebDataCapabilitiesParser( const QString& service ): mService( service.toUpper() ), mFinished( false ),
+    mRecordCount( 0 ), mMaxImageSize( 0, 0 )
+{
+}
+
+WebDataCapabilitiesParser::~WebDataCapabilitiesParser()
+{
+}
+
+void WebDataCapabilitiesParser::addData( const QByteArray& data )
+{
+  if ( mFinished || data.isEmpty() )
+  {
+    return;
+  }
+  mReader.addData( data );
+  parse();
+}
+
+void WebDataCapabilitiesParser::finish()
+{
+  mFinished = true;
+  parse();
+}
+
+bool WebDataCapabilitiesParser::hasError() const
+{
+  if ( !mReader.hasError() )
+  {
+    return false;
+  }
+
+  //running out of data is only an error once the whole document has been received
+  return ( mFinished || mReader.error() != QXmlStreamReader::PrematureEndOfDocumentError );
+}
+
+QString WebDataCapabilitiesParser::errorString() const
+{
+  if ( !hasError() )
+  {
+    return QString();
+  }
+  return QString( "%1 (line %2, column %3)" ).arg( mReader.errorString() ).arg( mReader.lineNumber() ).arg( mReader.columnNumber() );
+}
+
+QList<WebDataLayerRecord> WebDataCapabilitiesParser::takeRecords()
+{
+  QList<WebDataLayerRecord> records = mRecords;
+  mRecords.clear();
+  return records;
+}
+
+void WebDataCapabilitiesParser::parse()
+{
+  while ( !mReader.atEnd() )
+  {
+    QXmlStreamReader::TokenType token = mReader.readNext();
+    if ( token == QXmlStreamReader::Invalid )
+    {
+      //either an error or the end of the data received so far
+      break;
+    }
+
+    if ( token == QXmlStreamReader::StartElement )
+    {
+      QString name = mReader.name().toString();
+      mElementStack.push_back( name );
+      mText.clear();
+      startElement( name, mReader.attributes() );
+    }
+    else if ( token == QXmlStreamReader::EndElement )
+    {
+      endElement( mReader.name().toString() );
+      if ( !mElementStack.isEmpty() )
+      {
+        mElementStack.pop_back();
+      }
+      mText.clear();
+    }
+    else if ( token == QXmlStreamReader::Characters )
+    {
+      mText.append( mReader.text() );
+    }
+  }
+}
+
+void WebDataCapabilitiesParser::startElement( const QString& name, const QXmlStreamAttributes& attributes )
+{
+  //WMT_MS_Capabilities / WMS_Capabilities / WFS_Capabilities
+  if ( mElementStack.size() == 1 )
+  {
+    mVersion = attributes.value( "version" ).toString();
+    return;
+  }
+
+  if ( ( mService == "WMS" && name == "Layer" ) || ( mService == "WFS" && name == "FeatureType" ) )
+  {
+    WebDataLayerRecord layer;
+    QSet<QString> crsSet, styleSet;
+
+    //the properties of a parent layer come before its sublayers. Make the parent available before starting the child
+    if ( !mOpenLayers.isEmpty() )
+    {
+      emitOpenLayer();
+
+      //WMS sublayers inherit CRS and styles of their parents (additive)
+      const WebDataLayerRecord& parentLayer = mOpenLayers.last();
+      layer.parent = mOpenLayerIndex.last();
+      layer.crs = parentLayer.crs;
+      layer.styles = parentLayer.styles;
+      if ( mService == "WMS" )
+      {
+        layer.hasExtent = parentLayer.hasExtent;
+        layer.west = parentLayer.west;
+        layer.south = parentLayer.south;
+        layer.east = parentLayer.east;
+        layer.north = parentLayer.north;
+      }
+      crsSet = mOpenLayerCrs.last();
+      styleSet = mOpenLayerStyles.last();
+    }
+    mOpenLayers.push_back( layer );
+    mOpenLayerIndex.push_back( -1 );
+    mOpenLayerCrs.push_back( crsSet );
+    mOpenLayerStyles.push_back( styleSet );
+  }
+  else if ( !mOpenLayers.isEmpty() && ancestor( 1 ) == ( mService == "WMS" ? "Layer" : "FeatureType" )
+            && ( name == "LatLonBoundingBox" || name == "LatLongBoundingBox" ) ) //WMS 1.1.1 / WFS 1.0
+  {
+    setExtentFromAttributes( attributes );
+  }
+}
+
+void WebDataCapabilitiesParser::setExtentFromAttributes( const QXmlStreamAttributes& attributes )
+{
+  bool minxOk, minyOk, maxxOk, maxyOk;
+  double minx = attributes.value( "minx" ).toString().toDouble( &minxOk );
+  double miny = attributes.value( "miny" ).toString().toDouble( &minyOk );
+  double maxx = attributes.value( "maxx" ).toString().toDouble( &maxxOk );
+  double maxy = attributes.value( "maxy" ).toString().toDouble( &maxyOk );
+  if ( !minxOk || !minyOk || !maxxOk || !maxyOk )
+  {
+    return;
+  }
+
+  WebDataLayerRecord& layer = mOpenLayers.last();
+  layer.hasExtent = true;
+  layer.west = minx;
+  layer.south = miny;
+  layer.east = maxx;
+  layer.north = maxy;
+}
+
+void WebDataCapabilitiesParser::endElement( const QString& name )
+{
+  QString text = mText.trimmed();
+  QString parent = ancestor( 1 );
+
+  if ( mService == "WMS" )
+  {
+    if ( name == "Layer" )
+    {
+      emitOpenLayer();
+      mOpenLayers.removeLast();
+      mOpenLayerIndex.removeLast();
+      mOpenLayerCrs.removeLast();
+      mOpenLayerStyles.removeLast();
+    }
+    else if ( name == "Format" && parent == "GetMap" )
+    {
+      mFormats.append( text );
+    }
+    else if ( ( name == "MaxWidth" || name == "MaxHeight" ) && parent == "Service" )
+    {
+      int size = text.toInt();
+      if ( name == "MaxWidth" )
+      {
+        mMaxImageSize.setWidth( size );
+      }
+      else
+      {
+        mMaxImageSize.setHeight( size );
+      }
+    }
+    else if ( mOpenLayers.isEmpty() )
+    {
+      return;
+    }
+    else if ( parent == "Layer" )
+    {
+      WebDataLayerRecord& layer = mOpenLayers.last();
+      if ( name == "Name" )
+      {
+        layer.name = text;
+      }
+      else if ( name == "Title" )
+      {
+        layer.title = text;
+      }
+      else if ( name == "Abstract" )
+      {
+        layer.abstract = text;
+      }
+      else if ( name == "CRS" || name == "SRS" ) //CRS in WMS 1.3, SRS in WMS 1.1.1 (may be a list)
+      {
+        QStringList crsList = text.split( QRegExp( "\\s+" ), QString::SkipEmptyParts );
+        QStringList::const_iterator crsIt = crsList.constBegin();
+        for ( ; crsIt != crsList.constEnd(); ++crsIt )
+        {
+          appendUnique( layer.crs, mOpenLayerCrs.last(), *crsIt );
+        }
+      }
+    }
+    else if ( name == "Name" && parent == "Style" && ancestor( 2 ) == "Layer" )
+    {
+      appendUnique( mOpenLayers.last().styles, mOpenLayerStyles.last(), text );
+    }
+    else if ( name == "Keyword" && parent == "KeywordList" && ancestor( 2 ) == "Layer" && !text.isEmpty() )
+    {
+      mOpenLayers.last().keywords.append( text );
+    }
+    else if ( parent == "EX_GeographicBoundingBox" && ancestor( 2 ) == "Layer" ) //WMS 1.3
+    {
+      WebDataLayerRecord& layer = mOpenLayers.last();
+      bool ok;
+      double value = text.toDouble( &ok );
+      if ( !ok )
+      {
+        return;
+      }
+      if ( name == "westBoundLongitude" )
+      {
+        layer.west = value;
+      }
+      else if ( name == "eastBoundLongitude" )
+      {
+        layer.east = value;
+      }
+      else if ( name == "southBoundLatitude" )
+      {
+        layer.south = value;
+      }
+      else if ( name == "northBoundLatitude" )
+      {
+        layer.north = value;
+      }
+      layer.hasExtent = true;
+    }
+  }
+  else if ( mService == "WFS" )
+  {
+    if ( name == "FeatureType" )
+    {
+      emitOpenLayer();
+      mOpenLayers.removeLast();
+      mOpenLayerIndex.removeLast();
+      mOpenLayerCrs.removeLast();
+      mOpenLayerStyles.removeLast();
+    }
+    else if ( !mOpenLayers.isEmpty() && parent == "FeatureType" )
+    {
+      WebDataLayerRecord& featureType = mOpenLayers.last();
+      if ( name == "Name" )
+      {
+        featureType.name = text;
+      }
+      else if ( name == "Title" )
+      {
+        featureType.title = text;
+      }
+      else if ( name == "Abstract" )
+      {
+        featureType.abstract = text;
+      }
+      else if ( name == "SRS" || name == "DefaultSRS" || name == "DefaultCRS" )
+      {
+        featureType.crs.append( text );
+      }
+      else if ( name == "Keywords" ) //WFS 1.0: comma separated list
+      {
+        QStringList keywordList = text.split( ",", QString::SkipEmptyParts );
+        QStringList::const_iterator keywordIt = keywordList.constBegin();
+        for ( ; keywordIt != keywordList.constEnd(); ++keywordIt )
+        {
+          featureType.keywords.append( keywordIt->trimmed() );
+        }
+      }
+    }
+    else if ( !mOpenLayers.isEmpty() && name == "Keyword" && parent == "Keywords" && ancestor( 2 ) == "FeatureType"
+              && !text.isEmpty() ) //WFS 1.1 / 2.0: ows:Keywords/ows:Keyword
+    {
+      mOpenLayers.last().keywords.append( text );
+    }
+    else if ( !mOpenLayers.isEmpty() && ( name == "LowerCorner" || name == "UpperCorner" )
+              && parent == "WGS84BoundingBox" && ancestor( 2 ) == "FeatureType" ) //WFS 1.1 / 2.0: 'lon lat'
+    {
+      QStringList corner = text.split( QRegExp( "\\s+" ), QString::SkipEmptyParts );
+      bool xOk = false, yOk = false;
+      double x = corner.value( 0 ).toDouble( &xOk );
+      double y = corner.value( 1 ).toDouble( &yOk );
+      if ( xOk && yOk )
+      {
+        WebDataLayerRecord& featureType = mOpenLayers.last();
+        featureType.hasExtent = true;
+        if ( name == "LowerCorner" )
+        {
+          featureType.west = x;
+          featureType.south = y;
+        }
+        else
+        {
+          featureType.east = x;
+          featureType.north = y;
+        }
+      }
+    }
+  }
+}
+
+void WebDataCapabilitiesParser::emitOpenLayer()
+{
+  if ( mOpenLayers.isEmpty() || mOpenLayerIndex.last() != -1 )
+  {
+    return;
+  }
+  mRecords.append( mOpenLayers.last() );
+  mOpenLayerIndex.last() = mRecordCount++;
+}
+
+void WebDataCapabilitiesParser::appendUnique( QStringList& list, QSet<QString>& set, const QString& value )
+{
+  if ( value.isEmpty() || set.contains( value ) )
+  {
+    return;
+  }
+  set.insert( value );
+  list.append( value );
+}
+
+QString WebDataCapabilitiesParser::ancestor( int level ) const
+{
+  int i = mElementStack.size() - 1 - level;
+  if ( i < 0 )
+  {
+    return QString();
+  }
+  return mElementStack.at( i );
+}
+
+WebDataCapabilitiesWorker::WebDataCapabilitiesWorker( const QString& service ): QObject(), mParser( service )
+{
+}
+
+WebDataCapabilitiesWorker::~WebDataCapabilitiesWorker()
+{
+}
+
+void WebDataCapabilitiesWorker::addData( const QByteArray& data )
+{
+  mParser.addData( data );
+  mRecords.append( mParser.takeRecords() );
+}
+
+void WebDataCapabilitiesWorker::finish()
+{
+  mParser.finish();
+  mRecords.append( mParser.takeRecords() );
+  emit parsingFinished( mRecords, mParser.formats(), mParser.version(), mParser.maxImageSize(), !mParser.hasError(),
+                        mParser.errorString() );
+  mRecords.clear();
+}
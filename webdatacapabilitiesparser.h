@@ -0,0 +1,129 @@
+#ifndef WEBDATACAPABILITIESPARSER_H
+#define WEBDATACAPABILITIESPARSER_H
+
+#include <QList>
+#include <QMetaType>
+#include <QObject>
+#include <QSet>
+#include <QSize>
+#include <QStringList>
+#include <QVector>
+#include <QXmlStreamReader>
+
+/**Layer (WMS) or feature type (WFS) information read from a capabilities document*/
+struct WebDataLayerRecord
+{
+  WebDataLayerRecord(): hasExtent( false ), west( 0 ), south( 0 ), east( 0 ), north( 0 ), parent( -1 ) {}
+
+  /**Empty for WMS layers which only group other layers*/
+  QString name;
+  QString title;
+  QString abstract;
+  QStringList keywords;
+  /**Supported CRS including the ones inherited from parent layers*/
+  QStringList crs;
+  /**Style names including the ones inherited from parent layers*/
+  QStringList styles;
+  /**Geographic extent (WGS 84 longitude / latitude) if advertised. WMS layers inherit the extent of their parents*/
+  bool hasExtent;
+  double west;
+  double south;
+  double east;
+  double north;
+  /**Position of the parent layer in the sequence of records of the document (-1 for top level layers)*/
+  int parent;
+};
+
+Q_DECLARE_METATYPE( QList<WebDataLayerRecord> )
+
+/**Incremental parser for WMS/WFS GetCapabilities documents. The document can be passed in chunks as it arrives
+  from the network. Layer records are available as soon as the corresponding part of the document has been read,
+  so the complete document never needs to be held in memory*/
+class WebDataCapabilitiesParser
+{
+  public:
+    /**@param service WMS/WFS*/
+    WebDataCapabilitiesParser( const QString& service );
+    ~WebDataCapabilitiesParser();
+
+    /**Appends a chunk of the document and parses as far as the data allows*/
+    void addData( const QByteArray& data );
+    /**Tells the parser that no more data will follow*/
+    void finish();
+
+    /**Returns true if the document is not well formed (or incomplete after finish())*/
+    bool hasError() const;
+    QString errorString() const;
+
+    /**Returns the records parsed since the last call and removes them from the parser*/
+    QList<WebDataLayerRecord> takeRecords();
+
+    /**Supported GetMap formats (WMS only)*/
+    QStringList formats() const { return mFormats; }
+    /**Version attribute of the document's root element (e.g. 1.1.1 / 1.3.0)*/
+    QString version() const { return mVersion; }
+    /**Largest GetMap image the server accepts (MaxWidth / MaxHeight, WMS 1.3). 0 if not advertised*/
+    QSize maxImageSize() const { return mMaxImageSize; }
+
+  private:
+    QString mService;
+    QXmlStreamReader mReader;
+    bool mFinished;
+
+    /**Local names of the currently open elements*/
+    QVector<QString> mElementStack;
+    /**Character data of the innermost open element*/
+    QString mText;
+
+    /**Layers / feature types which are currently open (outermost first)*/
+    QList<WebDataLayerRecord> mOpenLayers;
+    /**Record position of the open layer at the same list position or -1 if it has not been moved to mRecords yet*/
+    QList<int> mOpenLayerIndex;
+    /**CRS / styles of the open layers for fast duplicate checks when adding to the inherited ones*/
+    QList< QSet<QString> > mOpenLayerCrs;
+    QList< QSet<QString> > mOpenLayerStyles;
+    /**Number of records produced so far*/
+    int mRecordCount;
+
+    QList<WebDataLayerRecord> mRecords;
+    QStringList mFormats;
+    QString mVersion;
+    QSize mMaxImageSize;
+
+    void parse();
+    void startElement( const QString& name, const QXmlStreamAttributes& attributes );
+    /**Sets the extent of the innermost open layer from minx/miny/maxx/maxy attributes*/
+    void setExtentFromAttributes( const QXmlStreamAttributes& attributes );
+    void endElement( const QString& name );
+    /**Moves the innermost open layer to the finished records (once)*/
+    void emitOpenLayer();
+    /**Adds value to list if not already contained in set*/
+    static void appendUnique( QStringList& list, QSet<QString>& set, const QString& value );
+    /**Returns the local name of the ancestor element at the given level above the current one (1 = parent)*/
+    QString ancestor( int level ) const;
+};
+
+/**Runs a WebDataCapabilitiesParser in a worker thread. Data chunks are passed with queued invocations of addData(),
+  the records are delivered all at once with parsingFinished()*/
+class WebDataCapabilitiesWorker: public QObject
+{
+    Q_OBJECT
+  public:
+    WebDataCapabilitiesWorker( const QString& service );
+    ~WebDataCapabilitiesWorker();
+
+  public slots:
+    void addData( const QByteArray& data );
+    /**Parses the remaining data and emits parsingFinished()*/
+    void finish();
+
+  signals:
+    void parsingFinished( const QList<WebDataLayerRecord>& records, const QStringList& formats, const QString& version,
+                          const QSize& maxImageSize, bool ok, const QString& errorString );
+
+  private:
+    WebDataCapabilitiesParser mParser;
+    QList<WebDataLayerRecord> mRecords;
+};
+
+#endif // WEBDATACAPABILITIESPARSER_H
@@ -0,0 +1,162 @@
+#include "webdatacatalogloader.h"
+#include "qgslogger.h"
+#include <QDomDocument>
+#include <QDomElement>
+#include <QFile>
+
+WebDataCatalogLoader::WebDataCatalogLoader(): QObject()
+{
+}
+
+WebDataCatalogLoader::~WebDataCatalogLoader()
+{
+}
+
+void WebDataCatalogLoader::load( const QString& databasePath, const QString& xmlPath, const QStringList& preloadServices )
+{
+  WebDataCatalogData data;
+  WebDataCatalogStore store;
+  data.databaseOk = store.open( databasePath );
+  if ( !data.databaseOk )
+  {
+    QgsDebugMsg( "Error opening " + databasePath );
+    emit loadingFinished( data );
+    return;
+  }
+
+  data.services = store.services();
+  if ( store.metaValue( "xmlMigrated" ).isEmpty() )
+  {
+    //webdata.xml is taken over only once, services the user deletes later don't come back
+    if ( data.services.isEmpty() && migrateXML( store, xmlPath ) )
+    {
+      data.services = store.services();
+    }
+    store.setMetaValue( "xmlMigrated", "1" );
+  }
+
+  QSet<QString> preload = preloadServices.toSet();
+  QList<WebDataCatalogStore::ServiceRecord>::const_iterator serviceIt = data.services.constBegin();
+  for ( ; serviceIt != data.services.constEnd(); ++serviceIt )
+  {
+    if ( serviceIt->layerCount > 0 && preload.contains( serviceIt->title ) )
+    {
+      data.layers.insert( serviceIt->title, store.layers( serviceIt->title ) );
+    }
+  }
+
+  store.close();
+  emit loadingFinished( data );
+}
+
+bool WebDataCatalogLoader::migrateXML( WebDataCatalogStore& store, const QString& xmlPath )
+{
+  QFile xmlFile( xmlPath );
+  if ( !xmlFile.exists() || !xmlFile.open( QIODevice::ReadOnly ) )
+  {
+    return false;
+  }
+
+  //happens once, the whole document can be parsed
+  QDomDocument doc;
+  QString errorMsg;
+  if ( !doc.setContent( &xmlFile, &errorMsg ) )
+  {
+    QgsDebugMsg( "Error reading " + xmlPath + ": " + errorMsg );
+    return false;
+  }
+
+  bool migrated = false;
+  QDomElement serviceElem = doc.documentElement().firstChildElement( "service" );
+  for ( ; !serviceElem.isNull(); serviceElem = serviceElem.nextSiblingElement( "service" ) )
+  {
+    QVector<WebDataCatalogStore::LayerRecord> layers;
+    WebDataCatalogStore::ServiceRecord service = xmlServiceRecord( serviceElem, layers );
+    if ( store.writeService( service, layers ) )
+    {
+      migrated = true;
+    }
+  }
+  return migrated;
+}
+
+WebDataCatalogStore::ServiceRecord WebDataCatalogLoader::xmlServiceRecord( const QDomElement& serviceElem,
+    QVector<WebDataCatalogStore::LayerRecord>& layers )
+{
+  WebDataCatalogStore::ServiceRecord record;
+  record.title = serviceElem.attribute( "serviceName" );
+  record.url = serviceElem.attribute( "url" );
+  record.type = serviceElem.attribute( "type" );
+  record.version = serviceElem.attribute( "version" );
+  record.maxWidth = serviceElem.attribute( "maxWidth" ).toInt();
+  record.maxHeight = serviceElem.attribute( "maxHeight" ).toInt();
+
+  //older files don't store url and type of the service. Take them from the first layer. Formats are stored on the
+  //(non group) layers
+  QDomNodeList layerNodes = serviceElem.elementsByTagName( "layer" );
+  if ( !layerNodes.isEmpty() )
+  {
+    QDomElement firstLayerElem = layerNodes.at( 0 ).toElement();
+    if ( record.url.isEmpty() )
+    {
+      record.url = firstLayerElem.attribute( "url" );
+    }
+    if ( record.type.isEmpty() )
+    {
+      record.type = firstLayerElem.attribute( "type" );
+    }
+  }
+  for ( int i = 0; i < layerNodes.size() && record.formats.isEmpty(); ++i )
+  {
+    record.formats = layerNodes.at( i ).toElement().attribute( "formats" );
+  }
+
+  xmlLayerRecords( serviceElem, -1, layers );
+  return record;
+}
+
+void WebDataCatalogLoader::xmlLayerRecords( const QDomElement& parentElem, int parentPosition,
+    QVector<WebDataCatalogStore::LayerRecord>& records )
+{
+  QDomElement layerElem = parentElem.firstChildElement( "layer" );
+  for ( ; !layerElem.isNull(); layerElem = layerElem.nextSiblingElement( "layer" ) )
+  {
+    WebDataCatalogStore::LayerRecord record;
+    record.name = layerElem.attribute( "name" );
+    record.parent = parentPosition;
+    if ( layerElem.attribute( "group" ) == "1" )
+    {
+      record.flags = WebDataCatalogStore::GroupFlag;
+    }
+    else
+    {
+      if ( layerElem.attribute( "favourite" ).compare( "1" ) == 0 )
+      {
+        record.flags |= WebDataCatalogStore::FavouriteFlag;
+      }
+      if ( layerElem.attribute( "status" ).compare( "online", Qt::CaseInsensitive ) != 0 )
+      {
+        record.flags |= WebDataCatalogStore::OfflineFlag;
+      }
+      QStringList bbox = layerElem.attribute( "bbox" ).split( "," );
+      if ( bbox.size() == 4 )
+      {
+        record.flags |= WebDataCatalogStore::ExtentFlag;
+        record.west = bbox.at( 0 ).toFloat();
+        record.south = bbox.at( 1 ).toFloat();
+        record.east = bbox.at( 2 ).toFloat();
+        record.north = bbox.at( 3 ).toFloat();
+      }
+      record.title = layerElem.attribute( "title" );
+      record.abstract = layerElem.attribute( "abstract" );
+      record.crs = layerElem.attribute( "crs" );
+      record.styles = layerElem.attribute( "styles" );
+      record.keywords = layerElem.attribute( "keywords" );
+      record.filePath = layerElem.attribute( "filePath" );
+    }
+
+    int position = records.size();
+    records.append( record );
+    xmlLayerRecords( layerElem, position, records );
+  }
+}
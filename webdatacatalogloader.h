@@ -0,0 +1,55 @@
+#ifndef WEBDATACATALOGLOADER_H
+#define WEBDATACATALOGLOADER_H
+
+#include "webdatacatalogstore.h"
+#include <QHash>
+#include <QMetaType>
+#include <QObject>
+
+class QDomElement;
+
+/**Catalogue read by WebDataCatalogLoader*/
+struct WebDataCatalogData
+{
+  WebDataCatalogData(): databaseOk( false ) {}
+
+  /**False if the database could not be opened*/
+  bool databaseOk;
+  QList<WebDataCatalogStore::ServiceRecord> services;
+  /**Layers read in advance (services expanded in the dialog), by service title*/
+  QHash<QString, QVector<WebDataCatalogStore::LayerRecord> > layers;
+};
+
+Q_DECLARE_METATYPE( WebDataCatalogData )
+
+/**Reads the catalogue database in a worker thread, so QGIS does not wait for the plugin at startup. On the first start
+  with the database, the services of webdata.xml are migrated to it. The result is delivered with loadingFinished()*/
+class WebDataCatalogLoader: public QObject
+{
+    Q_OBJECT
+  public:
+    WebDataCatalogLoader();
+    ~WebDataCatalogLoader();
+
+    /**Returns the database records of a service element of webdata.xml and its layers*/
+    static WebDataCatalogStore::ServiceRecord xmlServiceRecord( const QDomElement& serviceElem,
+        QVector<WebDataCatalogStore::LayerRecord>& layers );
+    /**Appends the database records for the layer elements below parentElem in depth first order*/
+    static void xmlLayerRecords( const QDomElement& parentElem, int parentPosition,
+                                 QVector<WebDataCatalogStore::LayerRecord>& records );
+
+  public slots:
+    /**Opens the database (with its own connection), migrates webdata.xml if the database is empty and reads the
+      services. The layers of the services in preloadServices are read as well
+      @param preloadServices titles of the services shown expanded in the dialog*/
+    void load( const QString& databasePath, const QString& xmlPath, const QStringList& preloadServices );
+
+  signals:
+    void loadingFinished( const WebDataCatalogData& data );
+
+  private:
+    /**Writes the services of webdata.xml to the database. Returns false if no service was written*/
+    static bool migrateXML( WebDataCatalogStore& store, const QString& xmlPath );
+};
+
+#endif // WEBDATACATALOGLOADER_H
@@ -0,0 +1,496 @@
+#include "webdatacatalogstore.h"
+#include "webdatasearchindex.h"
+#include "qgslogger.h"
+#include <QVariant>
+
+static const int CATALOG_SCHEMA_VERSION = 3;
+//ms to wait for another QGIS instance writing to the database
+static const int CATALOG_BUSY_TIMEOUT = 5000;
+
+WebDataCatalogStore::WebDataCatalogStore()
+{
+}
+
+WebDataCatalogStore::~WebDataCatalogStore()
+{
+}
+
+bool WebDataCatalogStore::open( const QString& path )
+{
+  close();
+  sqlite3_database_unique_ptr database;
+  if ( database.open( path ) != SQLITE_OK )
+  {
+    QgsDebugMsg( "Cannot open " + path + ": " + database.errorMessage() );
+    return false;
+  }
+  mDatabase = std::move( database );
+  sqlite3_busy_timeout( mDatabase.get(), CATALOG_BUSY_TIMEOUT );
+
+  int version = schemaVersion();
+
+  //readers don't block the writer (and the other way round) in WAL mode
+  bool ok = exec( "PRAGMA journal_mode=WAL" );
+  ok = ok && exec( "CREATE TABLE IF NOT EXISTS services( id INTEGER PRIMARY KEY, position INTEGER NOT NULL, "
+                   "title TEXT NOT NULL UNIQUE, url TEXT, type TEXT, formats TEXT, version TEXT, "
+                   "max_width INTEGER NOT NULL DEFAULT 0, max_height INTEGER NOT NULL DEFAULT 0 )" );
+  //version 1 did not store the version of the capabilities
+  if ( ok && version == 1 )
+  {
+    ok = exec( "ALTER TABLE services ADD COLUMN version TEXT" );
+  }
+  //versions 1 and 2 did not store the image size limits of the services
+  if ( ok && version > 0 && version < 3 )
+  {
+    ok = exec( "ALTER TABLE services ADD COLUMN max_width INTEGER NOT NULL DEFAULT 0" )
+         && exec( "ALTER TABLE services ADD COLUMN max_height INTEGER NOT NULL DEFAULT 0" );
+  }
+  ok = ok && exec( "CREATE INDEX IF NOT EXISTS services_type ON services( type )" );
+  ok = ok && exec( "CREATE TABLE IF NOT EXISTS layers( id INTEGER PRIMARY KEY, service INTEGER NOT NULL, "
+                   "position INTEGER NOT NULL, parent INTEGER NOT NULL, name TEXT, title TEXT, abstract TEXT, crs TEXT, "
+                   "styles TEXT, keywords TEXT, file_path TEXT, grp INTEGER NOT NULL, favourite INTEGER NOT NULL, "
+                   "offline INTEGER NOT NULL, has_extent INTEGER NOT NULL, west REAL, south REAL, east REAL, north REAL )" );
+  ok = ok && exec( "CREATE INDEX IF NOT EXISTS layers_service ON layers( service, position )" );
+  ok = ok && exec( "CREATE INDEX IF NOT EXISTS layers_name ON layers( service, name )" );
+  ok = ok && exec( "CREATE INDEX IF NOT EXISTS layers_offline ON layers( offline )" );
+  ok = ok && exec( "CREATE INDEX IF NOT EXISTS layers_favourite ON layers( favourite )" );
+  ok = ok && exec( "CREATE VIRTUAL TABLE IF NOT EXISTS layers_fts USING fts4( name, title, abstract, keywords )" );
+  ok = ok && exec( "CREATE VIRTUAL TABLE IF NOT EXISTS layers_terms USING fts4aux( layers_fts )" );
+  ok = ok && exec( "CREATE VIRTUAL TABLE IF NOT EXISTS layers_rtree USING rtree( id, west, east, south, north )" );
+  ok = ok && exec( "CREATE TABLE IF NOT EXISTS meta( key TEXT PRIMARY KEY, value TEXT )" );
+  ok = ok && exec( QString( "PRAGMA user_version=%1" ).arg( CATALOG_SCHEMA_VERSION ) );
+  if ( !ok )
+  {
+    close();
+  }
+  return ok;
+}
+
+void WebDataCatalogStore::close()
+{
+  mDatabase.reset();
+}
+
+QList<WebDataCatalogStore::ServiceRecord> WebDataCatalogStore::services() const
+{
+  QList<ServiceRecord> result;
+  if ( !mDatabase )
+  {
+    return result;
+  }
+
+  int rc;
+  sqlite3_statement_unique_ptr statement = mDatabase.prepare( "SELECT s.title, s.url, s.type, s.formats, "
+      "s.version, s.max_width, s.max_height, ( SELECT COUNT(*) FROM layers l WHERE l.service = s.id ) FROM services s "
+      "ORDER BY s.position", rc );
+  if ( rc != SQLITE_OK )
+  {
+    return result;
+  }
+
+  while ( statement.step() == SQLITE_ROW )
+  {
+    ServiceRecord service;
+    service.title = statement.columnAsText( 0 );
+    service.url = statement.columnAsText( 1 );
+    service.type = statement.columnAsText( 2 );
+    service.formats = statement.columnAsText( 3 );
+    service.version = statement.columnAsText( 4 );
+    service.maxWidth = statement.columnAsInt64( 5 );
+    service.maxHeight = statement.columnAsInt64( 6 );
+    service.layerCount = statement.columnAsInt64( 7 );
+    result.append( service );
+  }
+  return result;
+}
+
+QVector<WebDataCatalogStore::LayerRecord> WebDataCatalogStore::layers( const QString& serviceTitle ) const
+{
+  QVector<LayerRecord> result;
+  if ( !mDatabase )
+  {
+    return result;
+  }
+
+  int rc;
+  sqlite3_statement_unique_ptr statement = mDatabase.prepare( "SELECT l.name, l.title, l.abstract, l.crs, l.styles, "
+      "l.keywords, l.file_path, l.parent, l.grp, l.favourite, l.offline, l.has_extent, l.west, l.south, l.east, l.north "
+      "FROM layers l JOIN services s ON s.id = l.service WHERE s.title = ? ORDER BY l.position", rc );
+  if ( rc != SQLITE_OK )
+  {
+    return result;
+  }
+
+  bindText( statement, 1, serviceTitle );
+  while ( statement.step() == SQLITE_ROW )
+  {
+    LayerRecord layer;
+    layer.name = statement.columnAsText( 0 );
+    layer.title = statement.columnAsText( 1 );
+    layer.abstract = statement.columnAsText( 2 );
+    layer.crs = statement.columnAsText( 3 );
+    layer.styles = statement.columnAsText( 4 );
+    layer.keywords = statement.columnAsText( 5 );
+    layer.filePath = statement.columnAsText( 6 );
+    layer.parent = statement.columnAsInt64( 7 );
+    layer.flags = ( statement.columnAsInt64( 8 ) ? GroupFlag : 0 ) | ( statement.columnAsInt64( 9 ) ? FavouriteFlag : 0 )
+                  | ( statement.columnAsInt64( 10 ) ? OfflineFlag : 0 ) | ( statement.columnAsInt64( 11 ) ? ExtentFlag : 0 );
+    layer.west = statement.columnAsDouble( 12 );
+    layer.south = statement.columnAsDouble( 13 );
+    layer.east = statement.columnAsDouble( 14 );
+    layer.north = statement.columnAsDouble( 15 );
+    result.append( layer );
+  }
+  return result;
+}
+
+bool WebDataCatalogStore::writeService( const ServiceRecord& service, const QVector<LayerRecord>& layers )
+{
+  //IMMEDIATE takes the write lock at once (or waits for the other instance), so the transaction cannot fail later
+  if ( !mDatabase || !exec( "BEGIN IMMEDIATE" ) )
+  {
+    return false;
+  }
+
+  int rc;
+  qint64 serviceId = -1;
+  sqlite3_statement_unique_ptr selectStatement = mDatabase.prepare( "SELECT id FROM services WHERE title = ?", rc );
+  bool ok = ( rc == SQLITE_OK );
+  if ( ok )
+  {
+    bindText( selectStatement, 1, service.title );
+    if ( selectStatement.step() == SQLITE_ROW )
+    {
+      serviceId = selectStatement.columnAsInt64( 0 );
+    }
+  }
+
+  sqlite3_statement_unique_ptr serviceStatement = mDatabase.prepare( ( serviceId < 0 ) ?
+      "INSERT INTO services( url, type, formats, version, max_width, max_height, title, position ) "
+      "VALUES( ?, ?, ?, ?, ?, ?, ?, ( SELECT COALESCE( MAX( position ), 0 ) + 1 FROM services ) )" :
+      "UPDATE services SET url = ?, type = ?, formats = ?, version = ?, max_width = ?, max_height = ? WHERE title = ?", rc );
+  ok = ok && ( rc == SQLITE_OK );
+  if ( ok )
+  {
+    bindText( serviceStatement, 1, service.url );
+    bindText( serviceStatement, 2, service.type );
+    bindText( serviceStatement, 3, service.formats );
+    bindText( serviceStatement, 4, service.version );
+    sqlite3_bind_int( serviceStatement.get(), 5, service.maxWidth );
+    sqlite3_bind_int( serviceStatement.get(), 6, service.maxHeight );
+    bindText( serviceStatement, 7, service.title );
+    ok = ( serviceStatement.step() == SQLITE_DONE );
+  }
+  if ( ok && serviceId < 0 )
+  {
+    serviceId = sqlite3_last_insert_rowid( mDatabase.get() );
+  }
+  else
+  {
+    ok = ok && deleteLayers( serviceId );
+  }
+
+  sqlite3_statement_unique_ptr layerStatement = mDatabase.prepare( "INSERT INTO layers( service, position, parent, name, "
+      "title, abstract, crs, styles, keywords, file_path, grp, favourite, offline, has_extent, west, south, east, north ) "
+      "VALUES( ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ? )", rc );
+  ok = ok && ( rc == SQLITE_OK );
+  sqlite3_statement_unique_ptr ftsStatement = mDatabase.prepare( "INSERT INTO layers_fts( docid, name, title, abstract, "
+      "keywords ) VALUES( ?, ?, ?, ?, ? )", rc );
+  ok = ok && ( rc == SQLITE_OK );
+  sqlite3_statement_unique_ptr rtreeStatement = mDatabase.prepare( "INSERT INTO layers_rtree( id, west, east, south, "
+      "north ) VALUES( ?, ?, ?, ?, ? )", rc );
+  ok = ok && ( rc == SQLITE_OK );
+
+  for ( int i = 0; ok && i < layers.size(); ++i )
+  {
+    const LayerRecord& layer = layers.at( i );
+    sqlite3_reset( layerStatement.get() );
+    sqlite3_bind_int64( layerStatement.get(), 1, serviceId );
+    sqlite3_bind_int( layerStatement.get(), 2, i );
+    sqlite3_bind_int( layerStatement.get(), 3, layer.parent );
+    bindText( layerStatement, 4, layer.name );
+    bindText( layerStatement, 5, layer.title );
+    bindText( layerStatement, 6, layer.abstract );
+    bindText( layerStatement, 7, layer.crs );
+    bindText( layerStatement, 8, layer.styles );
+    bindText( layerStatement, 9, layer.keywords );
+    bindText( layerStatement, 10, layer.filePath );
+    sqlite3_bind_int( layerStatement.get(), 11, ( layer.flags & GroupFlag ) ? 1 : 0 );
+    sqlite3_bind_int( layerStatement.get(), 12, ( layer.flags & FavouriteFlag ) ? 1 : 0 );
+    sqlite3_bind_int( layerStatement.get(), 13, ( layer.flags & OfflineFlag ) ? 1 : 0 );
+    sqlite3_bind_int( layerStatement.get(), 14, ( layer.flags & ExtentFlag ) ? 1 : 0 );
+    sqlite3_bind_double( layerStatement.get(), 15, layer.west );
+    sqlite3_bind_double( layerStatement.get(), 16, layer.south );
+    sqlite3_bind_double( layerStatement.get(), 17, layer.east );
+    sqlite3_bind_double( layerStatement.get(), 18, layer.north );
+    ok = ( layerStatement.step() == SQLITE_DONE );
+    qint64 layerId = sqlite3_last_insert_rowid( mDatabase.get() );
+
+    //the texts are indexed as the words of the in-memory search index
+    sqlite3_reset( ftsStatement.get() );
+    sqlite3_bind_int64( ftsStatement.get(), 1, layerId );
+    bindText( ftsStatement, 2, WebDataSearchIndex::tokenize( layer.name ).join( " " ) );
+    bindText( ftsStatement, 3, WebDataSearchIndex::tokenize( layer.title ).join( " " ) );
+    bindText( ftsStatement, 4, WebDataSearchIndex::tokenize( layer.abstract ).join( " " ) );
+    bindText( ftsStatement, 5, WebDataSearchIndex::tokenize( layer.keywords ).join( " " ) );
+    ok = ok && ( ftsStatement.step() == SQLITE_DONE );
+
+    if ( ok && ( layer.flags & ExtentFlag ) )
+    {
+      //extents crossing the antimeridian are taken as the whole longitude range
+      bool wrapped = ( layer.west > layer.east );
+      sqlite3_reset( rtreeStatement.get() );
+      sqlite3_bind_int64( rtreeStatement.get(), 1, layerId );
+      sqlite3_bind_double( rtreeStatement.get(), 2, wrapped ? -180.0 : layer.west );
+      sqlite3_bind_double( rtreeStatement.get(), 3, wrapped ? 180.0 : layer.east );
+      sqlite3_bind_double( rtreeStatement.get(), 4, qMin( layer.south, layer.north ) );
+      sqlite3_bind_double( rtreeStatement.get(), 5, qMax( layer.south, layer.north ) );
+      ok = ( rtreeStatement.step() == SQLITE_DONE );
+    }
+  }
+
+  if ( !ok )
+  {
+    QgsDebugMsg( "Error writing service " + service.title + ": " + mDatabase.errorMessage() );
+    exec( "ROLLBACK" );
+    return false;
+  }
+  return exec( "COMMIT" );
+}
+
+bool WebDataCatalogStore::removeService( const QString& serviceTitle )
+{
+  if ( !mDatabase || !exec( "BEGIN IMMEDIATE" ) )
+  {
+    return false;
+  }
+
+  int rc;
+  sqlite3_statement_unique_ptr statement = mDatabase.prepare( "SELECT id FROM services WHERE title = ?", rc );
+  bool ok = ( rc == SQLITE_OK );
+  if ( ok )
+  {
+    bindText( statement, 1, serviceTitle );
+    if ( statement.step() == SQLITE_ROW )
+    {
+      qint64 serviceId = statement.columnAsInt64( 0 );
+      ok = deleteLayers( serviceId ) && execWithId( "DELETE FROM services WHERE id = ?", serviceId );
+    }
+  }
+
+  if ( !ok )
+  {
+    exec( "ROLLBACK" );
+    return false;
+  }
+  return exec( "COMMIT" );
+}
+
+QString WebDataCatalogStore::metaValue( const QString& key ) const
+{
+  if ( !mDatabase )
+  {
+    return QString();
+  }
+
+  int rc;
+  sqlite3_statement_unique_ptr statement = mDatabase.prepare( "SELECT value FROM meta WHERE key = ?", rc );
+  if ( rc != SQLITE_OK )
+  {
+    return QString();
+  }
+  bindText( statement, 1, key );
+  if ( statement.step() != SQLITE_ROW )
+  {
+    return QString();
+  }
+  return statement.columnAsText( 0 );
+}
+
+bool WebDataCatalogStore::setMetaValue( const QString& key, const QString& value )
+{
+  if ( !mDatabase )
+  {
+    return false;
+  }
+
+  int rc;
+  sqlite3_statement_unique_ptr statement = mDatabase.prepare( "INSERT OR REPLACE INTO meta( key, value ) VALUES( ?, ? )", rc );
+  if ( rc != SQLITE_OK )
+  {
+    return false;
+  }
+  bindText( statement, 1, key );
+  bindText( statement, 2, value );
+  return ( statement.step() == SQLITE_DONE );
+}
+
+bool WebDataCatalogStore::writeLayerState( const QString& serviceTitle, const QString& layerName, quint32 flags,
+    const QString& filePath )
+{
+  if ( !mDatabase )
+  {
+    return false;
+  }
+
+  int rc;
+  sqlite3_statement_unique_ptr statement = mDatabase.prepare( "UPDATE layers SET favourite = ?, offline = ?, file_path = ? "
+      "WHERE grp = 0 AND name = ? AND service = ( SELECT id FROM services WHERE title = ? )", rc );
+  if ( rc != SQLITE_OK )
+  {
+    return false;
+  }
+  sqlite3_bind_int( statement.get(), 1, ( flags & FavouriteFlag ) ? 1 : 0 );
+  sqlite3_bind_int( statement.get(), 2, ( flags & OfflineFlag ) ? 1 : 0 );
+  bindText( statement, 3, filePath );
+  bindText( statement, 4, layerName );
+  bindText( statement, 5, serviceTitle );
+  return ( statement.step() == SQLITE_DONE );
+}
+
+QSet<QString> WebDataCatalogStore::servicesWithLayers( const LayerQuery& query ) const
+{
+  QSet<QString> result;
+  if ( !mDatabase )
+  {
+    return result;
+  }
+
+  QString sql = "SELECT DISTINCT s.title FROM layers l JOIN services s ON s.id = l.service WHERE 1";
+  QVariantList values;
+  if ( !query.serviceType.isEmpty() )
+  {
+    sql += " AND s.type = ?";
+    values << query.serviceType;
+  }
+  if ( query.onlyFavourites )
+  {
+    sql += " AND l.favourite = 1";
+  }
+  if ( query.onlyOffline )
+  {
+    sql += " AND l.offline = 1";
+  }
+  if ( query.onlyOnline )
+  {
+    sql += " AND l.offline = 0";
+  }
+  if ( !query.crs.isEmpty() )
+  {
+    sql += " AND l.crs LIKE ?";
+    values << QString( "%" + query.crs + "%" );
+  }
+  if ( query.inExtent )
+  {
+    sql += " AND l.id IN ( SELECT id FROM layers_rtree WHERE west <= ? AND east >= ? AND south <= ? AND north >= ? )";
+    values << query.extent.xMaximum() << query.extent.xMinimum() << query.extent.yMaximum() << query.extent.yMinimum();
+  }
+  QStringList::const_iterator termIt = query.terms.constBegin();
+  for ( ; termIt != query.terms.constEnd(); ++termIt )
+  {
+    QString match = termQuery( *termIt );
+    if ( match.isEmpty() )
+    {
+      return result;
+    }
+    sql += " AND l.id IN ( SELECT docid FROM layers_fts WHERE layers_fts MATCH ? )";
+    values << match;
+  }
+
+  int rc;
+  sqlite3_statement_unique_ptr statement = mDatabase.prepare( sql, rc );
+  if ( rc != SQLITE_OK )
+  {
+    return result;
+  }
+  for ( int i = 0; i < values.size(); ++i )
+  {
+    if ( values.at( i ).type() == QVariant::Double )
+    {
+      sqlite3_bind_double( statement.get(), i + 1, values.at( i ).toDouble() );
+    }
+    else
+    {
+      bindText( statement, i + 1, values.at( i ).toString() );
+    }
+  }
+
+  while ( statement.step() == SQLITE_ROW )
+  {
+    result.insert( statement.columnAsText( 0 ) );
+  }
+  return result;
+}
+
+QString WebDataCatalogStore::termQuery( const QString& term ) const
+{
+  //short terms match the beginning of words (as in WebDataSearchIndex)
+  if ( term.size() < 3 )
+  {
+    return term + "*";
+  }
+
+  //longer terms match inside words. The words are taken from the vocabulary of the full text index
+  int rc;
+  sqlite3_statement_unique_ptr statement = mDatabase.prepare( "SELECT term FROM layers_terms WHERE col = '*' "
+      "AND instr( term, ? ) > 0", rc );
+  if ( rc != SQLITE_OK )
+  {
+    return QString();
+  }
+  bindText( statement, 1, term );
+  QStringList words;
+  while ( statement.step() == SQLITE_ROW )
+  {
+    words.append( statement.columnAsText( 0 ) );
+  }
+  return words.join( " OR " );
+}
+
+bool WebDataCatalogStore::deleteLayers( qint64 serviceId )
+{
+  return execWithId( "DELETE FROM layers_fts WHERE docid IN ( SELECT id FROM layers WHERE service = ? )", serviceId )
+         && execWithId( "DELETE FROM layers_rtree WHERE id IN ( SELECT id FROM layers WHERE service = ? )", serviceId )
+         && execWithId( "DELETE FROM layers WHERE service = ?", serviceId );
+}
+
+bool WebDataCatalogStore::exec( const QString& sql ) const
+{
+  char* errorMessage = 0;
+  if ( sqlite3_exec( mDatabase.get(), sql.toUtf8().constData(), 0, 0, &errorMessage ) != SQLITE_OK )
+  {
+    QgsDebugMsg( "SQLite error in '" + sql + "': " + QString::fromUtf8( errorMessage ) );
+    sqlite3_free( errorMessage );
+    return false;
+  }
+  return true;
+}
+
+bool WebDataCatalogStore::execWithId( const QString& sql, qint64 id ) const
+{
+  int rc;
+  sqlite3_statement_unique_ptr statement = mDatabase.prepare( sql, rc );
+  if ( rc != SQLITE_OK )
+  {
+    return false;
+  }
+  sqlite3_bind_int64( statement.get(), 1, id );
+  return ( statement.step() == SQLITE_DONE );
+}
+
+int WebDataCatalogStore::schemaVersion() const
+{
+  int rc;
+  sqlite3_statement_unique_ptr statement = mDatabase.prepare( "PRAGMA user_version", rc );
+  if ( rc != SQLITE_OK || statement.step() != SQLITE_ROW )
+  {
+    return 0;
+  }
+  return statement.columnAsInt64( 0 );
+}
+
+void WebDataCatalogStore::bindText( sqlite3_statement_unique_ptr& statement, int index, const QString& text )
+{
+  QByteArray utf8 = text.toUtf8();
+  sqlite3_bind_text( statement.get(), index, utf8.constData(), utf8.size(), SQLITE_TRANSIENT );
+}
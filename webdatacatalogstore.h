@@ -0,0 +1,130 @@
+#ifndef WEBDATACATALOGSTORE_H
+#define WEBDATACATALOGSTORE_H
+
+#include "qgsrectangle.h"
+#include "qgssqliteutils.h"
+#include <QList>
+#include <QSet>
+#include <QStringList>
+#include <QVector>
+
+/**SQLite database with the services and layers of the catalogue (webdata.sqlite). Every change is written in its own
+  transaction, so the database is always consistent, even after a crash. The database runs in WAL mode with a busy
+  timeout, so several QGIS instances can use it at the same time.
+  Besides the tables, the database has a full text index (FTS4) over the layer texts and an R*Tree over the layer
+  extents. Together with the indices on type, status and favourite, they allow to find the services with matching
+  layers without loading the layers*/
+class WebDataCatalogStore
+{
+  public:
+    /**Layer flags*/
+    enum Flag
+    {
+      GroupFlag = 1,
+      FavouriteFlag = 2,
+      OfflineFlag = 4,
+      ExtentFlag = 8
+    };
+
+    struct ServiceRecord
+    {
+      ServiceRecord(): maxWidth( 0 ), maxHeight( 0 ), layerCount( 0 ) {}
+
+      QString title;
+      QString url;
+      QString type;
+      /**Comma separated GetMap formats*/
+      QString formats;
+      /**Version of the capabilities document*/
+      QString version;
+      /**Largest GetMap image the server accepts (0 if not advertised)*/
+      int maxWidth;
+      int maxHeight;
+      /**Number of layers of the service in the database*/
+      int layerCount;
+    };
+
+    /**Layers of a service are stored in depth first order, so parents come before their sublayers and siblings
+      are in row order*/
+    struct LayerRecord
+    {
+      LayerRecord(): parent( -1 ), flags( 0 ), west( 0 ), south( 0 ), east( 0 ), north( 0 ) {}
+
+      QString name;
+      QString title;
+      QString abstract;
+      /**Comma separated lists*/
+      QString crs;
+      QString styles;
+      QString keywords;
+      QString filePath;
+      /**Position of the parent in the layers of the service (-1 for top level layers)*/
+      int parent;
+      quint32 flags;
+      float west;
+      float south;
+      float east;
+      float north;
+    };
+
+    /**Conditions a layer needs to meet (see servicesWithLayers()). Empty values don't restrict*/
+    struct LayerQuery
+    {
+      LayerQuery(): onlyFavourites( false ), onlyOffline( false ), onlyOnline( false ), inExtent( false ) {}
+
+      /**All terms need to occur in name, title, abstract or keywords (inside words for terms from three characters)*/
+      QStringList terms;
+      QString serviceType;
+      /**Authority id of a supported CRS*/
+      QString crs;
+      bool onlyFavourites;
+      bool onlyOffline;
+      bool onlyOnline;
+      bool inExtent;
+      /**WGS 84 extent the layer needs to intersect if inExtent is set*/
+      QgsRectangle extent;
+    };
+
+    WebDataCatalogStore();
+    ~WebDataCatalogStore();
+
+    /**Opens (or creates) the database and the tables*/
+    bool open( const QString& path );
+    void close();
+    bool isOpen() const { return static_cast<bool>( mDatabase ); }
+
+    /**Services in catalogue order with the number of their layers*/
+    QList<ServiceRecord> services() const;
+    /**Layers of a service in depth first order*/
+    QVector<LayerRecord> layers( const QString& serviceTitle ) const;
+
+    /**Inserts a service or replaces it (with all its layers). A new service is appended to the catalogue order*/
+    bool writeService( const ServiceRecord& service, const QVector<LayerRecord>& layers );
+    bool removeService( const QString& serviceTitle );
+    /**Updates favourite / offline flag and offline file of a (non group) layer*/
+    bool writeLayerState( const QString& serviceTitle, const QString& layerName, quint32 flags, const QString& filePath );
+
+    /**Value stored under key in the meta table (empty if there is none)*/
+    QString metaValue( const QString& key ) const;
+    bool setMetaValue( const QString& key, const QString& value );
+
+    /**Returns the titles of the services having at least one layer which meets the conditions*/
+    QSet<QString> servicesWithLayers( const LayerQuery& query ) const;
+
+  private:
+    sqlite3_database_unique_ptr mDatabase;
+
+    bool exec( const QString& sql ) const;
+    /**Runs a statement with a single id parameter*/
+    bool execWithId( const QString& sql, qint64 id ) const;
+    /**Returns the user_version of the database (0 for a new database)*/
+    int schemaVersion() const;
+    /**Returns the full text query for a term: the words of the index containing it (or starting with it for short
+      terms). Empty if no word matches*/
+    QString termQuery( const QString& term ) const;
+    /**Deletes the layers of a service from the tables and indices*/
+    bool deleteLayers( qint64 serviceId );
+    static void bindText( sqlite3_statement_unique_ptr& statement, int index, const QString& text );
+};
+
+#endif // WEBDATACATALOGSTORE_H
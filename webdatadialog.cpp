@@ -1,9 +1,14 @@
 #include "webdatadialog.h"
 #include "addservicedialog.h"
 #include "qgisinterface.h"
+#include "qgscoordinatetransform.h"
+#include "qgscsexception.h"
 #include "qgsmapcanvas.h"
 #include "qgsnetworkaccessmanager.h"
+#include "qgsproject.h"
 #include <QDomDocument>
+#include <QFileDialog>
+#include <QFileInfo>
 #include <QInputDialog>
 #include <QItemSelectionModel>
 #include <QKeyEvent>
@@ -23,33 +28,65 @@ WebDataDialog::WebDataDialog( QgisInterface* iface, QWidget* parent, Qt::WindowF
   mFilterModel.setFilterKeyColumn( -1 );
   mFilterModel.setFilterCaseSensitivity( Qt::CaseInsensitive );
   mLayersTreeView->setModel( &mFilterModel );
+  mLayersTreeView->setSelectionMode( QAbstractItemView::ExtendedSelection );
   connect( mLayersTreeView, SIGNAL( customContextMenuRequested( const QPoint& ) ), this, SLOT( showContextMenu( const QPoint& ) ) );
-  connect( &mModel, SIGNAL( serviceAdded() ), this, SLOT( resetStateAndCursor() ) );
+  connect( &mModel, SIGNAL( serviceAdded() ), this, SLOT( handleServiceAdded() ) );
+  connect( &mModel, SIGNAL( serviceRequestFailed( const QString&, const QString& ) ), this, SLOT( handleServiceRequestFailed( const QString&, const QString& ) ) );
+  connect( &mModel, SIGNAL( offlineJobFailed( const QString&, const QString& ) ), this,
+           SLOT( handleOfflineJobFailed( const QString&, const QString& ) ) );
   QSettings s;
+  mSearchTimer.setSingleShot( true );
+  mSearchTimer.setInterval( s.value( "/NIWA/searchDelay", 250 ).toInt() );
+  connect( &mSearchTimer, SIGNAL( timeout() ), this, SLOT( applySearch() ) );
+
+  //facets
+  mTypeFacetComboBox->addItem( tr( "All" ), QString() );
+  mTypeFacetComboBox->addItem( "WMS", "WMS" );
+  mTypeFacetComboBox->addItem( "WFS", "WFS" );
+  mStatusFacetComboBox->addItem( tr( "All" ), QString() );
+  mStatusFacetComboBox->addItem( tr( "Online" ), "online" );
+  mStatusFacetComboBox->addItem( tr( "Offline" ), "offline" );
+  connect( mTypeFacetComboBox, SIGNAL( currentIndexChanged( int ) ), this, SLOT( updateFacets() ) );
+  connect( mStatusFacetComboBox, SIGNAL( currentIndexChanged( int ) ), this, SLOT( updateFacets() ) );
+  connect( mInMapFacetCheckBox, SIGNAL( toggled( bool ) ), this, SLOT( updateFacets() ) );
+  connect( mMapCrsFacetCheckBox, SIGNAL( toggled( bool ) ), this, SLOT( updateFacets() ) );
+  mExtentTimer.setSingleShot( true );
+  mExtentTimer.setInterval( s.value( "/NIWA/searchDelay", 250 ).toInt() );
+  connect( &mExtentTimer, SIGNAL( timeout() ), this, SLOT( updateExtentFilter() ) );
+  connect( mExtentFacetCheckBox, SIGNAL( toggled( bool ) ), this, SLOT( updateExtentFilter() ) );
+  connect( mSortByOverlapCheckBox, SIGNAL( toggled( bool ) ), this, SLOT( updateExtentFilter() ) );
+  if ( mIface && mIface->mapCanvas() )
+  {
+    connect( mIface->mapCanvas(), SIGNAL( destinationCrsChanged() ), this, SLOT( updateFacets() ) );
+    connect( mIface->mapCanvas(), SIGNAL( extentsChanged() ), &mExtentTimer, SLOT( start() ) );
+  }
   mOnlyFavouritesCheckBox->setCheckState( s.value( "/NIWA/showOnlyFavourites", "false" ).toBool() ? Qt::Checked : Qt::Unchecked );
 
-  //expand items
-  QStringList expandedServices = s.value( "/NIWA/expandedServices" ).toStringList();
-  QSet<QString> expanded = expandedServices.toSet();
-  int nChildren = mFilterModel.rowCount();
-  for ( int i = 0; i < nChildren; ++i )
-  {
-    QModelIndex idx = mFilterModel.index( i, 0 );
-    if ( expanded.contains( mModel.itemFromIndex( mFilterModel.mapToSource( idx ) )->text() ) )
-    {
-      mLayersTreeView->setExpanded( idx, true );
-    }
-  }
+  //the catalogue is still being read in the background (see setCatalogue())
+  mServiceGroupBox->setEnabled( false );
+  mLayersTreeView->setEnabled( false );
+  mStatusLabel->setText( tr( "Loading catalogue..." ) );
 
   mContextMenu = new QMenu();
   mContextMenu->addAction( QIcon( ":/niwa/icons/remove_from_list.png" ), tr( "Delete" ), this, SLOT( deleteEntry( ) ) );
   mContextMenu->addAction( QIcon( ":/niwa/icons/refresh.png" ), tr( "Update" ), this, SLOT( updateEntry() ) );
+  mContextMenu->addAction( QIcon( ":/niwa/icons/refresh.png" ), tr( "Refresh all services" ), this, SLOT( refreshAllServices() ) );
+  mContextMenu->addAction( QIcon( ":/niwa/icons/offline.png" ), tr( "Take selected offline" ), this, SLOT( takeSelectedOffline() ) );
+  mContextMenu->addSeparator();
+  mContextMenu->addAction( tr( "Import catalogue..." ), this, SLOT( importCatalogue() ) );
+  mContextMenu->addAction( tr( "Export catalogue..." ), this, SLOT( exportCatalogue() ) );
 }
 
 WebDataDialog::~WebDataDialog()
 {
   QSettings s;
   s.setValue( "/NIWA/showOnlyFavourites", mOnlyFavouritesCheckBox->isChecked() );
+  if ( !mModel.isCatalogueLoaded() )
+  {
+    //nothing has been expanded, keep the stored state
+    delete mContextMenu;
+    return;
+  }
 
   //store names of expanded items
   QStringList expandedServices;
@@ -58,13 +95,37 @@ WebDataDialog::~WebDataDialog()
   {
     if ( mLayersTreeView->isExpanded( mFilterModel.index( i, 0 ) ) )
     {
-      expandedServices.append( mModel.itemFromIndex( mFilterModel.mapToSource( mFilterModel.index( i, 0 ) ) )->text() );
+      expandedServices.append( mFilterModel.index( i, 0 ).data().toString() );
     }
   }
   s.setValue( "/NIWA/expandedServices", expandedServices );
   delete mContextMenu;
 }
 
+void WebDataDialog::setCatalogue( const WebDataCatalogData& data )
+{
+  mModel.setCatalogue( data );
+  mServiceGroupBox->setEnabled( true );
+  mLayersTreeView->setEnabled( true );
+  mStatusLabel->setText( tr( "Ready" ) );
+
+  //filters set while loading need to see the new services
+  mFilterModel.refreshSearch();
+
+  //expand items
+  QSettings s;
+  QSet<QString> expanded = s.value( "/NIWA/expandedServices" ).toStringList().toSet();
+  int nChildren = mFilterModel.rowCount();
+  for ( int i = 0; i < nChildren; ++i )
+  {
+    QModelIndex idx = mFilterModel.index( i, 0 );
+    if ( expanded.contains( idx.data().toString() ) )
+    {
+      mLayersTreeView->setExpanded( idx, true );
+    }
+  }
+}
+
 void WebDataDialog::on_mConnectPushButton_clicked()
 {
   QApplication::setOverrideCursor( QCursor( Qt::WaitCursor ) );
@@ -360,24 +421,82 @@ void WebDataDialog::on_mOnlyFavouritesCheckBox_stateChanged( int state )
 
 void WebDataDialog::on_mSearchTableEdit_textChanged( const QString&  text )
 {
-  mFilterModel._setFilterWildcard( text );
+  Q_UNUSED( text );
+  //search when typing pauses, not on each key stroke
+  mSearchTimer.start();
+}
+
+void WebDataDialog::applySearch()
+{
+  mFilterModel._setFilterWildcard( mSearchTableEdit->text() );
+}
+
+void WebDataDialog::updateFacets()
+{
+  WebDataModel::FacetFilter filter;
+  filter.serviceType = mTypeFacetComboBox->itemData( mTypeFacetComboBox->currentIndex() ).toString();
+  filter.status = mStatusFacetComboBox->itemData( mStatusFacetComboBox->currentIndex() ).toString();
+  filter.onlyInMap = mInMapFacetCheckBox->isChecked();
+  if ( mMapCrsFacetCheckBox->isChecked() && mIface && mIface->mapCanvas() )
+  {
+    filter.crs = mIface->mapCanvas()->mapSettings().destinationCrs().authid();
+  }
+  mFilterModel.setFacetFilter( filter );
+}
+
+void WebDataDialog::updateExtentFilter()
+{
+  bool onlyInExtent = mExtentFacetCheckBox->isChecked();
+  bool sortByOverlap = mSortByOverlapCheckBox->isChecked();
+  QgsRectangle extent;
+  if ( ( onlyInExtent || sortByOverlap ) && mIface && mIface->mapCanvas() )
+  {
+    QgsMapCanvas* canvas = mIface->mapCanvas();
+    QgsCoordinateTransform ct( canvas->mapSettings().destinationCrs(), QgsCoordinateReferenceSystem( "EPSG:4326" ),
+                               QgsProject::instance() );
+    try
+    {
+      extent = ct.transformBoundingBox( canvas->extent() );
+    }
+    catch ( QgsCsException& )
+    {
+      extent = QgsRectangle();
+    }
+  }
+
+  if ( extent.isNull() )
+  {
+    //without a usable map extent, don't hide everything
+    onlyInExtent = false;
+    sortByOverlap = false;
+  }
+  mFilterModel.setExtentFilter( extent, onlyInExtent, sortByOverlap );
 }
 
 void WebDataDialog::on_mLayersTreeView_clicked( const QModelIndex& index )
 {
   QModelIndex srcIndex = mFilterModel.mapToSource( index );
-  QStandardItem* item = mModel.itemFromIndex( srcIndex );
-  if ( !item || item->column() != 4 )
+  if ( !srcIndex.isValid() || srcIndex.column() != WebDataModel::StatusColumn )
   {
     return;
   }
 
-  if ( item->text().compare( "online", Qt::CaseInsensitive ) == 0 )
+  QString status = mModel.layerStatus( srcIndex );
+  if ( mModel.offlineJobRunning( srcIndex ) )
   {
-    mStatusLabel->setText( tr( "Saving layer offline..." ) );
+    if ( QMessageBox::question( this, tr( "Cancel download" ), tr( "Stop taking %1 offline?" )
+                                .arg( srcIndex.sibling( srcIndex.row(), 0 ).data().toString() ) ) == QMessageBox::Yes )
+    {
+      mModel.cancelOfflineJob( srcIndex );
+    }
+    return;
+  }
+  else if ( status.compare( "online", Qt::CaseInsensitive ) == 0 )
+  {
+    //the layer is written in the background, the status column shows the progress
     mModel.changeEntryToOffline( srcIndex.sibling( srcIndex.row(), 0 ) );
   }
-  else if ( item->text().compare( "offline", Qt::CaseInsensitive ) == 0 )
+  else if ( status.compare( "offline", Qt::CaseInsensitive ) == 0 )
   {
     mStatusLabel->setText( tr( "Changing layer to online..." ) );
     mModel.changeEntryToOnline( srcIndex.sibling( srcIndex.row(), 0 ) );
@@ -391,6 +510,44 @@ void WebDataDialog::resetStateAndCursor()
   QApplication::restoreOverrideCursor();
 }
 
+void WebDataDialog::handleOfflineJobFailed( const QString& layerName, const QString& errorMessage )
+{
+  mStatusLabel->setText( tr( "%1 could not be taken offline: %2" ).arg( layerName ).arg( errorMessage ) );
+}
+
+void WebDataDialog::handleServiceAdded()
+{
+  resetStateAndCursor();
+  mFilterModel.refreshSearch();
+  int nRequests = mModel.pendingCapabilitiesRequests();
+  if ( nRequests > 0 )
+  {
+    mStatusLabel->setText( tr( "Retrieving service capabilities (%1 pending)..." ).arg( nRequests ) );
+  }
+}
+
+void WebDataDialog::handleServiceRequestFailed( const QString& title, const QString& errorMessage )
+{
+  resetStateAndCursor();
+  QString text = tr( "The capabilities of %1 could not be retrieved: %2" ).arg( title ).arg( errorMessage );
+  int nRequests = mModel.pendingCapabilitiesRequests();
+  if ( nRequests > 0 )
+  {
+    text.append( " " ).append( tr( "(%1 pending)" ).arg( nRequests ) );
+  }
+  mStatusLabel->setText( text );
+}
+
+void WebDataDialog::refreshAllServices()
+{
+  mModel.refreshAllServices();
+  int nRequests = mModel.pendingCapabilitiesRequests();
+  if ( nRequests > 0 )
+  {
+    mStatusLabel->setText( tr( "Retrieving service capabilities (%1 pending)..." ).arg( nRequests ) );
+  }
+}
+
 void WebDataDialog::keyPressEvent( QKeyEvent* event )
 {
   if ( event->key() != Qt::Key_Delete && event->key() != Qt::Key_F5 )
@@ -478,6 +635,57 @@ void WebDataDialog::showContextMenu( const QPoint&  point )
   }
 }
 
+void WebDataDialog::importCatalogue()
+{
+  QSettings s;
+  QString path = QFileDialog::getOpenFileName( this, tr( "Import catalogue" ), s.value( "/NIWA/catalogueDir" ).toString(),
+                 tr( "XML files (*.xml)" ) );
+  if ( path.isEmpty() )
+  {
+    return;
+  }
+  s.setValue( "/NIWA/catalogueDir", QFileInfo( path ).absolutePath() );
+
+  if ( !mModel.importFromXML( path ) )
+  {
+    QMessageBox::critical( this, tr( "Import failed" ), tr( "The catalogue could not be read from %1" ).arg( path ) );
+  }
+}
+
+void WebDataDialog::exportCatalogue()
+{
+  QSettings s;
+  QString path = QFileDialog::getSaveFileName( this, tr( "Export catalogue" ), s.value( "/NIWA/catalogueDir" ).toString(),
+                 tr( "XML files (*.xml)" ) );
+  if ( path.isEmpty() )
+  {
+    return;
+  }
+  s.setValue( "/NIWA/catalogueDir", QFileInfo( path ).absolutePath() );
+
+  QApplication::setOverrideCursor( QCursor( Qt::WaitCursor ) );
+  bool exported = mModel.exportToXML( path );
+  QApplication::restoreOverrideCursor();
+  if ( !exported )
+  {
+    QMessageBox::critical( this, tr( "Export failed" ), tr( "The catalogue could not be written to %1" ).arg( path ) );
+  }
+}
+
+void WebDataDialog::takeSelectedOffline()
+{
+  QModelIndexList layerIndexes;
+  QModelIndexList selectList = mLayersTreeView->selectionModel()->selectedRows( 0 );
+  QModelIndexList::const_iterator selectIt = selectList.constBegin();
+  for ( ; selectIt != selectList.constEnd(); ++selectIt )
+  {
+    layerIndexes.append( mFilterModel.mapToSource( *selectIt ) );
+  }
+
+  //the jobs are queued, the status column shows their progress
+  mModel.changeEntriesToOffline( layerIndexes );
+}
+
 QModelIndex WebDataDialog::selectedModelIndex() const
 {
   //find selected model index
@@ -4,6 +4,7 @@
 #include "ui_webdatadialogbase.h"
 #include "webdatafiltermodel.h"
 #include "webdatamodel.h"
+#include <QTimer>
 
 class QgisInterface;
 
@@ -14,6 +15,9 @@ class WebDataDialog: public QDialog, private Ui::WebDataDialogBase
     WebDataDialog( QgisInterface* iface, QWidget* parent = 0, Qt::WindowFlags f = 0 );
     ~WebDataDialog();
 
+    /**Fills the model with the catalogue read in the background and ends the loading state*/
+    void setCatalogue( const WebDataCatalogData& data );
+
   private slots:
     void on_mConnectPushButton_clicked();
     void on_mAddPushButton_clicked();
@@ -26,17 +30,37 @@ class WebDataDialog: public QDialog, private Ui::WebDataDialogBase
     void handleDownloadProgress( qint64 progress, qint64 total );
     void on_mOnlyFavouritesCheckBox_stateChanged( int state );
     void on_mSearchTableEdit_textChanged( const QString&  text );
+    /**Passes the search text to the filter model*/
+    void applySearch();
+    /**Passes the facet settings (type, status, in map, map CRS) to the filter model*/
+    void updateFacets();
+    /**Passes the map extent (in WGS 84) and the extent settings to the filter model*/
+    void updateExtentFilter();
     void on_mLayersTreeView_clicked( const QModelIndex& index );
     void keyPressEvent( QKeyEvent* event );
     void resetStateAndCursor(); //set status text to ready and restore cursor
+    void handleServiceAdded();
+    void handleServiceRequestFailed( const QString& title, const QString& errorMessage );
+    void handleOfflineJobFailed( const QString& layerName, const QString& errorMessage );
+    void refreshAllServices();
+    /**Queues offline jobs for all selected layers*/
+    void takeSelectedOffline();
     void deleteEntry();
     void updateEntry();
     void showContextMenu( const QPoint& point );
+    /**Adds the services of a webdata.xml file to the catalogue*/
+    void importCatalogue();
+    /**Writes the catalogue to a webdata.xml file*/
+    void exportCatalogue();
 
   private:
     QgisInterface* mIface;
     WebDataModel mModel;
     WebDataFilterModel mFilterModel;
+    /**Delays the search while typing (setting /NIWA/searchDelay in ms)*/
+    QTimer mSearchTimer;
+    /**Collects extent changes while the map is panned / zoomed*/
+    QTimer mExtentTimer;
     bool mNIWAServicesRequestFinished; //flag to make network request blocking
     QMenu* mContextMenu;
 
@@ -0,0 +1,119 @@
+#include "webdatafacetindex.h"
+#include "webdatastringpool.h"
+#include <QStringList>
+
+WebDataFacetIndex::WebDataFacetIndex( const WebDataStringPool* strings ): mStrings( strings ), mRevision( 0 )
+{
+}
+
+WebDataFacetIndex::~WebDataFacetIndex()
+{
+}
+
+int WebDataFacetIndex::addLayer()
+{
+  int number;
+  if ( !mFreeNumbers.isEmpty() )
+  {
+    number = mFreeNumbers.last();
+    mFreeNumbers.pop_back();
+  }
+  else
+  {
+    //all sets have the same size, so complements and ANDs line up
+    number = mCrsLists.size();
+    int size = number + 1;
+    for ( int i = 0; i < FacetCount; ++i )
+    {
+      mBits[i].resize( size );
+    }
+    QHash<QString, QBitArray>::iterator crsIt = mCrsBits.begin();
+    for ( ; crsIt != mCrsBits.end(); ++crsIt )
+    {
+      crsIt->resize( size );
+    }
+    mCrsLists.append( 0 );
+  }
+
+  mBits[LayerFacet].setBit( number );
+  ++mRevision;
+  return number;
+}
+
+void WebDataFacetIndex::removeLayer( int number )
+{
+  if ( number < 0 || number >= mCrsLists.size() )
+  {
+    return;
+  }
+
+  for ( int i = 0; i < FacetCount; ++i )
+  {
+    mBits[i].clearBit( number );
+  }
+  setCrs( number, 0 );
+  mFreeNumbers.append( number );
+  ++mRevision;
+}
+
+void WebDataFacetIndex::setFacet( int number, Facet facet, bool on )
+{
+  if ( number < 0 || number >= mCrsLists.size() || mBits[facet].testBit( number ) == on )
+  {
+    return;
+  }
+  mBits[facet].setBit( number, on );
+  ++mRevision;
+}
+
+void WebDataFacetIndex::setCrs( int number, quint32 crsList )
+{
+  if ( number < 0 || number >= mCrsLists.size() || mCrsLists.at( number ) == crsList )
+  {
+    return;
+  }
+
+  mCrsLists[number] = crsList;
+  QHash<QString, QBitArray>::iterator crsIt = mCrsBits.begin();
+  for ( ; crsIt != mCrsBits.end(); ++crsIt )
+  {
+    crsIt->setBit( number, crsListContains( crsList, crsIt.key() ) );
+  }
+  ++mRevision;
+}
+
+const QBitArray& WebDataFacetIndex::crsBits( const QString& authId )
+{
+  QHash<QString, QBitArray>::const_iterator crsIt = mCrsBits.constFind( authId );
+  if ( crsIt != mCrsBits.constEnd() )
+  {
+    return crsIt.value();
+  }
+
+  //many layers share the same CRS list, test each list only once
+  QBitArray bits( mCrsLists.size() );
+  QHash<quint32, bool> listContains;
+  for ( int i = 0; i < mCrsLists.size(); ++i )
+  {
+    quint32 crsList = mCrsLists.at( i );
+    QHash<quint32, bool>::const_iterator listIt = listContains.constFind( crsList );
+    if ( listIt == listContains.constEnd() )
+    {
+      listIt = listContains.insert( crsList, crsListContains( crsList, authId ) );
+    }
+    if ( listIt.value() )
+    {
+      bits.setBit( i );
+    }
+  }
+  return mCrsBits.insert( authId, bits ).value();
+}
+
+bool WebDataFacetIndex::crsListContains( quint32 crsList, const QString& authId ) const
+{
+  if ( crsList == 0 )
+  {
+    return false;
+  }
+  return mStrings->string( crsList ).split( "," ).contains( authId, Qt::CaseInsensitive );
+}
@@ -0,0 +1,58 @@
+#ifndef WEBDATAFACETINDEX_H
+#define WEBDATAFACETINDEX_H
+
+#include <QBitArray>
+#include <QHash>
+#include <QVector>
+
+class WebDataStringPool;
+
+/**Bitsets over the catalogue layers for the facet filters (service type, status, in map, supported CRS). Each layer
+  gets a number which is its bit position in all sets, so combining facets is a bitwise AND*/
+class WebDataFacetIndex
+{
+  public:
+    enum Facet
+    {
+      LayerFacet = 0, //all layers in the index
+      WMSFacet,
+      WFSFacet,
+      OfflineFacet,
+      InMapFacet,
+      FacetCount
+    };
+
+    /**@param strings pool of the interned CRS lists*/
+    WebDataFacetIndex( const WebDataStringPool* strings );
+    ~WebDataFacetIndex();
+
+    /**Returns a free layer number. The layer is added to the LayerFacet set*/
+    int addLayer();
+    /**Removes the layer from all sets, the number may be reused*/
+    void removeLayer( int number );
+
+    void setFacet( int number, Facet facet, bool on );
+    const QBitArray& bits( Facet facet ) const { return mBits[facet]; }
+
+    /**Sets the interned comma separated CRS list of a layer*/
+    void setCrs( int number, quint32 crsList );
+    /**Returns the layers supporting the CRS. The set is computed on first use and then kept up to date*/
+    const QBitArray& crsBits( const QString& authId );
+
+    /**Changes whenever a bit changes, allows to detect outdated combinations of sets*/
+    quint32 revision() const { return mRevision; }
+
+  private:
+    const WebDataStringPool* mStrings;
+    QBitArray mBits[FacetCount];
+    /**Interned CRS list by layer number*/
+    QVector<quint32> mCrsLists;
+    QHash<QString, QBitArray> mCrsBits;
+    QVector<int> mFreeNumbers;
+    quint32 mRevision;
+
+    /**Returns true if the CRS list contains the authority id*/
+    bool crsListContains( quint32 crsList, const QString& authId ) const;
+};
+
+#endif // WEBDATAFACETINDEX_H
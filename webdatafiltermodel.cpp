@@ -1,7 +1,10 @@
 #include "webdatafiltermodel.h"
-#include <QStandardItemModel>
+#include "webdatamodel.h"
+#include "webdatasearchindex.h"
 
-WebDataFilterModel::WebDataFilterModel( QObject* parent ): QSortFilterProxyModel( parent ), mShowOnlyFavourites( false )
+WebDataFilterModel::WebDataFilterModel( QObject* parent ): QSortFilterProxyModel( parent ), mShowOnlyFavourites( false ),
+    mWebDataModel( 0 ), mSearchActive( false ), mFacetMaskRevision( 0 ), mAcceptedRowsValid( false ),
+    mOnlyInExtent( false ), mSortByOverlap( false )
 {
 }
 
@@ -9,16 +12,194 @@ WebDataFilterModel::~WebDataFilterModel()
 {
 }
 
+void WebDataFilterModel::setSourceModel( QAbstractItemModel* sourceModel )
+{
+  mWebDataModel = qobject_cast<WebDataModel*>( sourceModel );
+  QSortFilterProxyModel::setSourceModel( sourceModel );
+}
+
 void WebDataFilterModel::setShowOnlyFavourites( bool b )
 {
+  if ( b == mShowOnlyFavourites )
+  {
+    return;
+  }
+
   mShowOnlyFavourites = b;
-  invalidateFilter();
+  if ( b )
+  {
+    fetchMatchingServices();
+  }
+  updateFilter();
 }
 
 void WebDataFilterModel::_setFilterWildcard( const QString& pattern )
 {
-  QSortFilterProxyModel::setFilterWildcard( pattern );
+  if ( !mWebDataModel )
+  {
+    if ( !pattern.isEmpty() )
+    {
+      fetchAllServices();
+    }
+    //setFilterWildcard already invalidates the filter
+    QSortFilterProxyModel::setFilterWildcard( pattern );
+    return;
+  }
+
+  //e.g. only a trailing blank has been typed
+  QStringList terms = WebDataSearchIndex::tokenize( pattern );
+  if ( terms == WebDataSearchIndex::tokenize( mSearchText ) )
+  {
+    mSearchText = pattern;
+    return;
+  }
+
+  //a query extending the previous one can only match a subset of the previous results
+  bool narrow = mSearchActive && WebDataSearchIndex::narrowsQuery( mSearchText, pattern );
+  mSearchText = pattern;
+  mSearchActive = !terms.isEmpty();
+  if ( !mSearchActive )
+  {
+    mSearchScores.clear();
+  }
+  else
+  {
+    fetchMatchingServices();
+    mSearchScores = mWebDataModel->searchLayers( pattern, narrow ? &mSearchScores : 0 );
+  }
+  updateFilter();
+}
+
+void WebDataFilterModel::refreshSearch()
+{
+  bool extentActive = mOnlyInExtent || mSortByOverlap;
+  if ( !mWebDataModel || ( !mSearchActive && !extentActive && !mShowOnlyFavourites && mFacetFilter.isEmpty() ) )
+  {
+    return;
+  }
+
+  fetchMatchingServices();
+  if ( mSearchActive )
+  {
+    mSearchScores = mWebDataModel->searchLayers( mSearchText );
+  }
+  if ( extentActive )
+  {
+    mExtentScores = mWebDataModel->layersInExtent( mExtent );
+  }
+  updateFilter();
+}
+
+void WebDataFilterModel::setFacetFilter( const WebDataModel::FacetFilter& filter )
+{
+  mFacetFilter = filter;
+  if ( !filter.isEmpty() )
+  {
+    fetchMatchingServices();
+  }
+  mFacetMask.clear();
+  updateFilter();
+}
+
+void WebDataFilterModel::setExtentFilter( const QgsRectangle& wgs84Extent, bool onlyInExtent, bool sortByOverlap )
+{
+  if ( !mWebDataModel )
+  {
+    return;
+  }
+
+  bool extentActive = onlyInExtent || sortByOverlap;
+  if ( !extentActive && !mOnlyInExtent && !mSortByOverlap )
+  {
+    //nothing to do, e.g. the map has been panned without extent filter
+    mExtent = wgs84Extent;
+    return;
+  }
+
+  mExtent = wgs84Extent;
+  mOnlyInExtent = onlyInExtent;
+  mSortByOverlap = sortByOverlap;
+  if ( extentActive )
+  {
+    fetchMatchingServices();
+    mExtentScores = mWebDataModel->layersInExtent( mExtent );
+  }
+  else
+  {
+    mExtentScores.clear();
+  }
+  updateFilter();
+}
+
+const QBitArray& WebDataFilterModel::facetMask() const
+{
+  if ( mFacetMask.isNull() || mFacetMaskRevision != mWebDataModel->facetRevision() )
+  {
+    mFacetMask = mWebDataModel->facetMask( mFacetFilter );
+    mFacetMaskRevision = mWebDataModel->facetRevision();
+  }
+  return mFacetMask;
+}
+
+void WebDataFilterModel::updateFilter()
+{
+  mAcceptedRows.clear();
+  mAcceptedRowsValid = true;
   invalidateFilter();
+  mAcceptedRowsValid = false;
+  mAcceptedRows.clear();
+
+  //best matches first, back to the order of the source model without search
+  sort( ( mSearchActive || mSortByOverlap ) ? 0 : -1 );
+}
+
+void WebDataFilterModel::fetchAllServices()
+{
+  QAbstractItemModel* model = sourceModel();
+  if ( !model )
+  {
+    return;
+  }
+
+  int nServices = model->rowCount();
+  for ( int i = 0; i < nServices; ++i )
+  {
+    QModelIndex serviceIndex = model->index( i, 0 );
+    if ( model->canFetchMore( serviceIndex ) )
+    {
+      model->fetchMore( serviceIndex );
+    }
+  }
+}
+
+void WebDataFilterModel::fetchMatchingServices()
+{
+  if ( !mWebDataModel )
+  {
+    fetchAllServices();
+    return;
+  }
+
+  //sorting by overlap alone only reorders the rows already there
+  if ( !mSearchActive && !mShowOnlyFavourites && mFacetFilter.isEmpty() && !mOnlyInExtent )
+  {
+    return;
+  }
+
+  //the query may accept more services than the filter (e.g. the in map facet is not in the database), never less
+  WebDataCatalogStore::LayerQuery query;
+  if ( mSearchActive )
+  {
+    query.terms = WebDataSearchIndex::tokenize( mSearchText );
+  }
+  query.serviceType = mFacetFilter.serviceType;
+  query.crs = mFacetFilter.crs;
+  query.onlyOffline = ( mFacetFilter.status == "offline" );
+  query.onlyOnline = ( mFacetFilter.status == "online" );
+  query.onlyFavourites = mShowOnlyFavourites;
+  query.inExtent = mOnlyInExtent;
+  query.extent = mExtent;
+  mWebDataModel->fetchServicesWithLayers( query );
 }
 
 bool WebDataFilterModel::filterAcceptsRow( int source_row, const QModelIndex & source_parent ) const
@@ -29,23 +210,89 @@ bool WebDataFilterModel::filterAcceptsRow( int source_row, const QModelIndex & s
     return true;
   }
 
-  if ( mShowOnlyFavourites )
+  QModelIndex sourceIndex = sourceModel()->index( source_row, 0, source_parent );
+  if ( mAcceptedRowsValid )
+  {
+    QHash<quint64, bool>::const_iterator acceptedIt = mAcceptedRows.constFind( sourceIndex.internalId() );
+    if ( acceptedIt != mAcceptedRows.constEnd() )
+    {
+      return acceptedIt.value();
+    }
+  }
+
+  bool accepted = layerRowAccepted( source_row, source_parent );
+  if ( !accepted )
   {
-    QStandardItemModel* model = dynamic_cast<QStandardItemModel*>( sourceModel() );
-    if ( model )
+    //show layer groups / parent layers if one of their sublayers is accepted
+    int nChildren = sourceModel()->rowCount( sourceIndex );
+    for ( int i = 0; i < nChildren && !accepted; ++i )
     {
-      QStandardItem* item = model->itemFromIndex( model->index( source_row, 1, source_parent ) );
-      {
-        if ( item && item->checkState() != Qt::Checked )
-        {
-          return false;
-        }
-      }
+      accepted = filterAcceptsRow( i, sourceIndex );
     }
+  }
 
+  if ( mAcceptedRowsValid )
+  {
+    mAcceptedRows.insert( sourceIndex.internalId(), accepted );
   }
+  return accepted;
+}
 
-  //else we have a row that describes a table and that
-  //should be tested using the given wildcard/regexp
-  return QSortFilterProxyModel::filterAcceptsRow( source_row, source_parent );
+bool WebDataFilterModel::layerRowAccepted( int source_row, const QModelIndex & source_parent ) const
+{
+  if ( !mWebDataModel )
+  {
+    return QSortFilterProxyModel::filterAcceptsRow( source_row, source_parent );
+  }
+
+  //layer groups are never favourites and only appear if one of their sublayers is accepted
+  QModelIndex sourceIndex = mWebDataModel->index( source_row, 0, source_parent );
+  if ( mShowOnlyFavourites && !mWebDataModel->layerFavourite( sourceIndex ) )
+  {
+    return false;
+  }
+
+  if ( !mFacetFilter.isEmpty() )
+  {
+    int number = mWebDataModel->layerNumber( sourceIndex );
+    const QBitArray& mask = facetMask();
+    if ( number < 0 || number >= mask.size() || !mask.testBit( number ) )
+    {
+      return false;
+    }
+  }
+
+  if ( mOnlyInExtent && !mExtentScores.contains( sourceIndex.internalId() ) )
+  {
+    return false;
+  }
+
+  if ( mSearchActive )
+  {
+    return mSearchScores.contains( sourceIndex.internalId() );
+  }
+  return true;
+}
+
+bool WebDataFilterModel::lessThan( const QModelIndex& left, const QModelIndex& right ) const
+{
+  if ( mSearchActive && left.parent().isValid() )
+  {
+    double leftScore = mSearchScores.value( left.internalId(), 0.0 );
+    double rightScore = mSearchScores.value( right.internalId(), 0.0 );
+    if ( leftScore != rightScore )
+    {
+      return leftScore > rightScore;
+    }
+  }
+  if ( mSortByOverlap && left.parent().isValid() )
+  {
+    double leftOverlap = mExtentScores.value( left.internalId(), 0.0 );
+    double rightOverlap = mExtentScores.value( right.internalId(), 0.0 );
+    if ( leftOverlap != rightOverlap )
+    {
+      return leftOverlap > rightOverlap;
+    }
+  }
+  return left.row() < right.row();
 }
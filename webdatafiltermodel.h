@@ -1,6 +1,9 @@
 #ifndef WEBDATAFILTERMODEL_H
 #define WEBDATAFILTERMODEL_H
 
+#include "webdatamodel.h"
+#include <QBitArray>
+#include <QHash>
 #include <QSortFilterProxyModel>
 
 class WebDataFilterModel: public QSortFilterProxyModel
@@ -9,16 +12,66 @@ class WebDataFilterModel: public QSortFilterProxyModel
     WebDataFilterModel( QObject* parent = 0 );
     ~WebDataFilterModel();
 
+    void setSourceModel( QAbstractItemModel* sourceModel );
+
     bool showOnlyFavourites() const { return mShowOnlyFavourites; }
     void setShowOnlyFavourites( bool b );
 
-    /**Calls QSortFilterProxyModel::setFilterWildcard and triggers update*/
+    /**Sets the search text. With a WebDataModel as source, the layers are searched by name, title, abstract and
+      keywords and sorted by relevance. Otherwise the text is used as wildcard on the first column*/
     void _setFilterWildcard( const QString& pattern );
+    /**Searches again for the current text and extent and loads the services the filters need, e.g. after layers
+      have been added to the source model or the catalogue has been loaded*/
+    void refreshSearch();
+
+    /**Shows only layers matching the facets (service type, CRS, status, in map). Needs a WebDataModel as source*/
+    void setFacetFilter( const WebDataModel::FacetFilter& filter );
+
+    /**Filters and / or sorts the layers by the overlap of their advertised extent with a WGS 84 extent (e.g. the
+      map view). Layers without extent information do not pass the extent filter
+      @param onlyInExtent show only layers intersecting the extent
+      @param sortByOverlap sort layers by the share of the extent they cover (after search relevance)*/
+    void setExtentFilter( const QgsRectangle& wgs84Extent, bool onlyInExtent, bool sortByOverlap );
 
   protected:
     bool mShowOnlyFavourites;
+    /**Source model if it is a WebDataModel (0 else)*/
+    WebDataModel* mWebDataModel;
+    /**Current search text*/
+    QString mSearchText;
+    /**True if a full text search is active*/
+    bool mSearchActive;
+    /**Search scores of the matching layers by internal id of the source index*/
+    QHash<quint64, double> mSearchScores;
+    WebDataModel::FacetFilter mFacetFilter;
+    /**Combined facet bitset and the facet revision of the source model it was computed for*/
+    mutable QBitArray mFacetMask;
+    mutable quint32 mFacetMaskRevision;
+    /**Results of filterAcceptsRow by internal id of the source index. Only valid during updateFilter(), so layer
+      groups and parent layers are evaluated once instead of once per ancestor*/
+    mutable QHash<quint64, bool> mAcceptedRows;
+    bool mAcceptedRowsValid;
+    /**Extent for the extent filter (WGS 84)*/
+    QgsRectangle mExtent;
+    bool mOnlyInExtent;
+    bool mSortByOverlap;
+    /**Covered share of mExtent of the layers intersecting it by internal id of the source index*/
+    QHash<quint64, double> mExtentScores;
 
     bool filterAcceptsRow( int source_row, const QModelIndex & source_parent ) const;
+    /**Ranks layers by search score and extent overlap, services and layers without search keep the order of the source model*/
+    bool lessThan( const QModelIndex& left, const QModelIndex& right ) const;
+    /**Tests a layer row against the favourite flag and the search text, without considering sublayers*/
+    bool layerRowAccepted( int source_row, const QModelIndex & source_parent ) const;
+    /**Makes the source model create the layer rows of all services, searching needs to see all of them*/
+    void fetchAllServices();
+    /**Makes the source model create the layer rows of the services which can have rows passing the current
+      filter. The catalogue database is asked, so the other services stay unloaded*/
+    void fetchMatchingServices();
+    /**Evaluates the filter for all rows (one invalidation) and sorts by search score / extent overlap*/
+    void updateFilter();
+    /**Returns the facet mask, computes it again if the facets in the source model have changed*/
+    const QBitArray& facetMask() const;
 };
 
 #endif // WEBDATAFILTERMODEL_H
@@ -2,7 +2,11 @@
 #include "qgisinterface.h"
 #include "qgsapplication.h"
 #include "qgscoordinatereferencesystem.h"
+#include "qgscoordinatetransform.h"
+#include "qgscsexception.h"
 #include "qgsdatasourceuri.h"
+#include "qgsfeature.h"
+#include "qgsgeometry.h"
 #include "qgsmapcanvas.h"
 #include "qgsnetworkaccessmanager.h"
 #include "qgsrasterfilewriter.h"
@@ -10,12 +14,19 @@
 #include "qgsrasterlayersaveasdialog.h"
 #include "qgsvectorfilewriter.h"
 #include "qgsvectorlayer.h"
+#include "webdataofflinecheckpoint.h"
+#include "webdataofflinetask.h"
+#include "webdatasyncstate.h"
 #include <QDomDocument>
 #include <QDomElement>
 #include <QNetworkReply>
 #include <QNetworkRequest>
-#include <QProgressDialog>
-#include <QTreeWidgetItem>
+#include <QMessageBox>
+#include <QMetaObject>
+#include <QSettings>
+#include <QUrl>
+#include <QUrlQuery>
+#include <QXmlStreamReader>
 
 //legend
 #include "qgslayertree.h"
@@ -24,24 +35,30 @@
 #include "qgslayertreemodel.h"
 #include "qgslayertreeview.h"
 
-static const QString WFS_NAMESPACE = "http://www.opengis.net/wfs";
+//internal id of model indices: service id in the upper bits, layer slot + 1 in the lower bits (0 for service rows)
+static const int SLOT_BITS = ( sizeof( quintptr ) > 4 ) ? 32 : 20;
+static const quintptr SLOT_MASK = ( quintptr( 1 ) << SLOT_BITS ) - 1;
 
-WebDataModel::WebDataModel( QgisInterface* iface ): QStandardItemModel(), mCapabilitiesReply( 0 ), mIface( iface ), mProgressDialog( 0 )
+WebDataModel::WebDataModel( QgisInterface* iface ): QAbstractItemModel(), mProjectLayerIndexValid( false ),
+    mNextServiceId( 1 ), mFacets( &mStrings ), mCatalogueLoaded( false ), mIface( iface )
 {
-  QStringList headerLabels;
-  headerLabels << tr( "Name" );
-  headerLabels << tr( "Favorite" );
-  headerLabels << tr( "Type" );
-  headerLabels << tr( "In map" );
-  headerLabels << tr( "Status" );
-  headerLabels << tr( "CRS" );
-  headerLabels << tr( "Formats" );
-  headerLabels << tr( "Styles" );
-  setHorizontalHeaderLabels( headerLabels );
+  mFavouriteIcon = QIcon( ":/niwa/icons/favourite.png" );
+  mOnlineIcon = QIcon( ":/niwa/icons/online.png" );
+  mOfflineIcon = QIcon( ":/niwa/icons/offline.png" );
+
+  qRegisterMetaType< QList<WebDataLayerRecord> >( "QList<WebDataLayerRecord>" );
+  mParserThread.start();
+  connect( &mOfflineScheduler, SIGNAL( jobCompleted( WebDataOfflineTask* ) ), this,
+           SLOT( offlineJobCompleted( WebDataOfflineTask* ) ) );
+  connect( &mOfflineScheduler, SIGNAL( jobTerminated( WebDataOfflineTask* ) ), this,
+           SLOT( offlineJobTerminated( WebDataOfflineTask* ) ) );
 
-  connect( this, SIGNAL( itemChanged( QStandardItem* ) ), this, SLOT( handleItemChange( QStandardItem* ) ) );
   connect( QgsProject::instance(), SIGNAL( layersWillBeRemoved( QStringList ) ), this,
            SLOT( syncLayerRemove( QStringList ) ) );
+  connect( QgsProject::instance(), SIGNAL( layersAdded( QList<QgsMapLayer*> ) ), this,
+           SLOT( invalidateProjectLayerIndex() ) );
+  connect( QgsProject::instance(), SIGNAL( layersRemoved( QStringList ) ), this,
+           SLOT( invalidateProjectLayerIndex() ) );
 
   //create cache layer directory if not already there
   QDir cacheDirectory = QDir( QgsApplication::qgisSettingsDirPath() + "/cachelayers" );
@@ -49,1160 +66,2886 @@ WebDataModel::WebDataModel( QgisInterface* iface ): QStandardItemModel(), mCapab
   {
     cacheDirectory.mkpath( QgsApplication::qgisSettingsDirPath() + "/cachelayers" );
   }
-
-  loadFromXML();
 }
 
 WebDataModel::~WebDataModel()
 {
-  saveToXML();
+  //changes are written to the database as they happen. Without database, webdata.xml is the catalogue
+  if ( mCatalogueLoaded && !mStore.isOpen() )
+  {
+    saveToXML( xmlFilePath() );
+  }
+
+  //stop the parser thread first, the workers can then be deleted from here
+  mParserThread.quit();
+  mParserThread.wait();
+
+  QHash<QNetworkReply*, CapabilitiesRequest>::iterator requestIt = mCapabilitiesRequests.begin();
+  for ( ; requestIt != mCapabilitiesRequests.end(); ++requestIt )
+  {
+    requestIt.key()->disconnect( this );
+    requestIt.key()->abort();
+    requestIt.key()->deleteLater();
+    delete requestIt->worker;
+  }
+
+  QHash<WebDataCapabilitiesWorker*, CapabilitiesRequest>::iterator parsingIt = mParsingRequests.begin();
+  for ( ; parsingIt != mParsingRequests.end(); ++parsingIt )
+  {
+    delete parsingIt.key();
+  }
+
+  qDeleteAll( mServices );
 }
 
-void WebDataModel::addService( const QString& title, const QString& url, const QString& service )
+QModelIndex WebDataModel::index( int row, int column, const QModelIndex& parent ) const
 {
-  QString requestUrl = url;
-  requestUrl.append( "REQUEST=GetCapabilities&SERVICE=" );
-  requestUrl.append( service );
-  if ( service.compare( "WFS", Qt::CaseInsensitive ) == 0 )
+  if ( row < 0 || column < 0 || column >= ColumnCount )
   {
-    requestUrl.append( "&VERSION=1.0.0" );
+    return QModelIndex();
+  }
+
+  if ( !parent.isValid() )
+  {
+    if ( row >= mServices.size() )
+    {
+      return QModelIndex();
+    }
+    return createIndex( row, column, internalId( mServices.at( row ), -1 ) );
   }
-  QNetworkRequest request( requestUrl );
-  request.setAttribute( QNetworkRequest::CacheSaveControlAttribute, true );
-  request.setAttribute( QNetworkRequest::CacheLoadControlAttribute, QNetworkRequest::PreferNetwork );
-  mCapabilitiesReply = QgsNetworkAccessManager::instance()->get( request );
-  mCapabilitiesReply->setProperty( "title", title );
-  mCapabilitiesReply->setProperty( "url", url );
 
-  if ( service.compare( "WMS", Qt::CaseInsensitive ) == 0 )
+  Service* service = serviceFromIndex( parent );
+  if ( !service || parent.column() != NameColumn )
   {
-    connect( mCapabilitiesReply, SIGNAL( finished() ), this, SLOT( wmsCapabilitiesRequestFinished() ) );
+    return QModelIndex();
   }
-  else if ( service.compare( "WFS", Qt::CaseInsensitive ) == 0 )
+
+  const QVector<int>& children = childSlots( service, slotFromIndex( parent ) );
+  if ( row >= children.size() )
   {
-    connect( mCapabilitiesReply, SIGNAL( finished() ), this, SLOT( wfsCapabilitiesRequestFinished() ) );
+    return QModelIndex();
   }
+  return createIndex( row, column, internalId( service, children.at( row ) ) );
 }
 
-void WebDataModel::wmsCapabilitiesRequestFinished()
+QModelIndex WebDataModel::parent( const QModelIndex& index ) const
 {
-  if ( !mCapabilitiesReply )
+  Service* service = serviceFromIndex( index );
+  int slot = slotFromIndex( index );
+  if ( !service || slot < 0 )
   {
-    return;
+    return QModelIndex();
   }
 
-  if ( mCapabilitiesReply->error() != QNetworkReply::NoError )
+  int parentSlot = service->layers.at( slot ).parent;
+  if ( parentSlot < 0 )
   {
-    //QMessageBox::critical( 0, tr( "Error" ), tr( "Capabilities could not be retrieved from the server" ) );
-    return;
+    return serviceIndex( service );
   }
+  return layerIndex( service, parentSlot );
+}
 
-  QByteArray buffer = mCapabilitiesReply->readAll();
-
-  QString capabilitiesDocError;
-  QDomDocument capabilitiesDocument;
-  if ( !capabilitiesDocument.setContent( buffer, true, &capabilitiesDocError ) )
+int WebDataModel::rowCount( const QModelIndex& parent ) const
+{
+  if ( !parent.isValid() )
   {
-    //QMessageBox::critical( 0, tr( "Error parsing capabilities document" ), capabilitiesDocError );
-    return;
+    return mServices.size();
   }
 
-  QString version = capabilitiesDocument.documentElement().attribute( "version" );
+  if ( parent.column() != NameColumn )
+  {
+    return 0;
+  }
 
-  //get format list for GetMap
-  QString formatList;
-  QDomElement capabilityElem = capabilitiesDocument.documentElement().firstChildElement( "Capability" );
-  QDomElement requestElem = capabilityElem.firstChildElement( "Request" );
-  QDomElement getMapElem = requestElem.firstChildElement( "GetMap" );
-  QDomNodeList formatNodeList = getMapElem.elementsByTagName( "Format" );
-  for ( int i = 0; i < formatNodeList.size(); ++i )
+  Service* service = serviceFromIndex( parent );
+  if ( !service )
   {
-    if ( i > 0 )
-    {
-      formatList.append( "," );
-    }
-    formatList.append( formatNodeList.at( i ).toElement().text() );
+    return 0;
   }
+  return childSlots( service, slotFromIndex( parent ) ).size();
+}
 
-  //get name, title, abstract of all layers (style / CRS? )
-  QDomNodeList layerList = capabilitiesDocument.elementsByTagName( "Layer" );
-  if ( layerList.size() < 1 )
+bool WebDataModel::hasChildren( const QModelIndex& parent ) const
+{
+  Service* service = serviceFromIndex( parent );
+  if ( service && parent.column() == NameColumn && slotFromIndex( parent ) < 0 && hasPendingLayers( service ) )
   {
-    return;
+    return true;
   }
+  return QAbstractItemModel::hasChildren( parent );
+}
 
-  //add parentItem
-  QString serviceTitle = mCapabilitiesReply->property( "title" ).toString();
-  QList<QStandardItem*> serviceTitleItems = findItems( serviceTitle );
-  QStandardItem* wmsTitleItem = 0;
-  if ( serviceTitleItems.size() < 1 )
+bool WebDataModel::canFetchMore( const QModelIndex& parent ) const
+{
+  Service* service = serviceFromIndex( parent );
+  return ( service && slotFromIndex( parent ) < 0 && hasPendingLayers( service ) );
+}
+
+void WebDataModel::fetchMore( const QModelIndex& parent )
+{
+  Service* service = serviceFromIndex( parent );
+  if ( service && slotFromIndex( parent ) < 0 )
   {
-    wmsTitleItem = new QStandardItem( serviceTitle );
-    invisibleRootItem()->setChild( invisibleRootItem()->rowCount(), wmsTitleItem );
+    fetchServiceLayers( service );
   }
-  else
+}
+
+int WebDataModel::columnCount( const QModelIndex& parent ) const
+{
+  Q_UNUSED( parent );
+  return ColumnCount;
+}
+
+QVariant WebDataModel::data( const QModelIndex& index, int role ) const
+{
+  Service* service = serviceFromIndex( index );
+  if ( !service )
   {
-    wmsTitleItem = serviceTitleItems.at( 0 );
-    wmsTitleItem->removeRows( 0, wmsTitleItem->rowCount() );
+    return QVariant();
   }
-  QString url = mCapabilitiesReply->property( "url" ).toString();
-  wmsTitleItem->setFlags( Qt::ItemIsEnabled );
-  wmsTitleItem->setData( url );
-  QStandardItem* wmsTitleServiceItem = new QStandardItem( "WMS" );
-  invisibleRootItem()->setChild( invisibleRootItem()->rowCount() - 1 , 2, wmsTitleServiceItem );
-  wmsTitleItem->setFlags( Qt::ItemIsEnabled );
 
-  for ( int i = 0; i < layerList.length(); ++i )
+  int slot = slotFromIndex( index );
+  int column = index.column();
+
+  //service row
+  if ( slot < 0 )
   {
-    QString name, title, abstract, crs, style;
-    QDomElement layerElem = layerList.at( i ).toElement();
-    QDomNodeList nameList = layerElem.elementsByTagName( "Name" );
-    if ( nameList.size() > 0 )
+    if ( role == Qt::DisplayRole && column == NameColumn )
     {
-      name = nameList.at( 0 ).toElement().text();
+      return service->title;
     }
-    QDomNodeList titleList = layerElem.elementsByTagName( "Title" );
-    if ( titleList.size() > 0 )
+    else if ( role == Qt::DisplayRole && column == TypeColumn )
     {
-      title = titleList.at( 0 ).toElement().text();
+      return mStrings.string( service->type );
     }
-    QDomNodeList abstractList = layerElem.elementsByTagName( "Abstract" );
-    if ( abstractList.size() > 0 )
+    else if ( role == DataRole && column == NameColumn )
     {
-      abstract = abstractList.at( 0 ).toElement().text();
+      return service->url;
     }
+    return QVariant();
+  }
 
-    //CRS in WMS 1.3
-    QDomNodeList crsList = layerElem.elementsByTagName( "CRS" );
-    for ( int i = 0; i < crsList.size(); ++i )
+  const Layer& layer = service->layers.at( slot );
+  if ( layer.flags & GroupFlag )
+  {
+    if ( role == Qt::DisplayRole && column == NameColumn )
     {
-      QString crsName = crsList.at( i ).toElement().text();
-      if ( i > 0 )
-      {
-        crsName.prepend( "," );
-      }
-      crs.append( crsName );
+      return layer.name;
     }
-    //SRS in WMS 1.1.1
-    QDomNodeList srsList = layerElem.elementsByTagName( "SRS" );
-    for ( int i = 0; i < srsList.size(); ++i )
+    else if ( role == DataRole && column == NameColumn )
     {
-      QString srsName = srsList.at( i ).toElement().text();
-      if ( i > 0 )
+      return service->url;
+    }
+    return QVariant();
+  }
+
+  bool wms = ( mStrings.string( service->type ) == "WMS" );
+  switch ( column )
+  {
+    case NameColumn:
+      if ( role == Qt::DisplayRole )
       {
-        srsName.prepend( "," );
+        return layer.name;
       }
-      crs.append( srsName );
-    }
-    QDomNodeList styleList = layerElem.elementsByTagName( "Style" );
-    for ( int i = 0; i < styleList.size(); ++i )
-    {
-      QString styleName = styleList.at( i ).toElement().firstChildElement( "Name" ).text();
-      if ( i > 0 )
+      else if ( role == Qt::ToolTipRole && !layer.title.isEmpty() )
+      {
+        return layer.abstract.isEmpty() ? layer.title : layer.title + "\n\n" + layer.abstract;
+      }
+      else if ( role == DataRole )
+      {
+        return service->url;
+      }
+      break;
+    case FavouriteColumn:
+      if ( role == Qt::CheckStateRole )
+      {
+        return ( layer.flags & FavouriteFlag ) ? Qt::Checked : Qt::Unchecked;
+      }
+      else if ( role == Qt::DecorationRole && ( layer.flags & FavouriteFlag ) )
+      {
+        return mFavouriteIcon;
+      }
+      break;
+    case TypeColumn:
+      if ( role == Qt::DisplayRole )
+      {
+        return mStrings.string( service->type );
+      }
+      break;
+    case InMapColumn:
+      if ( role == Qt::CheckStateRole )
       {
-        styleName.prepend( "," );
+        return ( layer.flags & InMapFlag ) ? Qt::Checked : Qt::Unchecked;
       }
-      style.append( styleName );
-    }
-
-    QList<QStandardItem*> childItemList;
-    //name
-    QStandardItem* nameItem = new QStandardItem( name );
-    nameItem->setData( url );
-    childItemList.push_back( nameItem );
-    //favorite
-    QStandardItem* favoriteItem = new QStandardItem();
-    favoriteItem->setCheckable( true );
-    favoriteItem->setCheckState( Qt::Unchecked );
-    childItemList.push_back( favoriteItem );
-    //type
-    QStandardItem* typeItem = new QStandardItem( "WMS" );
-    childItemList.push_back( typeItem );
-    //in map
-    QStandardItem* inMapItem = new QStandardItem();
-    inMapItem->setCheckable( true );
-    inMapItem->setCheckState( Qt::Unchecked );
-    childItemList.push_back( inMapItem );
-    //status
-    QStandardItem* statusItem = new QStandardItem( QIcon( ":/niwa/icons/online.png" ), tr( "online" ) );
-    childItemList.push_back( statusItem );
-    //crs
-    QStandardItem* crsItem = new QStandardItem( crs );
-    childItemList.push_back( crsItem );
-    //formats
-    QStandardItem* formatsItem = new QStandardItem( formatList );
-    childItemList.push_back( formatsItem );
-    //styles
-    QStandardItem* stylesItem = new QStandardItem( style );
-    childItemList.push_back( stylesItem );
-
-    wmsTitleItem->appendRow( childItemList );
+      else if ( role == DataRole )
+      {
+        return layer.layerId;
+      }
+      break;
+    case StatusColumn:
+      if ( role == Qt::DisplayRole )
+      {
+        WebDataOfflineTask* task = mOfflineJobs.value( index.internalId(), 0 );
+        if ( task && mOfflineScheduler.isWaiting( task ) )
+        {
+          return tr( "queued" );
+        }
+        else if ( task )
+        {
+          return tr( "downloading %1% (%2 MB)" ).arg( static_cast<int>( task->progress() ) )
+                 .arg( task->bytesWritten() / ( 1024.0 * 1024.0 ), 0, 'f', 1 );
+        }
+        return ( layer.flags & OfflineFlag ) ? QString( "offline" ) : QString( "online" );
+      }
+      else if ( role == Qt::DecorationRole )
+      {
+        return ( layer.flags & OfflineFlag ) ? mOfflineIcon : mOnlineIcon;
+      }
+      else if ( role == DataRole )
+      {
+        return layer.filePath;
+      }
+      break;
+    case CrsColumn:
+      if ( role == Qt::DisplayRole )
+      {
+        return mStrings.string( layer.crs );
+      }
+      break;
+    case FormatsColumn:
+      if ( role == Qt::DisplayRole && wms )
+      {
+        return mStrings.string( service->formats );
+      }
+      break;
+    case StylesColumn:
+      if ( role == Qt::DisplayRole && wms )
+      {
+        return mStrings.string( layer.styles );
+      }
+      break;
+    default:
+      break;
   }
-
-  emit serviceAdded();
+  return QVariant();
 }
 
-void WebDataModel::wfsCapabilitiesRequestFinished()
+bool WebDataModel::setData( const QModelIndex& index, const QVariant& value, int role )
 {
-  if ( !mCapabilitiesReply )
+  Layer* layer = layerFromIndex( index );
+  if ( !layer || ( layer->flags & GroupFlag ) || role != Qt::CheckStateRole )
   {
-    return;
+    return false;
   }
 
-  if ( mCapabilitiesReply->error() != QNetworkReply::NoError )
+  bool checked = ( value.toInt() == Qt::Checked );
+  if ( index.column() == FavouriteColumn )
   {
-    //QMessageBox::critical( 0, tr( "Error" ), tr( "Capabilities could not be retrieved from the server" ) );
-    return;
+    if ( checked )
+    {
+      layer->flags |= FavouriteFlag;
+    }
+    else
+    {
+      layer->flags &= ~FavouriteFlag;
+    }
+    emit dataChanged( index, index );
+    storeLayerState( serviceFromIndex( index ), slotFromIndex( index ) );
+    return true;
+  }
+  else if ( index.column() == InMapColumn )
+  {
+    if ( checked == ( ( layer->flags & InMapFlag ) != 0 ) )
+    {
+      return true;
+    }
+
+    if ( checked )
+    {
+      setLayerFlag( *layer, InMapFlag, true );
+      emit dataChanged( index, index );
+      addEntryToMap( index.sibling( index.row(), NameColumn ) );
+    }
+    else
+    {
+      removeEntryFromMap( index.sibling( index.row(), NameColumn ) );
+    }
+    return true;
   }
+  return false;
+}
 
-  QByteArray buffer = mCapabilitiesReply->readAll();
+Qt::ItemFlags WebDataModel::flags( const QModelIndex& index ) const
+{
+  if ( !index.isValid() )
+  {
+    return 0;
+  }
 
-  QString capabilitiesDocError;
-  QDomDocument capabilitiesDocument;
-  if ( !capabilitiesDocument.setContent( buffer, true, &capabilitiesDocError ) )
+  //services and layer groups
+  const Layer* layer = layerFromIndex( index );
+  if ( !layer || ( layer->flags & GroupFlag ) )
   {
-    //QMessageBox::critical( 0, tr( "Error parsing capabilities document" ), capabilitiesDocError );
-    return;
+    return Qt::ItemIsEnabled;
   }
 
-  QDomNodeList featureTypeList = capabilitiesDocument.elementsByTagNameNS( WFS_NAMESPACE, "FeatureType" );
-  if ( featureTypeList.size() < 1 )
+  Qt::ItemFlags f = Qt::ItemIsEnabled | Qt::ItemIsSelectable;
+  if ( index.column() == FavouriteColumn || index.column() == InMapColumn )
   {
-    return;
+    f |= Qt::ItemIsUserCheckable;
   }
+  return f;
+}
 
-  //add parentItem
-  QString serviceTitle = mCapabilitiesReply->property( "title" ).toString();
-  QList<QStandardItem*> serviceTitleItems = findItems( serviceTitle );
-  QStandardItem* wfsTitleItem = 0;
-  if ( serviceTitleItems.size() < 1 )
+QVariant WebDataModel::headerData( int section, Qt::Orientation orientation, int role ) const
+{
+  if ( orientation != Qt::Horizontal || role != Qt::DisplayRole )
   {
-    wfsTitleItem = new QStandardItem( serviceTitle );
-    invisibleRootItem()->setChild( invisibleRootItem()->rowCount(), wfsTitleItem );
+    return QVariant();
   }
-  else
+
+  switch ( section )
   {
-    wfsTitleItem = serviceTitleItems.at( 0 );
-    wfsTitleItem->removeRows( 0, wfsTitleItem->rowCount() );
-  }
-  QString url = mCapabilitiesReply->property( "url" ).toString();
-  wfsTitleItem->setFlags( Qt::ItemIsEnabled );
-  wfsTitleItem->setData( url );
-  QStandardItem* wfsTitleServiceItem = new QStandardItem( "WFS" );
-  invisibleRootItem()->setChild( invisibleRootItem()->rowCount() - 1 , 2, wfsTitleServiceItem );
-  wfsTitleItem->setFlags( Qt::ItemIsEnabled );
-
-  for ( int i = 0; i < featureTypeList.length(); ++i )
-  {
-    QString name, title, abstract, srs;
-    QDomElement featureTypeElem = featureTypeList.at( i ).toElement();
-
-    //Name
-    QDomNodeList nameList = featureTypeElem.elementsByTagNameNS( WFS_NAMESPACE, "Name" );
-    if ( nameList.length() > 0 )
-    {
-      name = nameList.at( 0 ).toElement().text();
-    }
-    //Title
-    QDomNodeList titleList = featureTypeElem.elementsByTagNameNS( WFS_NAMESPACE, "Title" );
-    if ( titleList.length() > 0 )
-    {
-      title = titleList.at( 0 ).toElement().text();
-    }
-    //Abstract
-    QDomNodeList abstractList = featureTypeElem.elementsByTagNameNS( WFS_NAMESPACE, "Abstract" );
-    if ( abstractList.length() > 0 )
-    {
-      abstract = abstractList.at( 0 ).toElement().text();
-    }
-    //SRS
-    QDomNodeList srsList = featureTypeElem.elementsByTagNameNS( WFS_NAMESPACE, "SRS" );
-    if ( srsList.length() > 0 )
-    {
-      srs = srsList.at( 0 ).toElement().text();
-    }
-
-    QList<QStandardItem*> childItemList;
-    //name
-    QStandardItem* nameItem = new QStandardItem( name );
-    nameItem->setData( url );
-    childItemList.push_back( nameItem );
-    //favorite
-    QStandardItem* favoriteItem = new QStandardItem();
-    favoriteItem->setCheckable( true );
-    favoriteItem->setCheckState( Qt::Unchecked );
-    childItemList.push_back( favoriteItem );
-    //type
-    QStandardItem* typeItem = new QStandardItem( "WFS" );
-    childItemList.push_back( typeItem );
-    //in map
-    QStandardItem* inMapItem = new QStandardItem();
-    inMapItem->setCheckable( true );
-    inMapItem->setCheckState( Qt::Unchecked );
-    childItemList.push_back( inMapItem );
-    //status
-    QStandardItem* statusItem = new QStandardItem( QIcon( ":/niwa/icons/online.png" ), tr( "online" ) );
-    childItemList.push_back( statusItem );
-    //crs
-    QStandardItem* srsItem = new QStandardItem( srs );
-    childItemList.push_back( srsItem );
-    wfsTitleItem->appendRow( childItemList );
+    case NameColumn:
+      return tr( "Name" );
+    case FavouriteColumn:
+      return tr( "Favorite" );
+    case TypeColumn:
+      return tr( "Type" );
+    case InMapColumn:
+      return tr( "In map" );
+    case StatusColumn:
+      return tr( "Status" );
+    case CrsColumn:
+      return tr( "CRS" );
+    case FormatsColumn:
+      return tr( "Formats" );
+    case StylesColumn:
+      return tr( "Styles" );
+    default:
+      return QVariant();
   }
-  emit serviceAdded();
 }
 
-void WebDataModel::handleItemChange( QStandardItem* item )
+bool WebDataModel::removeRows( int row, int count, const QModelIndex& parent )
 {
-  blockSignals( true );
-  if ( item->column() == 1 )
+  if ( row < 0 || count < 1 )
+  {
+    return false;
+  }
+
+  if ( !parent.isValid() )
   {
-    if ( item->checkState() == Qt::Checked )
+    if ( row + count > mServices.size() )
     {
-      item->setIcon( QIcon( ":/niwa/icons/favourite.png" ) );
+      return false;
     }
-    else
+    beginRemoveRows( QModelIndex(), row, row + count - 1 );
+    for ( int i = 0; i < count; ++i )
     {
-      item->setIcon( QIcon() ); //unset icon
+      Service* service = mServices.takeAt( row );
+      storeServiceRemoved( service );
+      deleteService( service );
     }
+    endRemoveRows();
+    return true;
   }
-  else if ( item->column() == 3 ) //in map
+
+  Service* service = serviceFromIndex( parent );
+  if ( !service || row + count > rowCount( parent ) )
   {
-    if ( item->checkState() == Qt::Checked )
-    {
+    return false;
+  }
+  removeLayers( service, slotFromIndex( parent ), row, count );
+  storeService( service );
+  return true;
+}
 
-      addEntryToMap( item->index().sibling( item->row(), 0 ) );
-    }
-    else
+void WebDataModel::deleteService( Service* service )
+{
+  mServiceById.remove( service->id );
+  for ( int j = 0; j < service->layers.size(); ++j )
+  {
+    mSearchIndex.removeDocument( internalId( service, j ) );
+    mFacets.removeLayer( service->layers.at( j ).number );
+    setLayerExtent( service, j, false, 0, 0, 0, 0 );
+    if ( !service->layers.at( j ).layerId.isEmpty() )
     {
-      removeEntryFromMap( item->index().sibling( item->row(), 0 ) );
+      mMapLayerRows.remove( service->layers.at( j ).layerId );
     }
   }
-  else if ( item->column() == 4 ) //online / offline
+  delete service;
+}
+
+void WebDataModel::addService( const QString& title, const QString& url, const QString& service, bool revalidate )
+{
+  QString serviceType = service.toUpper();
+  if ( serviceType != "WMS" && serviceType != "WFS" )
   {
+    return;
+  }
 
+  //a request for this service is already pending
+  if ( capabilitiesRequestPending( title ) )
+  {
+    return;
   }
-  blockSignals( false );
-}
 
-void WebDataModel::syncLayerRemove( QStringList theLayerIds )
-{
-  QSet<QString> idSet = theLayerIds.toSet();
+  CapabilitiesRequest request;
+  request.title = title;
+  request.url = url;
+  request.service = serviceType;
+  request.host = QUrl( url ).host();
+  request.worker = 0;
 
-  //iterate the layer items
-  int serviceCount = invisibleRootItem()->rowCount();
-  QStandardItem* serviceItem = 0;
+  request.requestUrl = url;
+  request.requestUrl.append( "REQUEST=GetCapabilities&SERVICE=" );
+  request.requestUrl.append( serviceType );
+  if ( serviceType == "WFS" )
+  {
+    request.requestUrl.append( "&VERSION=1.0.0" );
+  }
 
-  for ( int i = 0; i < serviceCount; ++i )
+  //capabilities fetched recently don't need to be requested again
+  WebDataCapabilitiesCache::Entry cacheEntry;
+  if ( mCapabilitiesCache.load( request.requestUrl, cacheEntry, false ) )
   {
-    serviceItem = invisibleRootItem()->child( i, 0 );
-    if ( serviceItem )
+    if ( !revalidate && WebDataCapabilitiesCache::isFresh( cacheEntry ) && insertCachedServiceLayers( request ) )
     {
-      int nLayers = serviceItem->rowCount();
-      for ( int j = 0; j < nLayers; ++j )
-      {
-        QStandardItem* inMapItem = serviceItem->child( j, 3 );
-        if ( !inMapItem )
-        {
-          continue;
-        }
-
-        if ( inMapItem->checkState() != Qt::Checked )
-        {
-          continue;
-        }
-
-        QString debug = inMapItem->data().toString();
-        if ( idSet.contains( inMapItem->data().toString() ) )
-        {
-          inMapItem->setCheckState( Qt::Unchecked );
-        }
-      }
+      return;
     }
+    request.eTag = cacheEntry.eTag;
+    request.lastModified = cacheEntry.lastModified;
   }
+
+  mQueuedCapabilitiesRequests.append( request );
+  startQueuedCapabilitiesRequests();
 }
 
-void WebDataModel::addEntryToMap( const QModelIndex& index )
+bool WebDataModel::insertCachedServiceLayers( const CapabilitiesRequest& request )
 {
-  if ( !mIface )
+  WebDataCapabilitiesCache::Entry cacheEntry;
+  if ( !mCapabilitiesCache.load( request.requestUrl, cacheEntry ) || cacheEntry.records.size() < 1 )
   {
-    return;
+    return false;
   }
 
-  QString layername = layerName( index );
-  QString type = serviceType( index );//wms / wfs ?
-  QStandardItem* inMapItem = itemFromIndex( index.sibling( index.row(), 3 ) );
-  if ( !inMapItem || ! ( inMapItem->checkState()  == Qt::Checked ) )
+  insertServiceLayers( request.title, request.url, request.service, cacheEntry.records, cacheEntry.formats,
+                       cacheEntry.version, cacheEntry.maxImageSize );
+  emit serviceAdded();
+  return true;
+}
+
+void WebDataModel::refreshAllServices()
+{
+  QList<Service*>::const_iterator serviceIt = mServices.constBegin();
+  for ( ; serviceIt != mServices.constEnd(); ++serviceIt )
   {
-    return;
+    addService( ( *serviceIt )->title, ( *serviceIt )->url, mStrings.string( ( *serviceIt )->type ), true );
   }
-  bool offline = layerStatus( index ).compare( "offline", Qt::CaseInsensitive ) == 0;
-  QStandardItem* statusItem = itemFromIndex( index.sibling( index.row(), 4 ) );
-  if ( !statusItem )
+}
+
+int WebDataModel::pendingCapabilitiesRequests() const
+{
+  return mCapabilitiesRequests.size() + mParsingRequests.size() + mQueuedCapabilitiesRequests.size();
+}
+
+bool WebDataModel::capabilitiesRequestPending( const QString& title ) const
+{
+  QHash<QNetworkReply*, CapabilitiesRequest>::const_iterator runningIt = mCapabilitiesRequests.constBegin();
+  for ( ; runningIt != mCapabilitiesRequests.constEnd(); ++runningIt )
   {
-    return;
+    if ( runningIt.value().title == title )
+    {
+      return true;
+    }
   }
 
-  QgsMapLayer* mapLayer = 0;
-  if ( type == "WMS" )
+  QHash<WebDataCapabilitiesWorker*, CapabilitiesRequest>::const_iterator parsingIt = mParsingRequests.constBegin();
+  for ( ; parsingIt != mParsingRequests.constEnd(); ++parsingIt )
   {
-    if ( offline )
+    if ( parsingIt.value().title == title )
     {
-      mapLayer = mIface->addRasterLayer( statusItem->data().toString(), layername );
+      return true;
     }
-    else
+  }
+
+  QList<CapabilitiesRequest>::const_iterator queuedIt = mQueuedCapabilitiesRequests.constBegin();
+  for ( ; queuedIt != mQueuedCapabilitiesRequests.constEnd(); ++queuedIt )
+  {
+    if ( queuedIt->title == title )
     {
-      QgsDataSourceUri uri = wmsUriFromIndex( index );
-      mapLayer = mIface->addRasterLayer( uri.encodedUri(), layername, "wms" );
+      return true;
     }
   }
-  else if ( type == "WFS" )
+  return false;
+}
+
+void WebDataModel::startQueuedCapabilitiesRequests()
+{
+  QSettings s;
+  int maxRequestsPerHost = qMax( 1, s.value( "/NIWA/maxCapabilitiesRequestsPerHost", 4 ).toInt() );
+
+  QList<CapabilitiesRequest>::iterator queuedIt = mQueuedCapabilitiesRequests.begin();
+  while ( queuedIt != mQueuedCapabilitiesRequests.end() )
   {
-    QString url = wfsUrlFromLayerIndex( index );
-    if ( offline )
+    if ( mRunningRequestsPerHost.value( queuedIt->host, 0 ) >= maxRequestsPerHost )
     {
-      mapLayer =  mIface->addVectorLayer( statusItem->data().toString(), layername, "ogr" );
+      ++queuedIt;
+      continue;
     }
-    else
+
+    CapabilitiesRequest request = *queuedIt;
+    queuedIt = mQueuedCapabilitiesRequests.erase( queuedIt );
+
+    //the validators of the cached capabilities make the server answer with 304 if nothing has changed
+    QNetworkRequest networkRequest( request.requestUrl );
+    networkRequest.setAttribute( QNetworkRequest::CacheSaveControlAttribute, false );
+    networkRequest.setAttribute( QNetworkRequest::CacheLoadControlAttribute, QNetworkRequest::AlwaysNetwork );
+    if ( !request.eTag.isEmpty() )
     {
-      mapLayer = mIface->addVectorLayer( url, layername, "WFS" );
+      networkRequest.setRawHeader( "If-None-Match", request.eTag.toLatin1() );
     }
-    if ( !mapLayer )
+    if ( !request.lastModified.isEmpty() )
     {
-      return;
+      networkRequest.setRawHeader( "If-Modified-Since", request.lastModified.toLatin1() );
     }
+    QNetworkReply* reply = QgsNetworkAccessManager::instance()->get( networkRequest );
+
+    //the document is parsed in the worker thread while it arrives, so it never needs to be held in memory as a whole
+    request.worker = new WebDataCapabilitiesWorker( request.service );
+    request.worker->moveToThread( &mParserThread );
+    connect( request.worker, SIGNAL( parsingFinished( const QList<WebDataLayerRecord>&, const QStringList&, const QString&, const QSize&, bool, const QString& ) ),
+             this, SLOT( capabilitiesParsingFinished( const QList<WebDataLayerRecord>&, const QStringList&, const QString&, const QSize&, bool, const QString& ) ) );
+    mCapabilitiesRequests.insert( reply, request );
+    mRunningRequestsPerHost[request.host] += 1;
+
+    connect( reply, SIGNAL( readyRead() ), this, SLOT( capabilitiesReplyReadyRead() ) );
+    connect( reply, SIGNAL( finished() ), this, SLOT( capabilitiesRequestFinished() ) );
   }
-  inMapItem->setCheckState( Qt::Checked );
+}
 
-  if ( mapLayer )
+void WebDataModel::capabilitiesReplyReadyRead()
+{
+  QNetworkReply* reply = qobject_cast<QNetworkReply*>( sender() );
+  QHash<QNetworkReply*, CapabilitiesRequest>::iterator requestIt = mCapabilitiesRequests.find( reply );
+  if ( requestIt == mCapabilitiesRequests.end() )
   {
-    inMapItem->setData( mapLayer->id() );
+    return;
   }
+
+  QMetaObject::invokeMethod( requestIt->worker, "addData", Qt::QueuedConnection, Q_ARG( QByteArray, reply->readAll() ) );
 }
 
-void WebDataModel::removeEntryFromMap( const QModelIndex& index )
+void WebDataModel::capabilitiesRequestFinished()
 {
-  //is entry already in map
-  QStandardItem* inMapItem = itemFromIndex( index.sibling( index.row(), 3 ) );
-  /*bool inMap = ( inMapItem && inMapItem->checkState() == Qt::Checked );
-  if ( !inMap )
+  QNetworkReply* reply = qobject_cast<QNetworkReply*>( sender() );
+  QHash<QNetworkReply*, CapabilitiesRequest>::iterator requestIt = mCapabilitiesRequests.find( reply );
+  if ( requestIt == mCapabilitiesRequests.end() )
   {
     return;
-  }*/
+  }
 
-  QString layerId = inMapItem->data().toString();
-  QgsProject::instance()->removeMapLayers( QStringList() << layerId );
-  inMapItem->setCheckState( Qt::Unchecked );
+  CapabilitiesRequest request = requestIt.value();
+  mCapabilitiesRequests.erase( requestIt );
+  reply->deleteLater();
+
+  //free the slot on the host for the next queued request
+  mRunningRequestsPerHost[request.host] -= 1;
+  if ( mRunningRequestsPerHost.value( request.host ) < 1 )
+  {
+    mRunningRequestsPerHost.remove( request.host );
+  }
+  startQueuedCapabilitiesRequests();
+
+  //not modified: the cached records are still valid and don't need to be parsed again
+  if ( reply->attribute( QNetworkRequest::HttpStatusCodeAttribute ).toInt() == 304 )
+  {
+    request.worker->deleteLater();
+    if ( insertCachedServiceLayers( request ) )
+    {
+      mCapabilitiesCache.touch( request.requestUrl );
+      return;
+    }
+    if ( request.eTag.isEmpty() && request.lastModified.isEmpty() )
+    {
+      emit serviceRequestFailed( request.title, tr( "The server answered 'not modified' to an unconditional request" ) );
+      return;
+    }
+
+    //the cached records are gone or unreadable. Drop the entry and request the whole document again
+    mCapabilitiesCache.remove( request.requestUrl );
+    request.eTag.clear();
+    request.lastModified.clear();
+    request.worker = 0;
+    mQueuedCapabilitiesRequests.append( request );
+    startQueuedCapabilitiesRequests();
+    return;
+  }
+
+  if ( reply->error() != QNetworkReply::NoError )
+  {
+    request.worker->deleteLater();
+    emit serviceRequestFailed( request.title, reply->errorString() );
+    return;
+  }
+
+  request.eTag = QString::fromLatin1( reply->rawHeader( "ETag" ) );
+  request.lastModified = QString::fromLatin1( reply->rawHeader( "Last-Modified" ) );
+  mParsingRequests.insert( request.worker, request );
+  QMetaObject::invokeMethod( request.worker, "addData", Qt::QueuedConnection, Q_ARG( QByteArray, reply->readAll() ) );
+  QMetaObject::invokeMethod( request.worker, "finish", Qt::QueuedConnection );
 }
 
-void WebDataModel::changeEntryToOffline( const QModelIndex& index )
+void WebDataModel::capabilitiesParsingFinished( const QList<WebDataLayerRecord>& records, const QStringList& formats,
+    const QString& version, const QSize& maxImageSize, bool ok, const QString& errorString )
 {
-  //bail out if entry already has offline status
-  QString status = layerStatus( index );
-  if ( status.compare( "offline", Qt::CaseInsensitive ) == 0 )
+  WebDataCapabilitiesWorker* worker = qobject_cast<WebDataCapabilitiesWorker*>( sender() );
+  QHash<WebDataCapabilitiesWorker*, CapabilitiesRequest>::iterator requestIt = mParsingRequests.find( worker );
+  if ( requestIt == mParsingRequests.end() )
   {
     return;
   }
 
-  //wms / wfs ?
-  QString type = serviceType( index );
-  QString layername = layerName( index );
+  CapabilitiesRequest request = requestIt.value();
+  mParsingRequests.erase( requestIt );
+  worker->deleteLater();
 
-  QString saveFilePath = QgsApplication::qgisSettingsDirPath() + "/cachelayers/";
-  QDateTime dt = QDateTime::currentDateTime();
-  QString layerId = layername + dt.toString( "yyyyMMddhhmmsszzz" );
-  bool inMap = layerInMap( index );
-  QString filePath;
-  QStandardItem* inMapItem = itemFromIndex( index.sibling( index.row(), 3 ) );
-  bool offlineOk = false;
+  if ( !ok || records.size() < 1 )
+  {
+    QgsDebugMsg( "Error parsing capabilities document: " + errorString );
+    emit serviceRequestFailed( request.title, ok ? tr( "The service does not offer any layers" ) : errorString );
+    return;
+  }
+
+  WebDataCapabilitiesCache::Entry cacheEntry;
+  cacheEntry.eTag = request.eTag;
+  cacheEntry.lastModified = request.lastModified;
+  cacheEntry.fetched = QDateTime::currentDateTimeUtc();
+  cacheEntry.formats = formats;
+  cacheEntry.version = version;
+  cacheEntry.maxImageSize = maxImageSize;
+  cacheEntry.records = records;
+  mCapabilitiesCache.store( request.requestUrl, cacheEntry );
+
+  insertServiceLayers( request.title, request.url, request.service, records, formats, version, maxImageSize );
+  emit serviceAdded();
+}
 
-  if ( type == "WFS" )
+void WebDataModel::insertServiceLayers( const QString& serviceTitle, const QString& url, const QString& serviceType,
+                                        const QList<WebDataLayerRecord>& records, const QStringList& formats,
+                                        const QString& version, const QSize& maxImageSize )
+{
+  LayerRecordTree tree;
+  tree.records = &records;
+  tree.formats = mStrings.intern( formats.join( "," ) );
+  tree.wms = ( serviceType == "WMS" );
+  tree.children.resize( records.size() );
+
+  //records come in document order, so a parent always has a lower index than its sublayers
+  for ( int i = 0; i < records.size(); ++i )
   {
-    //create table <layername//url>
-    QgsVectorLayer* wfsLayer = 0;
-    if ( inMap )
+    int parent = records.at( i ).parent;
+    if ( parent >= 0 && parent < i )
     {
-      if ( inMapItem )
-      {
-        wfsLayer = static_cast<QgsVectorLayer*>( QgsProject::instance()->mapLayer( inMapItem->data().toString() ) );
-      }
+      tree.children[parent].append( i );
     }
     else
     {
-      QString wfsUrl = wfsUrlFromLayerIndex( index );
-      wfsLayer = new QgsVectorLayer( wfsUrl, layername, "WFS" );
+      tree.topLevel.append( i );
     }
+  }
 
-    QApplication::setOverrideCursor( QCursor( Qt::WaitCursor ) );
-    filePath = saveFilePath + layerId + ".shp";
-    const QgsCoordinateReferenceSystem& layerCRS = wfsLayer->crs();
-    offlineOk = ( QgsVectorFileWriter::writeAsVectorFormat( wfsLayer, filePath,
-                  "UTF-8", layerCRS, "ESRI Shapefile" ) == QgsVectorFileWriter::NoError );
-    if ( offlineOk && inMap )
+  Service* service = serviceByTitle( serviceTitle );
+  if ( service )
+  {
+    //the existing rows are needed for the comparison
+    fetchServiceLayers( service );
+
+    //refresh: only touch the rows which changed, so favourite / in map / offline state of the other layers is kept
+    service->url = url;
+    service->version = version;
+    service->maxImageSize = maxImageSize;
+    if ( service->formats != tree.formats )
     {
-      QgsVectorLayer* offlineLayer = mIface->addVectorLayer( filePath, layername, "ogr" );
-      if ( inMapItem )
+      service->formats = tree.formats;
+      //all layers show the formats of the service, including sublayers
+      for ( int i = 0; i < service->layers.size(); ++i )
       {
-        exchangeLayer( inMapItem->data().toString(), offlineLayer );
-        blockSignals( true );
-        inMapItem->setData( offlineLayer->id() );
-        blockSignals( false );
+        if ( !( service->layers.at( i ).flags & RemovedFlag ) )
+        {
+          emitLayerChanged( layerIndex( service, i ), FormatsColumn, FormatsColumn );
+        }
       }
     }
-    QApplication::restoreOverrideCursor();
-
-    if ( !inMap )
+    mergeLayers( service, -1, tree.topLevel, tree );
+    if ( storeService( service ) )
     {
-      delete wfsLayer;
+      compactLayers( service );
     }
+    return;
   }
-  else if ( type == "WMS" )
+
+  //the service is completely built before it is added. Inserting it with all its layers then costs only
+  //a single rowsInserted signal instead of one per layer
+  service = new Service();
+  service->id = mNextServiceId++;
+  service->title = serviceTitle;
+  service->url = url;
+  service->type = mStrings.intern( serviceType );
+  service->formats = tree.formats;
+  service->version = version;
+  service->maxImageSize = maxImageSize;
+  service->layers.reserve( records.size() );
+  QList<int>::const_iterator topLevelIt = tree.topLevel.constBegin();
+  for ( ; topLevelIt != tree.topLevel.constEnd(); ++topLevelIt )
   {
-    //get raster layer
-    QgsRasterLayer* wmsLayer = 0;
-    if ( inMap )
-    {
-      wmsLayer = static_cast<QgsRasterLayer*>( QgsProject::instance()->mapLayer( inMapItem->data().toString() ) );
-    }
-    else
-    {
-      QgsDataSourceUri uri = wmsUriFromIndex( index );
-      wmsLayer = new QgsRasterLayer( uri.encodedUri(), layername, "wms" );
-    }
+    createLayer( service, -1, *topLevelIt, tree );
+  }
 
-    //call save as dialog
+  beginInsertRows( QModelIndex(), mServices.size(), mServices.size() );
+  mServices.append( service );
+  mServiceById.insert( service->id, service );
+  endInsertRows();
+  storeService( service );
+}
+
+int WebDataModel::createLayer( Service* service, int parentSlot, int recordIndex, const LayerRecordTree& tree )
+{
+  const WebDataLayerRecord& record = tree.records->at( recordIndex );
+  Layer layer;
+  layer.parent = parentSlot;
+
+  //layers without name only group their sublayers and cannot be requested themselves
+  if ( record.name.isEmpty() )
+  {
+    layer.name = record.title;
+    layer.flags = GroupFlag;
+  }
+  else
+  {
+    layer.name = record.name;
+    layer.title = record.title;
+    layer.abstract = record.abstract;
+    layer.keywords = mStrings.intern( record.keywords.join( "," ) );
+    layer.crs = internCrs( record, tree.wms );
+    if ( tree.wms )
+    {
+      layer.styles = mStrings.intern( record.styles.join( "," ) );
+    }
+  }
+
+  int slot = service->layers.size();
+  service->layers.append( layer );
+  QVector<int>& siblings = ( parentSlot < 0 ) ? service->topLevel : service->layers[parentSlot].children;
+  service->layers[slot].row = siblings.size();
+  siblings.append( slot );
+  indexLayer( service, slot );
+  addLayerFacets( service, slot );
+  setLayerExtent( service, slot, record.hasExtent, record.west, record.south, record.east, record.north );
+
+  //sublayers
+  const QList<int>& children = tree.children.at( recordIndex );
+  QList<int>::const_iterator childIt = children.constBegin();
+  for ( ; childIt != children.constEnd(); ++childIt )
+  {
+    createLayer( service, slot, *childIt, tree );
+  }
+  return slot;
+}
+
+void WebDataModel::mergeLayers( Service* service, int parentSlot, const QList<int>& recordIndices, const LayerRecordTree& tree )
+{
+  //existing rows by name (layers) or title (layer groups)
+  QVector<int> existing = childSlots( service, parentSlot );
+  QHash<QString, int> existingRows;
+  for ( int i = 0; i < existing.size(); ++i )
+  {
+    existingRows.insert( layerKey( service->layers.at( existing.at( i ) ) ), i );
+  }
+
+  QVector<bool> rowInCapabilities( existing.size(), false );
+  QList<int> newRecords;
+
+  QList<int>::const_iterator recordIt = recordIndices.constBegin();
+  for ( ; recordIt != recordIndices.constEnd(); ++recordIt )
+  {
+    const WebDataLayerRecord& record = tree.records->at( *recordIt );
+    QString key = record.name.isEmpty() ? ( "group:" + record.title ) : record.name;
+    QHash<QString, int>::const_iterator rowIt = existingRows.constFind( key );
+    if ( rowIt == existingRows.constEnd() )
+    {
+      newRecords.append( *recordIt );
+      continue;
+    }
+
+    int row = rowIt.value();
+    int slot = existing.at( row );
+    rowInCapabilities[row] = true;
+    if ( !record.name.isEmpty() )
+    {
+      //update changed metadata in place
+      quint32 crs = internCrs( record, tree.wms );
+      quint32 styles = tree.wms ? mStrings.intern( record.styles.join( "," ) ) : 0;
+      Layer& layer = service->layers[slot];
+      if ( layer.crs != crs || layer.styles != styles )
+      {
+        layer.crs = crs;
+        layer.styles = styles;
+        mFacets.setCrs( layer.number, crs );
+        emitLayerChanged( layerIndex( service, slot ), CrsColumn, StylesColumn );
+      }
+
+      quint32 keywords = mStrings.intern( record.keywords.join( "," ) );
+      if ( layer.title != record.title || layer.abstract != record.abstract || layer.keywords != keywords )
+      {
+        layer.title = record.title;
+        layer.abstract = record.abstract;
+        layer.keywords = keywords;
+        indexLayer( service, slot );
+      }
+      setLayerExtent( service, slot, record.hasExtent, record.west, record.south, record.east, record.north );
+    }
+
+    mergeLayers( service, slot, tree.children.at( *recordIt ), tree );
+  }
+
+  //remove layers which are no longer offered by the service. Offline layers are kept, their data is still usable
+  //and removing the row would orphan the files in the cache directory. Layers in the map and groups containing
+  //such layers are kept as well
+  for ( int i = existing.size() - 1; i >= 0; --i )
+  {
+    if ( rowInCapabilities.at( i ) || layerInUse( service, existing.at( i ) ) )
+    {
+      continue;
+    }
+    removeLayers( service, parentSlot, i, 1 );
+  }
+
+  //add new layers
+  if ( newRecords.isEmpty() )
+  {
+    return;
+  }
+  int firstRow = childSlots( service, parentSlot ).size();
+  QModelIndex parentIndex = ( parentSlot < 0 ) ? serviceIndex( service ) : layerIndex( service, parentSlot );
+  beginInsertRows( parentIndex, firstRow, firstRow + newRecords.size() - 1 );
+  QList<int>::const_iterator newIt = newRecords.constBegin();
+  for ( ; newIt != newRecords.constEnd(); ++newIt )
+  {
+    createLayer( service, parentSlot, *newIt, tree );
+  }
+  endInsertRows();
+}
+
+QString WebDataModel::layerKey( const Layer& layer )
+{
+  if ( layer.flags & GroupFlag )
+  {
+    return "group:" + layer.name;
+  }
+  return layer.name;
+}
+
+bool WebDataModel::layerInUse( const Service* service, int slot )
+{
+  const Layer& layer = service->layers.at( slot );
+  if ( layer.flags & ( OfflineFlag | InMapFlag ) )
+  {
+    return true;
+  }
+  QVector<int>::const_iterator childIt = layer.children.constBegin();
+  for ( ; childIt != layer.children.constEnd(); ++childIt )
+  {
+    if ( layerInUse( service, *childIt ) )
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+quint32 WebDataModel::internCrs( const WebDataLayerRecord& record, bool wms )
+{
+  //WFS: only the default SRS
+  return mStrings.intern( wms ? record.crs.join( "," ) : record.crs.value( 0 ) );
+}
+
+void WebDataModel::removeLayers( Service* service, int parentSlot, int row, int count )
+{
+  QVector<int>& children = ( parentSlot < 0 ) ? service->topLevel : service->layers[parentSlot].children;
+  if ( row < 0 || count < 1 || row + count > children.size() )
+  {
+    return;
+  }
+
+  QModelIndex parentIndex = ( parentSlot < 0 ) ? serviceIndex( service ) : layerIndex( service, parentSlot );
+  beginRemoveRows( parentIndex, row, row + count - 1 );
+  for ( int i = row; i < row + count; ++i )
+  {
+    markLayerRemoved( service, children.at( i ) );
+  }
+  children.remove( row, count );
+  for ( int i = row; i < children.size(); ++i )
+  {
+    service->layers[children.at( i )].row = i;
+  }
+  endRemoveRows();
+}
+
+void WebDataModel::indexLayer( const Service* service, int slot )
+{
+  //layer groups are shown if one of their sublayers matches
+  const Layer& layer = service->layers.at( slot );
+  if ( layer.flags & GroupFlag )
+  {
+    return;
+  }
+  mSearchIndex.addDocument( internalId( service, slot ), layer.name, layer.title, layer.abstract,
+                            mStrings.string( layer.keywords ).split( ",", QString::SkipEmptyParts ) );
+}
+
+void WebDataModel::addLayerFacets( Service* service, int slot )
+{
+  Layer& layer = service->layers[slot];
+  if ( layer.flags & GroupFlag )
+  {
+    return;
+  }
+
+  QString type = mStrings.string( service->type );
+  layer.number = mFacets.addLayer();
+  mFacets.setFacet( layer.number, WebDataFacetIndex::WMSFacet, type == "WMS" );
+  mFacets.setFacet( layer.number, WebDataFacetIndex::WFSFacet, type == "WFS" );
+  mFacets.setFacet( layer.number, WebDataFacetIndex::OfflineFacet, layer.flags & OfflineFlag );
+  mFacets.setFacet( layer.number, WebDataFacetIndex::InMapFacet, layer.flags & InMapFlag );
+  mFacets.setCrs( layer.number, layer.crs );
+}
+
+void WebDataModel::setLayerExtent( Service* service, int slot, bool hasExtent, double west, double south, double east,
+                                   double north )
+{
+  Layer& layer = service->layers[slot];
+  if ( layer.flags & GroupFlag )
+  {
+    return;
+  }
+
+  bool hadExtent = ( layer.flags & ExtentFlag );
+  if ( hadExtent == hasExtent && ( !hasExtent || ( layer.west == float( west ) && layer.south == float( south )
+                                   && layer.east == float( east ) && layer.north == float( north ) ) ) )
+  {
+    return;
+  }
+
+  QgsFeatureId id = QgsFeatureId( internalId( service, slot ) );
+  if ( hadExtent )
+  {
+    //the R-tree finds the entry by its bounds
+    QgsFeature feature( id );
+    feature.setGeometry( QgsGeometry::fromRect( layerExtent( layer ) ) );
+    mExtentIndex.deleteFeature( feature );
+    layer.flags &= ~ExtentFlag;
+  }
+
+  if ( hasExtent )
+  {
+    layer.west = west;
+    layer.south = south;
+    layer.east = east;
+    layer.north = north;
+    layer.flags |= ExtentFlag;
+    mExtentIndex.insertFeature( id, layerExtent( layer ) );
+  }
+}
+
+QgsRectangle WebDataModel::layerExtent( const Layer& layer )
+{
+  //extents crossing the antimeridian are taken as the whole longitude range
+  if ( layer.west > layer.east )
+  {
+    return QgsRectangle( -180.0, layer.south, 180.0, layer.north );
+  }
+  return QgsRectangle( layer.west, layer.south, layer.east, layer.north );
+}
+
+void WebDataModel::setLayerFlag( Layer& layer, LayerFlag flag, bool on )
+{
+  if ( on )
+  {
+    layer.flags |= flag;
+  }
+  else
+  {
+    layer.flags &= ~flag;
+  }
+
+  if ( flag == InMapFlag )
+  {
+    mFacets.setFacet( layer.number, WebDataFacetIndex::InMapFacet, on );
+  }
+  else if ( flag == OfflineFlag )
+  {
+    mFacets.setFacet( layer.number, WebDataFacetIndex::OfflineFacet, on );
+  }
+}
+
+void WebDataModel::markLayerRemoved( Service* service, int slot )
+{
+  mSearchIndex.removeDocument( internalId( service, slot ) );
+  if ( !service->layers.at( slot ).layerId.isEmpty() )
+  {
+    setMapLayerId( service, slot, QString() );
+  }
+  setLayerExtent( service, slot, false, 0, 0, 0, 0 );
+  //the slot keeps nothing but the flag, so removed layers don't hold on to their strings and child vectors
+  Layer& layer = service->layers[slot];
+  mFacets.removeLayer( layer.number );
+  QVector<int> children = layer.children;
+  layer = Layer();
+  layer.flags = RemovedFlag;
+  QVector<int>::const_iterator childIt = children.constBegin();
+  for ( ; childIt != children.constEnd(); ++childIt )
+  {
+    markLayerRemoved( service, *childIt );
+  }
+}
+
+QModelIndex WebDataModel::serviceIndex( const Service* service, int column ) const
+{
+  int row = mServices.indexOf( const_cast<Service*>( service ) );
+  if ( row < 0 )
+  {
+    return QModelIndex();
+  }
+  return createIndex( row, column, internalId( service, -1 ) );
+}
+
+QModelIndex WebDataModel::layerIndex( const Service* service, int slot, int column ) const
+{
+  if ( !service || slot < 0 || slot >= service->layers.size() )
+  {
+    return QModelIndex();
+  }
+  return createIndex( service->layers.at( slot ).row, column, internalId( service, slot ) );
+}
+
+WebDataModel::Service* WebDataModel::serviceFromIndex( const QModelIndex& index ) const
+{
+  if ( !index.isValid() || index.model() != this )
+  {
+    return 0;
+  }
+  return mServiceById.value( quint32( index.internalId() >> SLOT_BITS ), 0 );
+}
+
+int WebDataModel::slotFromIndex( const QModelIndex& index )
+{
+  if ( !index.isValid() )
+  {
+    return -1;
+  }
+  return int( index.internalId() & SLOT_MASK ) - 1;
+}
+
+WebDataModel::Layer* WebDataModel::layerFromIndex( const QModelIndex& index ) const
+{
+  Service* service = serviceFromIndex( index );
+  int slot = slotFromIndex( index );
+  if ( !service || slot < 0 || slot >= service->layers.size() || ( service->layers.at( slot ).flags & RemovedFlag ) )
+  {
+    return 0;
+  }
+  return &( service->layers[slot] );
+}
+
+WebDataModel::Service* WebDataModel::serviceByTitle( const QString& title ) const
+{
+  QList<Service*>::const_iterator serviceIt = mServices.constBegin();
+  for ( ; serviceIt != mServices.constEnd(); ++serviceIt )
+  {
+    if ( ( *serviceIt )->title == title )
+    {
+      return *serviceIt;
+    }
+  }
+  return 0;
+}
+
+const QVector<int>& WebDataModel::childSlots( const Service* service, int slot )
+{
+  if ( slot < 0 )
+  {
+    return service->topLevel;
+  }
+  return service->layers.at( slot ).children;
+}
+
+quintptr WebDataModel::internalId( const Service* service, int slot ) const
+{
+  return ( quintptr( service->id ) << SLOT_BITS ) | quintptr( slot + 1 );
+}
+
+void WebDataModel::emitLayerChanged( const QModelIndex& index, int firstColumn, int lastColumn )
+{
+  if ( !index.isValid() )
+  {
+    return;
+  }
+  emit dataChanged( index.sibling( index.row(), firstColumn ), index.sibling( index.row(), lastColumn ) );
+}
+
+void WebDataModel::syncLayerRemove( QStringList theLayerIds )
+{
+  QStringList::const_iterator idIt = theLayerIds.constBegin();
+  for ( ; idIt != theLayerIds.constEnd(); ++idIt )
+  {
+    QHash<QString, MapLayerRow>::const_iterator rowIt = mMapLayerRows.constFind( *idIt );
+    if ( rowIt == mMapLayerRows.constEnd() )
+    {
+      continue;
+    }
+
+    Service* service = mServiceById.value( rowIt->first, 0 );
+    int slot = rowIt->second;
+    if ( !service )
+    {
+      mMapLayerRows.remove( *idIt );
+      continue;
+    }
+    setLayerFlag( service->layers[slot], InMapFlag, false );
+    setMapLayerId( service, slot, QString() );
+    emitLayerChanged( layerIndex( service, slot ), InMapColumn, InMapColumn );
+  }
+}
+
+void WebDataModel::setMapLayerId( Service* service, int slot, const QString& layerId )
+{
+  Layer& layer = service->layers[slot];
+  if ( !layer.layerId.isEmpty() )
+  {
+    mMapLayerRows.remove( layer.layerId );
+  }
+  layer.layerId = layerId;
+  if ( !layerId.isEmpty() )
+  {
+    mMapLayerRows.insert( layerId, MapLayerRow( service->id, slot ) );
+  }
+}
+
+void WebDataModel::addEntryToMap( const QModelIndex& index )
+{
+  if ( !mIface )
+  {
+    return;
+  }
+
+  QString layername = layerName( index );
+  QString type = serviceType( index );//wms / wfs ?
+  Layer* layer = layerFromIndex( index );
+  if ( !layer || !( layer->flags & InMapFlag ) )
+  {
+    return;
+  }
+  bool offline = ( layer->flags & OfflineFlag );
+  QString filePath = layer->filePath;
+
+  QgsMapLayer* mapLayer = 0;
+  if ( type == "WMS" )
+  {
+    if ( offline )
+    {
+      mapLayer = mIface->addRasterLayer( filePath, layername );
+    }
+    else
+    {
+      QgsDataSourceUri uri = wmsUriFromIndex( index );
+      mapLayer = mIface->addRasterLayer( uri.encodedUri(), layername, "wms" );
+    }
+  }
+  else if ( type == "WFS" )
+  {
+    QString url = wfsUrlFromLayerIndex( index );
+    if ( offline )
+    {
+      mapLayer =  mIface->addVectorLayer( filePath, layername, "ogr" );
+    }
+    else
+    {
+      mapLayer = mIface->addVectorLayer( url, layername, "WFS" );
+    }
+  }
+
+  //adding layers may trigger event processing, get the record again
+  layer = layerFromIndex( index );
+  if ( !layer )
+  {
+    return;
+  }
+  if ( mapLayer )
+  {
+    setMapLayerId( serviceFromIndex( index ), slotFromIndex( index ), mapLayer->id() );
+  }
+  else
+  {
+    setLayerFlag( *layer, InMapFlag, false );
+  }
+  emitLayerChanged( index, InMapColumn, InMapColumn );
+}
+
+void WebDataModel::removeEntryFromMap( const QModelIndex& index )
+{
+  Layer* layer = layerFromIndex( index );
+  if ( !layer )
+  {
+    return;
+  }
+
+  QString layerId = layer->layerId;
+  QgsProject::instance()->removeMapLayers( QStringList() << layerId );
+
+  layer = layerFromIndex( index );
+  if ( layer )
+  {
+    setLayerFlag( *layer, InMapFlag, false );
+    setMapLayerId( serviceFromIndex( index ), slotFromIndex( index ), QString() );
+    emitLayerChanged( index, InMapColumn, InMapColumn );
+  }
+}
+
+void WebDataModel::changeEntryToOffline( const QModelIndex& index )
+{
+  changeEntriesToOffline( QModelIndexList() << index );
+}
+
+void WebDataModel::changeEntriesToOffline( const QModelIndexList& indexes )
+{
+  //the save dialog processes events, the model may change in between
+  QList<QPersistentModelIndex> layerIndexes;
+  QModelIndexList::const_iterator indexIt = indexes.constBegin();
+  for ( ; indexIt != indexes.constEnd(); ++indexIt )
+  {
+    //skip layer groups, offline layers and layers which are being taken offline
+    if ( layerStatus( *indexIt ).compare( "online", Qt::CaseInsensitive ) == 0 && !offlineJobRunning( *indexIt ) )
+    {
+      layerIndexes.append( QPersistentModelIndex( indexIt->sibling( indexIt->row(), 0 ) ) );
+    }
+  }
+
+  //the output of the first WMS layer is asked for once and used for all WMS layers
+  RasterOfflineSettings rasterSettings;
+  bool rasterSettingsValid = false;
+  QList<QPersistentModelIndex>::const_iterator layerIt = layerIndexes.constBegin();
+  for ( ; layerIt != layerIndexes.constEnd(); ++layerIt )
+  {
+    if ( !layerIt->isValid() )
+    {
+      continue;
+    }
+
+    //wms / wfs ?
+    QString type = serviceType( *layerIt );
+    if ( type == "WFS" )
+    {
+      startVectorOfflineJob( *layerIt );
+    }
+    else if ( type == "WMS" && !startRasterOfflineJob( *layerIt, rasterSettings, rasterSettingsValid ) )
+    {
+      //save dialog cancelled
+      break;
+    }
+  }
+}
+
+void WebDataModel::startVectorOfflineJob( const QModelIndex& index )
+{
+  QString layername = layerName( index );
+
+  //an interrupted download of the layer continues
+  QMap<QString, QString> parameters;
+  QString manifestPath = WebDataOfflineCheckpoint::findManifest( offlineDirectory(), offlineSource( index ) );
+  if ( manifestPath.isEmpty() || !WebDataOfflineCheckpoint::readParameters( manifestPath, parameters ) )
+  {
+    QDateTime dt = QDateTime::currentDateTime();
+    manifestPath = offlineDirectory() + layername + dt.toString( "yyyyMMddhhmmsszzz" ) + ".checkpoint";
+    parameters.clear();
+    parameters.insert( "source", offlineSource( index ) );
+    parameters.insert( "pageGrid", QString::number( QSettings().value( "/NIWA/offlineVectorPageGrid", 4 ).toInt() ) );
+  }
+
+  QFileInfo manifestInfo( manifestPath );
+  QString layerId = manifestInfo.completeBaseName();
+  QString outputPath = manifestInfo.absolutePath() + "/" + layerId;
+  QString filePath = outputPath + "/" + layerId + ".shp";
+  manifestInfo.absoluteDir().mkdir( layerId );
+
+  //the layer is created by the job, in its thread. The size of a feature type is not known before it has been
+  //downloaded, so the job counts as small
+  WebDataVectorOfflineTask* task = new WebDataVectorOfflineTask( tr( "Taking %1 offline" ).arg( layername ),
+      wfsUrlFromLayerIndex( index ), layername, filePath, outputPath, parameters.value( "pageGrid" ).toInt() );
+  WebDataOfflineCheckpoint* checkpoint = new WebDataOfflineCheckpoint( manifestPath, outputPath );
+  checkpoint->setParameters( parameters );
+  task->setCheckpoint( checkpoint );
+  startOfflineJob( index, task, 0 );
+}
+
+bool WebDataModel::startRasterOfflineJob( const QModelIndex& index, RasterOfflineSettings& settings, bool& settingsValid )
+{
+  QPersistentModelIndex layerPersistentIndex( index );
+  QString layername = layerName( index );
+
+  //an interrupted download of the layer continues with the output it was started with
+  QString manifestPath = WebDataOfflineCheckpoint::findManifest( offlineDirectory(), offlineSource( index ) );
+  QMap<QString, QString> checkpointParameters;
+  if ( !manifestPath.isEmpty() && WebDataOfflineCheckpoint::readParameters( manifestPath, checkpointParameters ) )
+  {
+    if ( QMessageBox::question( 0, tr( "Interrupted download" ), tr( "The download of %1 has been interrupted. "
+                                "Do you want to resume it?" ).arg( layername ), QMessageBox::Yes | QMessageBox::No )
+         == QMessageBox::Yes )
+    {
+      startRasterOfflineJob( layerPersistentIndex, manifestPath, checkpointParameters );
+      return true;
+    }
+    removeCheckpoint( manifestPath );
+  }
+
+  bool inMap = layerInMap( index );
+  QString mapLayerId = index.sibling( index.row(), InMapColumn ).data( DataRole ).toString();
+
+  //get raster layer
+  QgsRasterLayer* wmsLayer = 0;
+  if ( inMap )
+  {
+    wmsLayer = static_cast<QgsRasterLayer*>( QgsProject::instance()->mapLayer( mapLayerId ) );
+  }
+  else
+  {
+    QgsDataSourceUri uri = wmsUriFromIndex( index );
+    wmsLayer = new QgsRasterLayer( uri.encodedUri(), layername, "wms" );
+  }
+
+  if ( !settingsValid )
+  {
+    //call save as dialog
     QgsRasterLayerSaveAsDialog d( wmsLayer, wmsLayer->dataProvider(),  mIface->mapCanvas()->extent(), wmsLayer->crs(),
                                   mIface->mapCanvas()->mapSettings().destinationCrs() );
     d.hideFormat();
     d.hideOutput();
-    if ( d.exec() == QDialog::Accepted )
+    if ( d.exec() != QDialog::Accepted )
+    {
+      if ( !inMap )
+      {
+        delete wmsLayer;
+      }
+      return false;
+    }
+
+    settings.extent = d.outputRectangle();
+    settings.crs = wmsLayer->crs();
+    settings.columns = d.nColumns();
+    settings.rows = d.nRows();
+    settings.tiled = d.tileMode();
+    settings.tileWidth = d.maximumTileSizeX();
+    settings.tileHeight = d.maximumTileSizeY();
+    settingsValid = true;
+  }
+
+  //the same area for layers in other CRS
+  QgsRectangle extent = settings.extent;
+  bool extentOk = layerPersistentIndex.isValid();
+  if ( extentOk && wmsLayer->crs() != settings.crs )
+  {
+    QgsCoordinateTransform ct( settings.crs, wmsLayer->crs(), QgsProject::instance() );
+    try
+    {
+      extent = ct.transformBoundingBox( extent );
+    }
+    catch ( QgsCsException& )
+    {
+      QgsDebugMsg( "Cannot transform the offline extent for " + layername );
+      extentOk = false;
+    }
+  }
+
+  if ( extentOk )
+  {
+    QDateTime dt = QDateTime::currentDateTime();
+    QString layerId = layername + dt.toString( "yyyyMMddhhmmsszzz" );
+
+    //the largest tiles the server accepts (the tile size of the dialog is an upper limit in tile mode)
+    QSettings s;
+    Service* service = serviceFromIndex( index );
+    int tileWidth = service->maxImageSize.width() > 0 ? service->maxImageSize.width() :
+                    s.value( "/NIWA/offlineTileSize", 2048 ).toInt();
+    int tileHeight = service->maxImageSize.height() > 0 ? service->maxImageSize.height() :
+                     s.value( "/NIWA/offlineTileSize", 2048 ).toInt();
+    if ( settings.tiled )
+    {
+      tileWidth = qMin( tileWidth, settings.tileWidth );
+      tileHeight = qMin( tileHeight, settings.tileHeight );
+    }
+
+    //everything the job needs, so it can be resumed from the checkpoint
+    QgsDataSourceUri uri = wmsUriFromIndex( index );
+    QMap<QString, QString> parameters;
+    parameters.insert( "source", offlineSource( index ) );
+    parameters.insert( "url", uri.param( "url" ) );
+    parameters.insert( "layers", uri.param( "layers" ) );
+    parameters.insert( "styles", uri.param( "styles" ) );
+    parameters.insert( "format", uri.param( "format" ) );
+    parameters.insert( "version", service->version );
+    parameters.insert( "crs", wmsLayer->crs().authid() );
+    parameters.insert( "extent", QString( "%1,%2,%3,%4" ).arg( qgsDoubleToString( extent.xMinimum() ) )
+                       .arg( qgsDoubleToString( extent.yMinimum() ) ).arg( qgsDoubleToString( extent.xMaximum() ) )
+                       .arg( qgsDoubleToString( extent.yMaximum() ) ) );
+    parameters.insert( "columns", QString::number( settings.columns ) );
+    parameters.insert( "rows", QString::number( settings.rows ) );
+    parameters.insert( "maxTileWidth", QString::number( tileWidth ) );
+    parameters.insert( "maxTileHeight", QString::number( tileHeight ) );
+    startRasterOfflineJob( layerPersistentIndex, offlineDirectory() + layerId + ".checkpoint", parameters );
+  }
+
+  if ( !inMap )
+  {
+    delete wmsLayer;
+  }
+  return true;
+}
+
+void WebDataModel::startRasterOfflineJob( const QModelIndex& index, const QString& manifestPath,
+    const QMap<QString, QString>& parameters )
+{
+  QFileInfo manifestInfo( manifestPath );
+  QString layerId = manifestInfo.completeBaseName();
+  QString outputPath = manifestInfo.absolutePath() + "/" + layerId;
+  QString filePath = outputPath + "/" + layerId + ".vrt";
+  manifestInfo.absoluteDir().mkdir( layerId );
+
+  WebDataRasterOfflineTask::GetMapParameters getMapParameters;
+  getMapParameters.url = parameters.value( "url" );
+  getMapParameters.layers = parameters.value( "layers" );
+  getMapParameters.styles = parameters.value( "styles" );
+  getMapParameters.format = parameters.value( "format" );
+  getMapParameters.version = parameters.value( "version" );
+  getMapParameters.crs = QgsCoordinateReferenceSystem::fromOgcWmsCrs( parameters.value( "crs" ) );
+  QStringList extentValues = parameters.value( "extent" ).split( "," );
+  QgsRectangle extent( extentValues.value( 0 ).toDouble(), extentValues.value( 1 ).toDouble(),
+                       extentValues.value( 2 ).toDouble(), extentValues.value( 3 ).toDouble() );
+  int columns = parameters.value( "columns" ).toInt();
+  int rows = parameters.value( "rows" ).toInt();
+
+  WebDataRasterOfflineTask* task = new WebDataRasterOfflineTask( tr( "Taking %1 offline" ).arg( layerName( index ) ),
+      getMapParameters, extent, columns, rows, parameters.value( "maxTileWidth" ).toInt(),
+      parameters.value( "maxTileHeight" ).toInt(), QSettings().value( "/NIWA/maxGetMapRequests", 4 ).toInt(), filePath,
+      outputPath );
+  WebDataOfflineCheckpoint* checkpoint = new WebDataOfflineCheckpoint( manifestPath, outputPath );
+  checkpoint->setParameters( parameters );
+  task->setCheckpoint( checkpoint );
+  //four bytes per pixel before compression
+  startOfflineJob( index, task, qint64( columns ) * rows * 4 );
+}
+
+QString WebDataModel::offlineDirectory()
+{
+  return QgsApplication::qgisSettingsDirPath() + "/cachelayers/";
+}
+
+QString WebDataModel::offlineSource( const QModelIndex& index ) const
+{
+  Service* service = serviceFromIndex( index );
+  return QString( "%1|%2|%3" ).arg( serviceType( index ), service ? service->url : QString(), layerName( index ) );
+}
+
+void WebDataModel::removeCheckpoint( const QString& manifestPath )
+{
+  QFileInfo manifestInfo( manifestPath );
+  QDir( manifestInfo.absolutePath() + "/" + manifestInfo.completeBaseName() ).removeRecursively();
+  QFile::remove( manifestPath );
+}
+
+void WebDataModel::startOfflineJob( const QModelIndex& index, WebDataOfflineTask* task, qint64 estimatedSize )
+{
+  mOfflineJobs.insert( index.internalId(), task );
+  mOfflineJobIds.insert( task, index.internalId() );
+  connect( task, SIGNAL( progressChanged( double ) ), this, SLOT( offlineJobProgress() ) );
+  connect( task, SIGNAL( bytesWrittenChanged( qint64 ) ), this, SLOT( offlineJobProgress() ) );
+  Service* service = serviceFromIndex( index );
+  mOfflineScheduler.addJob( task, QUrl( service->url ).host(), estimatedSize );
+  emitLayerChanged( index, StatusColumn, StatusColumn );
+}
+
+bool WebDataModel::offlineJobRunning( const QModelIndex& index ) const
+{
+  //indices of other models or of removed services are never keys of mOfflineJobs
+  return serviceFromIndex( index ) && mOfflineJobs.contains( index.internalId() );
+}
+
+void WebDataModel::cancelOfflineJob( const QModelIndex& index )
+{
+  if ( !serviceFromIndex( index ) )
+  {
+    return;
+  }
+
+  //the job removes its files and ends with offlineJobTerminated()
+  WebDataOfflineTask* task = mOfflineJobs.value( index.internalId(), 0 );
+  if ( task )
+  {
+    mOfflineScheduler.cancelJob( task );
+  }
+}
+
+QModelIndex WebDataModel::offlineJobIndex( const WebDataOfflineTask* task ) const
+{
+  QHash<const WebDataOfflineTask*, quintptr>::const_iterator idIt = mOfflineJobIds.constFind( task );
+  if ( idIt == mOfflineJobIds.constEnd() )
+  {
+    return QModelIndex();
+  }
+
+  Service* service = mServiceById.value( quint32( quint64( idIt.value() ) >> SLOT_BITS ), 0 );
+  int slot = int( quint64( idIt.value() ) & SLOT_MASK ) - 1;
+  if ( !service || slot < 0 || slot >= service->layers.size() || ( service->layers.at( slot ).flags & RemovedFlag ) )
+  {
+    return QModelIndex();
+  }
+  return layerIndex( service, slot );
+}
+
+void WebDataModel::takeOfflineJob( const WebDataOfflineTask* task )
+{
+  QHash<const WebDataOfflineTask*, quintptr>::iterator idIt = mOfflineJobIds.find( task );
+  if ( idIt == mOfflineJobIds.end() )
+  {
+    return;
+  }
+  mOfflineJobs.remove( idIt.value() );
+  mOfflineJobIds.erase( idIt );
+}
+
+void WebDataModel::offlineJobProgress()
+{
+  QModelIndex index = offlineJobIndex( qobject_cast<WebDataOfflineTask*>( sender() ) );
+  if ( index.isValid() )
+  {
+    emitLayerChanged( index, StatusColumn, StatusColumn );
+  }
+}
+
+void WebDataModel::offlineJobCompleted( WebDataOfflineTask* task )
+{
+  QModelIndex index = offlineJobIndex( task );
+  takeOfflineJob( task );
+  QString replacedFilePath = mReloadJobs.take( task );
+  Service* service = serviceFromIndex( index );
+  Layer* layer = layerFromIndex( index );
+  if ( !service || !layer )
+  {
+    //the layer has been removed from the catalogue in the meantime
+    deleteOfflineDatasource( qobject_cast<WebDataVectorOfflineTask*>( task ) ? "WFS" : "WMS", task->filePath() );
+    return;
+  }
+
+  //the map layer of an offline layer is exchanged with the new copy directly, it does not go online in between
+  QString type = mStrings.string( service->type );
+  if ( layer->flags & InMapFlag )
+  {
+    QgsMapLayer* offlineLayer = 0;
+    if ( type == "WFS" )
+    {
+      offlineLayer = mIface->addVectorLayer( task->filePath(), layer->name, "ogr" );
+    }
+    else
+    {
+      offlineLayer = mIface->addRasterLayer( task->filePath(), layer->name );
+    }
+    exchangeLayer( layer->layerId, offlineLayer );
+  }
+
+  //exchangeLayer() changes the map layer rows
+  layer = layerFromIndex( index );
+  if ( !layer )
+  {
+    return;
+  }
+  setLayerFlag( *layer, OfflineFlag, true );
+  layer->filePath = task->filePath();
+  emitLayerChanged( index, InMapColumn, StatusColumn );
+  storeLayerState( service, slotFromIndex( index ) );
+
+  //the old copy is not used any more
+  if ( !replacedFilePath.isEmpty() && replacedFilePath != task->filePath() )
+  {
+    deleteOfflineDatasource( type, replacedFilePath );
+  }
+}
+
+void WebDataModel::offlineJobTerminated( WebDataOfflineTask* task )
+{
+  QModelIndex index = offlineJobIndex( task );
+  takeOfflineJob( task );
+  //a reloaded layer keeps its old copy
+  mReloadJobs.remove( task );
+  if ( !index.isValid() )
+  {
+    return;
+  }
+
+  //the layer keeps its state (online or the old offline copy). The job has removed its files unless it can be resumed
+  emitLayerChanged( index, StatusColumn, StatusColumn );
+  WebDataVectorSyncTask* syncTask = qobject_cast<WebDataVectorSyncTask*>( task );
+  if ( syncTask && syncTask->fullReloadRequired() )
+  {
+    startOfflineReload( index );
+    return;
+  }
+  if ( !task->errorMessage().isEmpty() )
+  {
+    emit offlineJobFailed( layerName( index ), task->errorMessage() );
+  }
+}
+
+void WebDataModel::changeEntryToOnline( const QModelIndex& index )
+{
+  bool inMap = layerInMap( index );
+  QString type = serviceType( index );
+  QString layername = layerName( index );
+
+  Layer* layer = layerFromIndex( index );
+  if ( !layer || ( layer->flags & GroupFlag ) )
+  {
+    return;
+  }
+  QString mapLayerId = layer->layerId;
+  QString offlineFileName = layer->filePath;
+
+  QApplication::setOverrideCursor( QCursor( Qt::WaitCursor ) );
+
+  if ( inMap )
+  {
+    //generate new wfs/wms layer
+    //exchange with layer in map
+    QgsMapLayer* onlineLayer = 0;
+    if ( type == "WFS" )
+    {
+      QString wfsUrl = wfsUrlFromLayerIndex( index );
+      onlineLayer = mIface->addVectorLayer( wfsUrl, layername, "WFS" );
+    }
+    else if ( type == "WMS" )
+    {
+      //add to map
+      QgsDataSourceUri uri = wmsUriFromIndex( index );
+      onlineLayer = mIface->addRasterLayer( uri.encodedUri(), layername, "wms" );
+    }
+
+    if ( onlineLayer )
+    {
+      exchangeLayer( mapLayerId, onlineLayer );
+    }
+  }
+
+  deleteOfflineDatasource( type, offlineFileName );
+
+  layer = layerFromIndex( index );
+  if ( !layer )
+  {
+    return;
+  }
+  setLayerFlag( *layer, OfflineFlag, false );
+  layer->filePath.clear();
+  emitLayerChanged( index, InMapColumn, StatusColumn );
+  storeLayerState( serviceFromIndex( index ), slotFromIndex( index ) );
+}
+
+void WebDataModel::reload( const QModelIndex& index )
+{
+  Service* service = serviceFromIndex( index );
+  if ( !service )
+  {
+    return;
+  }
+
+  QString name = layerName( index );
+  QString status = layerStatus( index );
+  QString type = serviceType( index );
+
+  if ( slotFromIndex( index ) < 0 ) //update service
+  {
+    addService( name, service->url, type, true );
+  }
+  else if ( status.compare( "online", Qt::CaseInsensitive ) == 0 || status.isEmpty() ) //online layer or layer group
+  {
+    return;
+  }
+  else if ( ( type.compare( "WMS", Qt::CaseInsensitive ) == 0 || type.compare( "WFS", Qt::CaseInsensitive ) == 0 )
+            && !offlineJobRunning( index ) ) //update offline layer
+  {
+    //offline WFS layers only download the changed features. offlineJobTerminated() falls back to a full reload if
+    //the layer cannot be synchronised
+    if ( type.compare( "WFS", Qt::CaseInsensitive ) == 0 && QSettings().value( "/NIWA/wfsDeltaSync", true ).toBool() )
+    {
+      startVectorSyncJob( index );
+    }
+    else
+    {
+      startOfflineReload( index );
+    }
+  }
+}
+
+void WebDataModel::startOfflineReload( const QModelIndex& index )
+{
+  //the new copy is staged in a directory of its own, offlineJobCompleted() swaps it with the old one
+  Layer* layer = layerFromIndex( index );
+  if ( !layer )
+  {
+    return;
+  }
+  QString oldFilePath = layer->filePath;
+  if ( serviceType( index ).compare( "WFS", Qt::CaseInsensitive ) == 0 )
+  {
+    startVectorOfflineJob( index );
+  }
+  else
+  {
+    RasterOfflineSettings settings;
+    bool settingsValid = rasterOfflineSettings( oldFilePath, settings );
+    startRasterOfflineJob( index, settings, settingsValid );
+  }
+
+  WebDataOfflineTask* task = mOfflineJobs.value( index.internalId(), 0 );
+  if ( task )
+  {
+    mReloadJobs.insert( task, oldFilePath );
+  }
+}
+
+void WebDataModel::startVectorSyncJob( const QModelIndex& index )
+{
+  //the changes are applied to a copy in a directory of its own, offlineJobCompleted() swaps it with the old one
+  Layer* layer = layerFromIndex( index );
+  if ( !layer )
+  {
+    return;
+  }
+  QString oldFilePath = layer->filePath;
+  QString layername = layerName( index );
+  QString layerId = layername + QDateTime::currentDateTime().toString( "yyyyMMddhhmmsszzz" );
+  QString outputPath = offlineDirectory() + layerId;
+  QString filePath = outputPath + "/" + layerId + ".shp";
+
+  //the job creates the directory, so a job cancelled while waiting leaves nothing behind
+  WebDataVectorSyncTask* task = new WebDataVectorSyncTask( tr( "Synchronising %1" ).arg( layername ),
+      wfsUrlFromLayerIndex( index ), layername, oldFilePath, filePath, outputPath );
+  startOfflineJob( index, task, 0 );
+  mReloadJobs.insert( task, oldFilePath );
+}
+
+bool WebDataModel::rasterOfflineSettings( const QString& filePath, RasterOfflineSettings& settings )
+{
+  QgsRasterLayer offlineLayer( filePath, QString(), "gdal", QgsRasterLayer::LayerOptions( false ) );
+  if ( !offlineLayer.isValid() )
+  {
+    return false;
+  }
+
+  settings.extent = offlineLayer.extent();
+  settings.crs = offlineLayer.crs();
+  settings.columns = offlineLayer.width();
+  settings.rows = offlineLayer.height();
+  settings.tiled = false;
+  return true;
+}
+
+QString WebDataModel::wfsUrlFromLayerIndex( const QModelIndex& index ) const
+{
+  Service* service = serviceFromIndex( index );
+  Layer* layer = layerFromIndex( index );
+  if ( !service || !layer )
+  {
+    return "";
+  }
+
+  QString url = service->url;
+  QString srs = mStrings.string( layer->crs );
+
+  url.append( "SERVICE=WFS&VERSION=1.0.0&REQUEST=GetFeature&TYPENAME=" );
+  url.append( layer->name );
+  if ( !srs.isEmpty() )
+  {
+    url.append( "&SRSNAME=" + srs );
+  }
+  return url;
+}
+
+QgsDataSourceUri WebDataModel::wmsUriFromIndex( const QModelIndex& index ) const
+{
+  Service* service = serviceFromIndex( index );
+  Layer* layer = layerFromIndex( index );
+  if ( !service || !layer )
+  {
+    return QgsDataSourceUri();
+  }
+
+  //QgsWMSConnection wmsConnection( parentItem->text() );
+  QgsDataSourceUri uri; // = wmsConnection.uri();
+  uri.setParam( "url", service->url );
+
+  //ignore advertised GetMap / GetFeatureInfo urls per derfault
+  uri.setParam( "IgnoreGetMapUrl", "1" );
+  uri.setParam( "IgnoreGetFeatureInfoUrl", "1" );
+
+  //name
+  uri.setParam( "layers", layer->name );
+
+  //format: prefer png
+  QString format;
+  QStringList formatList = mStrings.string( service->formats ).split( ",", QString::SkipEmptyParts );
+  if ( formatList.size() > 0 )
+  {
+    if ( formatList.contains( "image/png" ) )
+    {
+      format = "image/png";
+    }
+    else
+    {
+      format = formatList.at( 0 );
+    }
+  }
+  uri.setParam( "format", format );
+
+  //CRS: prefer map crs
+  QString crs;
+  QStringList crsList = mStrings.string( layer->crs ).split( ",", QString::SkipEmptyParts );
+  if ( crsList.size() > 0 && mIface )
+  {
+    crs = crsList.at( 0 );
+    QgsMapCanvas* canvas = mIface->mapCanvas();
+    if ( canvas )
+    {
+      const QgsMapSettings& settings = canvas->mapSettings();
+      const QgsCoordinateReferenceSystem& destCRS = settings.destinationCrs();
+      QString authId = destCRS.authid();
+      if ( crsList.contains( authId ) )
+      {
+        crs = authId;
+      }
+    }
+  }
+  uri.setParam( "crs", crs );
+
+  //styles: take first style
+  QString stylesString = mStrings.string( layer->styles );
+  uri.setParam( "styles", stylesString.isEmpty() ? QString( "" ) : stylesString.split( "," ).at( 0 ) );
+  return uri;
+}
+
+QString WebDataModel::layerName( const QModelIndex& index ) const
+{
+  Service* service = serviceFromIndex( index );
+  if ( !service )
+  {
+    return QString();
+  }
+
+  if ( slotFromIndex( index ) < 0 )
+  {
+    return service->title;
+  }
+  Layer* layer = layerFromIndex( index );
+  return layer ? layer->name : QString();
+}
+
+QString WebDataModel::serviceType( const QModelIndex& index ) const
+{
+  //wms / wfs ?
+  Service* service = serviceFromIndex( index );
+  if ( service )
+  {
+    return mStrings.string( service->type );
+  }
+  return QString();
+}
+
+QString WebDataModel::layerStatus( const QModelIndex& index ) const
+{
+  Layer* layer = layerFromIndex( index );
+  if ( !layer || ( layer->flags & GroupFlag ) )
+  {
+    return QString();
+  }
+  return ( layer->flags & OfflineFlag ) ? "offline" : "online";
+}
+
+QHash<quint64, double> WebDataModel::searchLayers( const QString& query, const QHash<quint64, double>* candidates ) const
+{
+  return mSearchIndex.search( query, candidates );
+}
+
+bool WebDataModel::layerInMap( const QModelIndex& index ) const
+{
+  Layer* layer = layerFromIndex( index );
+  return ( layer && ( layer->flags & InMapFlag ) );
+}
+
+QBitArray WebDataModel::facetMask( const FacetFilter& filter )
+{
+  QBitArray mask = mFacets.bits( WebDataFacetIndex::LayerFacet );
+  if ( filter.serviceType.compare( "WMS", Qt::CaseInsensitive ) == 0 )
+  {
+    mask &= mFacets.bits( WebDataFacetIndex::WMSFacet );
+  }
+  else if ( filter.serviceType.compare( "WFS", Qt::CaseInsensitive ) == 0 )
+  {
+    mask &= mFacets.bits( WebDataFacetIndex::WFSFacet );
+  }
+
+  if ( filter.status.compare( "offline", Qt::CaseInsensitive ) == 0 )
+  {
+    mask &= mFacets.bits( WebDataFacetIndex::OfflineFacet );
+  }
+  else if ( filter.status.compare( "online", Qt::CaseInsensitive ) == 0 )
+  {
+    mask &= ~mFacets.bits( WebDataFacetIndex::OfflineFacet );
+  }
+
+  if ( filter.onlyInMap )
+  {
+    mask &= mFacets.bits( WebDataFacetIndex::InMapFacet );
+  }
+
+  if ( !filter.crs.isEmpty() )
+  {
+    mask &= mFacets.crsBits( filter.crs );
+  }
+  return mask;
+}
+
+QHash<quint64, double> WebDataModel::layersInExtent( const QgsRectangle& extent ) const
+{
+  QHash<quint64, double> result;
+  double extentArea = extent.width() * extent.height();
+  QList<QgsFeatureId> ids = mExtentIndex.intersects( extent );
+  QList<QgsFeatureId>::const_iterator idIt = ids.constBegin();
+  for ( ; idIt != ids.constEnd(); ++idIt )
+  {
+    Service* service = mServiceById.value( quint32( quint64( *idIt ) >> SLOT_BITS ), 0 );
+    int slot = int( quint64( *idIt ) & SLOT_MASK ) - 1;
+    if ( !service || slot < 0 || slot >= service->layers.size() )
+    {
+      continue;
+    }
+
+    QgsRectangle intersection = layerExtent( service->layers.at( slot ) ).intersect( extent );
+    double share = ( extentArea > 0 ) ? intersection.width() * intersection.height() / extentArea : 1.0;
+    result.insert( quint64( *idIt ), share );
+  }
+  return result;
+}
+
+int WebDataModel::layerNumber( const QModelIndex& index ) const
+{
+  Layer* layer = layerFromIndex( index );
+  return layer ? layer->number : -1;
+}
+
+bool WebDataModel::layerFavourite( const QModelIndex& index ) const
+{
+  Layer* layer = layerFromIndex( index );
+  return ( layer && ( layer->flags & FavouriteFlag ) );
+}
+
+bool WebDataModel::exchangeLayer( const QString& layerId, QgsMapLayer* newLayer )
+{
+  if ( !mIface )
+  {
+    return false;
+  }
+
+  QgsMapLayer* oldLayer = QgsProject::instance()->mapLayer( layerId );
+  if ( !oldLayer || !newLayer )
+  {
+    return false;
+  }
+
+  if ( newLayer->type() == QgsMapLayer::VectorLayer )
+  {
+    QgsVectorLayer* newVectorLayer = static_cast<QgsVectorLayer*>( newLayer );
+    QgsVectorLayer* oldVectorLayer = static_cast<QgsVectorLayer*>( oldLayer );
+
+    //write old style
+    QDomDocument vectorQMLDoc;
+    QDomElement qmlRootElem = vectorQMLDoc.createElement( "qgis" );
+    vectorQMLDoc.appendChild( qmlRootElem );
+    QString errorMessage;
+    QgsReadWriteContext rwContext;
+    if ( !oldVectorLayer->writeSymbology( qmlRootElem, vectorQMLDoc, errorMessage, rwContext ) )
+    {
+      return false;
+    }
+
+    //set old style to new layer
+    if ( !newVectorLayer->readSymbology( qmlRootElem, errorMessage, rwContext ) )
+    {
+      return false;
+    }
+  }
+
+  //move new layer next to the old one
+  //remove old layer
+    legendMoveLayer( newLayer, oldLayer );
+    //todo: refreshSymbology() still necessary?
+
+  disconnect( QgsProject::instance(), SIGNAL( layersWillBeRemoved( QStringList ) ), this,
+              SLOT( syncLayerRemove( QStringList ) ) );
+  QgsProject::instance()->removeMapLayers( QStringList() << layerId );
+  connect( QgsProject::instance(), SIGNAL( layersWillBeRemoved( QStringList ) ), this,
+           SLOT( syncLayerRemove( QStringList ) ) );
+
+  //the catalogue row now refers to the new layer
+  QHash<QString, MapLayerRow>::const_iterator rowIt = mMapLayerRows.constFind( layerId );
+  if ( rowIt != mMapLayerRows.constEnd() )
+  {
+    Service* service = mServiceById.value( rowIt->first, 0 );
+    if ( service )
+    {
+      setMapLayerId( service, rowIt->second, newLayer->id() );
+    }
+  }
+  return false;
+}
+
+void WebDataModel::deleteOfflineDatasource( const QString& serviceType, const QString& offlinePath )
+{
+  if ( serviceType == "WFS" )
+  {
+    QgsVectorFileWriter::deleteShapeFile( offlinePath );
+    QFile::remove( WebDataSyncState::statePath( offlinePath ) );
+
+    //resumable downloads write the shapefile into a directory of the same name
+    QFileInfo shapeFileInfo( offlinePath );
+    QDir shapeFileDir = shapeFileInfo.absoluteDir();
+    QString dirName = shapeFileDir.dirName();
+    if ( dirName == shapeFileInfo.completeBaseName() && shapeFileDir.cdUp() )
+    {
+      shapeFileDir.rmdir( dirName );
+    }
+  }
+  else if ( serviceType == "WMS" )
+  {
+    //remove files in directory
+    QDir rasterFileDir( QFileInfo( offlinePath ).absolutePath() );  //raster offline is always in a directory
+    QFileInfoList rasterFileList = rasterFileDir.entryInfoList( QDir::Files | QDir::NoDotAndDotDot );
+    QFileInfoList::iterator it = rasterFileList.begin();
+    for ( ; it != rasterFileList.end(); ++it )
+    {
+      QFile::remove( it->absoluteFilePath() );
+    }
+
+    //remove the directory itself
+    QString dirName = rasterFileDir.dirName();
+    if ( rasterFileDir.cdUp() )
+    {
+      rasterFileDir.rmdir( dirName );
+    }
+  }
+}
+
+QString WebDataModel::layerIdFromUrl( const QString& url, const QString& serviceType, bool online,
+                                      const QString& layerName )
+{
+  if ( !mProjectLayerIndexValid )
+  {
+    buildProjectLayerIndex();
+  }
+
+  QString key = online ? serviceSourceKey( serviceType, url, layerName ) : fileSourceKey( url );
+  return mProjectLayerIndex.value( key );
+}
+
+void WebDataModel::buildProjectLayerIndex()
+{
+  mProjectLayerIndex.clear();
+
+  const QMap<QString, QgsMapLayer*>& layerMap = QgsProject::instance()->mapLayers();
+  QMap<QString, QgsMapLayer*>::const_iterator layerIt = layerMap.constBegin();
+  for ( ; layerIt != layerMap.constEnd(); ++layerIt )
+  {
+    const QgsMapLayer* layer = layerIt.value();
+    if ( !layer )
     {
-      QApplication::setOverrideCursor( QCursor( Qt::WaitCursor ) );
+      continue;
+    }
 
-      filePath = saveFilePath + "/" + layerId;
-      if ( !d.tileMode() )
+    QString source = layer->source();
+    QString provider = layer->providerType();
+    QStringList keys;
+    if ( provider.compare( "WFS", Qt::CaseInsensitive ) == 0 )
+    {
+      QString url, typeName;
+      if ( source.startsWith( "http", Qt::CaseInsensitive ) ) //GET url as created by wfsUrlFromLayerIndex
       {
-        QDir saveFileDir( saveFilePath );
-        saveFileDir.mkdir( layerId );
-        filePath += ( "/" + layerId + ".tif" );
+        url = source;
+        typeName = queryItemValue( QUrlQuery( QUrl( source ) ), "TYPENAME" );
       }
-
-      QgsRasterFileWriter fileWriter( filePath );
-      if ( d.tileMode() )
+      else
       {
-        fileWriter.setTiledMode( true );
-        fileWriter.setMaxTileWidth( d.maximumTileSizeX() );
-        fileWriter.setMaxTileHeight( d.maximumTileSizeY() );
+        QgsDataSourceUri uri( source );
+        url = uri.param( "url" );
+        typeName = uri.param( "typename" );
       }
+      keys << serviceSourceKey( "WFS", url, typeName );
+    }
+    else if ( provider.compare( "wms", Qt::CaseInsensitive ) == 0 )
+    {
+      QgsDataSourceUri uri;
+      uri.setEncodedUri( source );
+      QString url = uri.param( "url" );
+      QStringList layerNames = uri.params( "layers" );
+      QStringList::const_iterator nameIt = layerNames.constBegin();
+      for ( ; nameIt != layerNames.constEnd(); ++nameIt )
+      {
+        keys << serviceSourceKey( "WMS", url, *nameIt );
+      }
+    }
+    else
+    {
+      keys << fileSourceKey( source );
+    }
 
-      QProgressDialog pd( 0, tr( "Abort..." ), 0, 0 );
-      mProgressDialog = &pd;
-      pd.setWindowModality( Qt::WindowModal );
-
-      QgsRasterPipe* pipe = new QgsRasterPipe();
-      if ( !pipe->set( wmsLayer->dataProvider()->clone() ) )
+    //if several map layers have the same source, the first one is taken
+    QStringList::const_iterator keyIt = keys.constBegin();
+    for ( ; keyIt != keys.constEnd(); ++keyIt )
+    {
+      if ( !mProjectLayerIndex.contains( *keyIt ) )
       {
-        QgsDebugMsg( "Cannot set pipe provider" );
-        return;
+        mProjectLayerIndex.insert( *keyIt, layer->id() );
       }
+    }
+  }
+  mProjectLayerIndexValid = true;
+}
+
+void WebDataModel::invalidateProjectLayerIndex()
+{
+  mProjectLayerIndexValid = false;
+  mProjectLayerIndex.clear();
+}
+
+QString WebDataModel::fileSourceKey( const QString& source )
+{
+  //ogr sources may have options appended (e.g. '|layername=')
+  QString path = source.section( '|', 0, 0 );
+  if ( QDir::isRelativePath( path ) )
+  {
+    path = QDir::current().absoluteFilePath( path );
+  }
+  path = QDir::cleanPath( path );
+#ifdef Q_OS_WIN
+  path = path.toLower();
+#endif
+  return "file:" + path;
+}
+
+QString WebDataModel::serviceSourceKey( const QString& serviceType, const QString& url, const QString& layerName )
+{
+  //the request parameters added for GetCapabilities / GetMap / GetFeature don't identify the service
+  static QSet<QString> requestParameters = QSet<QString>() << "SERVICE" << "VERSION" << "REQUEST" << "TYPENAME"
+      << "TYPENAMES" << "SRSNAME" << "LAYERS" << "STYLES" << "FORMAT" << "CRS" << "SRS" << "BBOX" << "WIDTH" << "HEIGHT";
+
+  QUrl serviceUrl( url );
+  QStringList parameters;
+  QList< QPair<QString, QString> > queryItems = QUrlQuery( serviceUrl ).queryItems( QUrl::FullyDecoded );
+  QList< QPair<QString, QString> >::const_iterator itemIt = queryItems.constBegin();
+  for ( ; itemIt != queryItems.constEnd(); ++itemIt )
+  {
+    if ( !itemIt->first.isEmpty() && !requestParameters.contains( itemIt->first.toUpper() ) )
+    {
+      parameters << itemIt->first.toLower() + "=" + itemIt->second;
+    }
+  }
+  parameters.sort();
+
+  return serviceType.toUpper() + ":" + serviceUrl.scheme().toLower() + "://" + serviceUrl.host().toLower() + ":"
+         + QString::number( serviceUrl.port() ) + serviceUrl.path() + "?" + parameters.join( "&" ) + "|" + layerName.toLower();
+}
+
+QString WebDataModel::queryItemValue( const QUrlQuery& query, const QString& key )
+{
+  QList< QPair<QString, QString> > queryItems = query.queryItems( QUrl::FullyDecoded );
+  QList< QPair<QString, QString> >::const_iterator itemIt = queryItems.constBegin();
+  for ( ; itemIt != queryItems.constEnd(); ++itemIt )
+  {
+    if ( itemIt->first.compare( key, Qt::CaseInsensitive ) == 0 )
+    {
+      return itemIt->second;
+    }
+  }
+  return QString();
+}
+
+void WebDataModel::setCatalogue( const WebDataCatalogData& data )
+{
+  if ( mCatalogueLoaded )
+  {
+    return;
+  }
+  mCatalogueLoaded = true;
+
+  //the worker has its own connection, the model writes with a second one
+  if ( !data.databaseOk || !mStore.open( databaseFilePath() ) )
+  {
+    //without database, the catalogue is read from and written back to webdata.xml
+    QgsDebugMsg( "Error opening " + databaseFilePath() );
+    loadFromXML( xmlFilePath() );
+    return;
+  }
 
-      pd.setMaximum( 100 );
-      pd.show();
+  //the layers stay in the database until the service is expanded or searched (except the preloaded ones)
+  beginResetModel();
+  QList<WebDataCatalogStore::ServiceRecord>::const_iterator recordIt = data.services.constBegin();
+  for ( ; recordIt != data.services.constEnd(); ++recordIt )
+  {
+    Service* service = new Service();
+    service->id = mNextServiceId++;
+    service->title = recordIt->title;
+    service->url = recordIt->url;
+    service->type = mStrings.intern( recordIt->type );
+    service->formats = mStrings.intern( recordIt->formats );
+    service->version = recordIt->version;
+    service->maxImageSize = QSize( recordIt->maxWidth, recordIt->maxHeight );
+    mServices.append( service );
+    mServiceById.insert( service->id, service );
+
+    QHash<QString, QVector<WebDataCatalogStore::LayerRecord> >::const_iterator layersIt = data.layers.constFind( service->title );
+    if ( layersIt != data.layers.constEnd() )
+    {
+      createLayersFromRecords( service, layersIt.value() );
+    }
+    else
+    {
+      service->pendingLayerCount = recordIt->layerCount;
+    }
+  }
+  endResetModel();
+}
 
-      QgsRasterBlockFeedback rasterFeedback;
-      connect( &rasterFeedback, SIGNAL( progressChanged( double ) ), this, SLOT( setProgressValue( double ) ) );
-      fileWriter.writeRaster( pipe, d.nColumns(), d.nRows(), d.outputRectangle(), wmsLayer->crs(), &rasterFeedback /*todo: give QgsRasterBlockFeedback for progress report*/ );
-      mProgressDialog = 0;
-      if ( d.tileMode() )
+void WebDataModel::catalogueLayerRecords( const Service* service, int parentSlot, int parentPosition,
+    QVector<WebDataCatalogStore::LayerRecord>& records ) const
+{
+  const QVector<int>& children = childSlots( service, parentSlot );
+  QVector<int>::const_iterator childIt = children.constBegin();
+  for ( ; childIt != children.constEnd(); ++childIt )
+  {
+    const Layer& layer = service->layers.at( *childIt );
+    WebDataCatalogStore::LayerRecord record;
+    record.name = layer.name;
+    record.parent = parentPosition;
+    if ( layer.flags & GroupFlag )
+    {
+      record.flags = WebDataCatalogStore::GroupFlag;
+    }
+    else
+    {
+      if ( layer.flags & FavouriteFlag )
+      {
+        record.flags |= WebDataCatalogStore::FavouriteFlag;
+      }
+      if ( layer.flags & OfflineFlag )
+      {
+        record.flags |= WebDataCatalogStore::OfflineFlag;
+      }
+      if ( layer.flags & ExtentFlag )
       {
-        filePath += ( "/" + layerId + ".vrt" );
+        record.flags |= WebDataCatalogStore::ExtentFlag;
+        record.west = layer.west;
+        record.south = layer.south;
+        record.east = layer.east;
+        record.north = layer.north;
       }
+      record.title = layer.title;
+      record.abstract = layer.abstract;
+      record.crs = mStrings.string( layer.crs );
+      record.styles = mStrings.string( layer.styles );
+      record.keywords = mStrings.string( layer.keywords );
+      record.filePath = layer.filePath;
+    }
+
+    int position = records.size();
+    records.append( record );
+    if ( !layer.children.isEmpty() )
+    {
+      catalogueLayerRecords( service, *childIt, position, records );
+    }
+  }
+}
+
+void WebDataModel::storeXMLService( Service* service )
+{
+  if ( !mStore.isOpen() )
+  {
+    return;
+  }
+
+  WebDataCatalogStore::ServiceRecord serviceRecord;
+  QVector<WebDataCatalogStore::LayerRecord> layerRecords;
+  if ( !service->pendingXml.isEmpty() )
+  {
+    QDomDocument pendingDoc;
+    if ( !pendingDoc.setContent( service->pendingXml ) )
+    {
+      return;
+    }
+    serviceRecord = WebDataCatalogLoader::xmlServiceRecord( pendingDoc.documentElement(), layerRecords );
+  }
+  serviceRecord.title = service->title;
+  serviceRecord.url = service->url;
+  serviceRecord.type = mStrings.string( service->type );
+  serviceRecord.version = service->version;
+  serviceRecord.maxWidth = service->maxImageSize.width();
+  serviceRecord.maxHeight = service->maxImageSize.height();
+
+  if ( !mStore.writeService( serviceRecord, layerRecords ) )
+  {
+    QgsDebugMsg( "Error storing service " + service->title );
+    return;
+  }
+
+  //from now on the layers are read from the database
+  service->formats = mStrings.intern( serviceRecord.formats );
+  service->pendingXml.clear();
+  service->pendingLayerCount = layerRecords.size();
+}
 
-      offlineOk = true;
-      if ( inMap )
+void WebDataModel::fetchServicesWithLayers( const WebDataCatalogStore::LayerQuery& query )
+{
+  QSet<QString> titles;
+  bool queried = false;
+  QList<Service*>::const_iterator serviceIt = mServices.constBegin();
+  for ( ; serviceIt != mServices.constEnd(); ++serviceIt )
+  {
+    Service* service = *serviceIt;
+    if ( service->pendingLayerCount > 0 )
+    {
+      //one query for all services, and only if there are services left in the database
+      if ( !queried )
       {
-        QgsRasterLayer* offlineLayer = mIface->addRasterLayer( filePath, layername );
-        exchangeLayer( inMapItem->data().toString(), offlineLayer );
-        blockSignals( true );
-        inMapItem->setData( offlineLayer->id() );
-        blockSignals( false );
+        titles = mStore.servicesWithLayers( query );
+        queried = true;
       }
-      else
+      if ( titles.contains( service->title ) )
       {
-        delete wmsLayer;
+        fetchServiceLayers( service );
       }
-      QApplication::restoreOverrideCursor();
+    }
+    else if ( !service->pendingXml.isEmpty() )
+    {
+      //not in the database, the layers need to be parsed to know
+      fetchServiceLayers( service );
     }
   }
+}
+
+bool WebDataModel::hasPendingLayers( const Service* service )
+{
+  return ( !service->pendingXml.isEmpty() || service->pendingLayerCount > 0 );
+}
+
+bool WebDataModel::importFromXML( const QString& path )
+{
+  return loadFromXML( path );
+}
 
-  if ( offlineOk )
+bool WebDataModel::exportToXML( const QString& path )
+{
+  //layers still in the database need rows to be written
+  QList<Service*>::const_iterator serviceIt = mServices.constBegin();
+  for ( ; serviceIt != mServices.constEnd(); ++serviceIt )
   {
-    QStandardItem* statusItem = itemFromIndex( index.sibling( index.row(), 4 ) );
-    if ( statusItem )
+    if ( ( *serviceIt )->pendingLayerCount > 0 )
     {
-      statusItem->setText( "offline" );
-      statusItem->setIcon( QIcon( ":/niwa/icons/offline.png" ) );
-      statusItem->setData( filePath );
+      fetchServiceLayers( *serviceIt );
     }
   }
+  return saveToXML( path );
 }
 
-void WebDataModel::changeEntryToOnline( const QModelIndex& index )
+bool WebDataModel::loadFromXML( const QString& path )
 {
-  bool inMap = layerInMap( index );
-  QString type = serviceType( index );
-  QString layername = layerName( index );
+  QFile xmlFile( path );
+  if ( !xmlFile.exists() )
+  {
+    return false;
+  }
 
-  QStandardItem* inMapItem = itemFromIndex( index.sibling( index.row(), 3 ) );
-  if ( !inMapItem )
+  if ( !xmlFile.open( QIODevice::ReadOnly ) )
   {
-    return;
+    return false;
   }
 
-  QApplication::setOverrideCursor( QCursor( Qt::WaitCursor ) );
+  //only the service elements are read here. The layers of a service are cut out as text and parsed when
+  //the service is expanded, so startup time does not depend on the number of layers in the catalogue
+  QString content = QString::fromUtf8( xmlFile.readAll() );
+  QXmlStreamReader reader( content );
+  Service* service = 0;
+  qint64 serviceStart = 0;
+  bool hasLayers = false;
 
-  if ( inMap )
+  while ( !reader.atEnd() )
   {
-    //generate new wfs/wms layer
-    //exchange with layer in map
-    QgsMapLayer* onlineLayer = 0;
-    if ( type == "WFS" )
+    qint64 offset = reader.characterOffset();
+    reader.readNext();
+    if ( reader.isStartElement() && reader.name() == "service" )
     {
-      QString wfsUrl = wfsUrlFromLayerIndex( index );
-      onlineLayer = mIface->addVectorLayer( wfsUrl, layername, "WFS" );
+      delete service;
+      service = new Service();
+      service->title = reader.attributes().value( "serviceName" ).toString();
+      service->url = reader.attributes().value( "url" ).toString();
+      service->type = mStrings.intern( reader.attributes().value( "type" ).toString() );
+      service->version = reader.attributes().value( "version" ).toString();
+      service->maxImageSize = QSize( reader.attributes().value( "maxWidth" ).toInt(),
+                                     reader.attributes().value( "maxHeight" ).toInt() );
+      serviceStart = offset;
+      hasLayers = false;
     }
-    else if ( type == "WMS" )
+    else if ( service && reader.isStartElement() && reader.name() == "layer" && !hasLayers )
     {
-      //add to map
-      QgsDataSourceUri uri = wmsUriFromIndex( index );
-      onlineLayer = mIface->addRasterLayer( uri.encodedUri(), layername, "wms" );
+      //older files don't store url and type of the service. Take them from the first layer
+      hasLayers = true;
+      if ( service->url.isEmpty() )
+      {
+        service->url = reader.attributes().value( "url" ).toString();
+      }
+      if ( service->type == 0 )
+      {
+        service->type = mStrings.intern( reader.attributes().value( "type" ).toString() );
+      }
     }
+    else if ( service && reader.isEndElement() && reader.name() == "service" )
+    {
+      if ( serviceByTitle( service->title ) )
+      {
+        //keep the service in the model
+        delete service;
+        service = 0;
+        continue;
+      }
 
-    if ( onlineLayer )
-    {
-      exchangeLayer( inMapItem->data().toString(), onlineLayer );
-      blockSignals( true );
-      inMapItem->setData( onlineLayer->id() );
-      blockSignals( false );
+      if ( hasLayers )
+      {
+        service->pendingXml = content.mid( serviceStart, reader.characterOffset() - serviceStart );
+      }
+      service->id = mNextServiceId++;
+      beginInsertRows( QModelIndex(), mServices.size(), mServices.size() );
+      mServices.append( service );
+      mServiceById.insert( service->id, service );
+      endInsertRows();
+      storeXMLService( service );
+      service = 0;
     }
   }
+  delete service;
 
-  QStandardItem* statusItem = itemFromIndex( index.sibling( index.row(), 4 ) );
-  if ( !statusItem )
+  if ( reader.hasError() )
   {
-    return;
+    QgsDebugMsg( "Error reading " + path + ": " + reader.errorString() );
+    return false;
   }
-
-  QString offlineFileName = statusItem->data().toString();
-  deleteOfflineDatasource( type, offlineFileName );
-
-  statusItem->setText( "online" );
-  statusItem->setIcon( QIcon( ":/niwa/icons/online.png" ) );
-  statusItem->setData( "" );
+  return true;
 }
 
-void WebDataModel::reload( const QModelIndex& index )
+void WebDataModel::fetchServiceLayers( Service* service )
 {
-  QStandardItem* nameItem = itemFromIndex( index );
-  if ( !nameItem )
+  if ( service->pendingLayerCount > 0 )
   {
+    loadLayersFromStore( service );
     return;
   }
 
-  QString name = layerName( index );
-  QString status = layerStatus( index );
-  QString type = serviceType( index );
-
-  if ( status.compare( "online", Qt::CaseInsensitive ) == 0 )
+  if ( service->pendingXml.isEmpty() )
   {
     return;
   }
-  else if ( status.isEmpty() ) //update service
-  {
-    addService( name, nameItem->data().toString(), type );
-  }
-  else if ( type.compare( "WMS", Qt::CaseInsensitive ) == 0
-            || type.compare( "WFS", Qt::CaseInsensitive ) == 0 ) //update WMS layer
+
+  QDomDocument doc;
+  bool xmlOk = doc.setContent( service->pendingXml );
+  service->pendingXml.clear();
+  if ( !xmlOk )
   {
-    if ( mIface && mIface->mapCanvas() )
-    {
-      bool bkRenderFlag = mIface->mapCanvas()->renderFlag();
-      mIface->mapCanvas()->setRenderFlag( false );
-      changeEntryToOnline( index );
-      changeEntryToOffline( index );
-      mIface->mapCanvas()->setRenderFlag( bkRenderFlag );
-    }
+    return;
   }
-}
 
-QString WebDataModel::wfsUrlFromLayerIndex( const QModelIndex& index ) const
-{
-  QStandardItem* nameItem = itemFromIndex( index );
-  if ( !nameItem )
+  QDomElement serviceElem = doc.documentElement();
+  int nLayers = 0;
+  QDomElement layerElem = serviceElem.firstChildElement( "layer" );
+  for ( ; !layerElem.isNull(); layerElem = layerElem.nextSiblingElement( "layer" ) )
   {
-    return "";
+    ++nLayers;
   }
-
-  QString url = nameItem->data().toString();
-  QString layerName = nameItem->text();
-  QStandardItem* srsItem = itemFromIndex( index.sibling( index.row(), 5 ) );
-  QString srs = srsItem->text();
-
-  url.append( "SERVICE=WFS&VERSION=1.0.0&REQUEST=GetFeature&TYPENAME=" );
-  url.append( layerName );
-  if ( !srs.isEmpty() )
+  if ( nLayers < 1 )
   {
-    url.append( "&SRSNAME=" + srs );
+    return;
   }
-  return url;
+
+  beginInsertRows( serviceIndex( service ), 0, nLayers - 1 );
+  loadLayersFromXML( serviceElem, service, -1 );
+  endInsertRows();
 }
 
-QgsDataSourceUri WebDataModel::wmsUriFromIndex( const QModelIndex& index ) const
+void WebDataModel::loadLayersFromStore( Service* service )
 {
-  QStandardItem* nameItem = itemFromIndex( index );
-  if ( !nameItem )
+  service->pendingLayerCount = 0;
+  QVector<WebDataCatalogStore::LayerRecord> records = mStore.layers( service->title );
+  int nTopLevel = 0;
+  for ( int i = 0; i < records.size(); ++i )
   {
-    return QgsDataSourceUri();
+    if ( records.at( i ).parent < 0 || records.at( i ).parent >= i )
+    {
+      ++nTopLevel;
+    }
   }
-
-  //get name of parent item
-  QStandardItem* parentItem = nameItem->parent();
-  if ( !parentItem )
+  if ( nTopLevel < 1 )
   {
-    return QgsDataSourceUri();
+    return;
   }
 
-  //QgsWMSConnection wmsConnection( parentItem->text() );
-  QgsDataSourceUri uri; // = wmsConnection.uri();
-  uri.setParam( "url", nameItem->data().toString() );
-
-  //ignore advertised GetMap / GetFeatureInfo urls per derfault
-  uri.setParam( "IgnoreGetMapUrl", "1" );
-  uri.setParam( "IgnoreGetFeatureInfoUrl", "1" );
-
-  //name
-  uri.setParam( "layers", nameItem->text() );
+  beginInsertRows( serviceIndex( service ), 0, nTopLevel - 1 );
+  createLayersFromRecords( service, records );
+  endInsertRows();
+}
 
-  //format: prefer png
-  QString format;
-  QStandardItem* formatItem = itemFromIndex( index.sibling( index.row(), 6 ) );
-  if ( formatItem )
+void WebDataModel::createLayersFromRecords( Service* service, const QVector<WebDataCatalogStore::LayerRecord>& records )
+{
+  QString type = mStrings.string( service->type );
+  QVector<int> layerSlots( records.size(), -1 );
+  service->layers.reserve( service->layers.size() + records.size() );
+  for ( int i = 0; i < records.size(); ++i )
   {
-    QStringList formatList = formatItem->text().split( "," );
-    if ( formatList.size() > 0 )
+    const WebDataCatalogStore::LayerRecord& record = records.at( i );
+    Layer layer;
+    //parents always come before their sublayers
+    layer.parent = ( record.parent < 0 || record.parent >= i ) ? -1 : layerSlots.at( record.parent );
+    layer.name = record.name;
+    QString layerId;
+
+    if ( record.flags & WebDataCatalogStore::GroupFlag )
     {
-      if ( formatList.contains( "image/png" ) )
+      layer.flags = GroupFlag;
+    }
+    else
+    {
+      if ( record.flags & WebDataCatalogStore::FavouriteFlag )
       {
-        format = "image/png";
+        layer.flags |= FavouriteFlag;
       }
-      else
+      bool online = !( record.flags & WebDataCatalogStore::OfflineFlag );
+      if ( !online )
       {
-        format = formatList.at( 0 );
+        layer.flags |= OfflineFlag;
       }
-    }
-  }
-  uri.setParam( "format", format );
-
-  //CRS: prefer map crs
-  QString crs;
-  QStandardItem* crsItem = itemFromIndex( index.sibling( index.row(), 5 ) );
-  if ( crsItem && mIface )
-  {
-    QStringList crsList = crsItem->text().split( "," );
-    if ( crsList.size() > 0 )
-    {
-      crs = crsList.at( 0 );
-      QgsMapCanvas* canvas = mIface->mapCanvas();
-      if ( canvas )
+      layer.filePath = record.filePath;
+      layerId = layerIdFromUrl( online ? service->url : layer.filePath, type, online, layer.name );
+      if ( !layerId.isEmpty() )
       {
-        const QgsMapSettings& settings = canvas->mapSettings();
-        const QgsCoordinateReferenceSystem& destCRS = settings.destinationCrs();
-        QString authId = destCRS.authid();
-        if ( crsList.contains( authId ) )
-        {
-          crs = authId;
-        }
+        layer.flags |= InMapFlag;
       }
+      layer.title = record.title;
+      layer.abstract = record.abstract;
+      layer.keywords = mStrings.intern( record.keywords );
+      layer.crs = mStrings.intern( record.crs );
+      layer.styles = mStrings.intern( record.styles );
     }
-  }
-  uri.setParam( "crs", crs );
 
-  //styles
-  QString styles;
-  QStandardItem* stylesItem = itemFromIndex( index.sibling( index.row(), 7 ) );
-  if ( stylesItem )
-  {
-    //take first style
-    QString stylesString = stylesItem->text();
-    if ( stylesString.isEmpty() )
-    {
-      styles.append( "" );
-    }
-    else
+    int slot = appendLoadedLayer( service, layer, layerId );
+    layerSlots[i] = slot;
+    if ( record.flags & WebDataCatalogStore::ExtentFlag )
     {
-      styles.append( stylesString.split( "," ).at( 0 ) );
+      setLayerExtent( service, slot, true, record.west, record.south, record.east, record.north );
     }
   }
-  uri.setParam( "styles", styles );
-  return uri;
 }
 
-QString WebDataModel::layerName( const QModelIndex& index ) const
+void WebDataModel::storeLayerState( const Service* service, int slot )
 {
-  QStandardItem* nameItem = itemFromIndex( index );
-  if ( nameItem )
+  if ( !service || slot < 0 || !mStore.isOpen() )
   {
-    return nameItem->text();
+    return;
   }
-  return QString();
-}
 
-QString WebDataModel::serviceType( const QModelIndex& index ) const
-{
-  //wms / wfs ?
-  QStandardItem* typeItem = itemFromIndex( index.sibling( index.row(), 2 ) );
-  if ( typeItem )
+  const Layer& layer = service->layers.at( slot );
+  quint32 flags = 0;
+  if ( layer.flags & FavouriteFlag )
   {
-    return typeItem->text();
+    flags |= WebDataCatalogStore::FavouriteFlag;
   }
-  return QString();
-}
-
-QString WebDataModel::layerStatus( const QModelIndex& index ) const
-{
-  QStandardItem* statusItem = itemFromIndex( index.sibling( index.row(), 4 ) );
-  if ( statusItem )
+  if ( layer.flags & OfflineFlag )
   {
-    return statusItem->text();
+    flags |= WebDataCatalogStore::OfflineFlag;
+  }
+  if ( !mStore.writeLayerState( service->title, layer.name, flags, layer.filePath ) )
+  {
+    QgsDebugMsg( "Error storing layer " + layer.name );
   }
-  return QString();
-}
-
-bool WebDataModel::layerInMap( const QModelIndex& index ) const
-{
-  QStandardItem* inMapItem = itemFromIndex( index.sibling( index.row(), 3 ) );
-  return ( inMapItem && inMapItem->checkState() == Qt::Checked );
 }
 
-bool WebDataModel::exchangeLayer( const QString& layerId, QgsMapLayer* newLayer )
+bool WebDataModel::storeService( const Service* service )
 {
-  if ( !mIface )
+  if ( !mStore.isOpen() )
   {
     return false;
   }
 
-  QgsMapLayer* oldLayer = QgsProject::instance()->mapLayer( layerId );
-  if ( !oldLayer || !newLayer )
+  WebDataCatalogStore::ServiceRecord record;
+  record.title = service->title;
+  record.url = service->url;
+  record.type = mStrings.string( service->type );
+  record.formats = mStrings.string( service->formats );
+  record.version = service->version;
+  record.maxWidth = service->maxImageSize.width();
+  record.maxHeight = service->maxImageSize.height();
+  QVector<WebDataCatalogStore::LayerRecord> layerRecords;
+  catalogueLayerRecords( service, -1, -1, layerRecords );
+  if ( !mStore.writeService( record, layerRecords ) )
   {
+    QgsDebugMsg( "Error storing service " + service->title );
     return false;
   }
+  return true;
+}
 
-  if ( newLayer->type() == QgsMapLayer::VectorLayer )
+void WebDataModel::compactLayers( Service* service )
+{
+  int nRemoved = 0;
+  QVector<Layer>::const_iterator layerIt = service->layers.constBegin();
+  for ( ; layerIt != service->layers.constEnd(); ++layerIt )
   {
-    QgsVectorLayer* newVectorLayer = static_cast<QgsVectorLayer*>( newLayer );
-    QgsVectorLayer* oldVectorLayer = static_cast<QgsVectorLayer*>( oldLayer );
-
-    //write old style
-    QDomDocument vectorQMLDoc;
-    QDomElement qmlRootElem = vectorQMLDoc.createElement( "qgis" );
-    vectorQMLDoc.appendChild( qmlRootElem );
-    QString errorMessage;
-    QgsReadWriteContext rwContext;
-    if ( !oldVectorLayer->writeSymbology( qmlRootElem, vectorQMLDoc, errorMessage, rwContext ) )
-    {
-      return false;
-    }
-
-    //set old style to new layer
-    if ( !newVectorLayer->readSymbology( qmlRootElem, errorMessage, rwContext ) )
+    if ( layerIt->flags & RemovedFlag )
     {
-      return false;
+      ++nRemoved;
     }
   }
-
-  //move new layer next to the old one
-  //remove old layer
-    legendMoveLayer( newLayer, oldLayer );
-    //todo: refreshSymbology() still necessary?
-
-  disconnect( QgsProject::instance(), SIGNAL( layersWillBeRemoved( QStringList ) ), this,
-              SLOT( syncLayerRemove( QStringList ) ) );
-  QgsProject::instance()->removeMapLayers( QStringList() << layerId );
-  connect( QgsProject::instance(), SIGNAL( layersWillBeRemoved( QStringList ) ), this,
-           SLOT( syncLayerRemove( QStringList ) ) );
-  return false;
-}
-
-void WebDataModel::deleteOfflineDatasource( const QString& serviceType, const QString& offlinePath )
-{
-  if ( serviceType == "WFS" )
+  if ( nRemoved * 2 <= service->layers.size() )
   {
-    QgsVectorFileWriter::deleteShapeFile( offlinePath );
+    return;
   }
-  else if ( serviceType == "WMS" )
-  {
-    //remove files in directory
-    QDir rasterFileDir( QFileInfo( offlinePath ).absolutePath() );  //raster offline is always in a directory
-    QFileInfoList rasterFileList = rasterFileDir.entryInfoList( QDir::Files | QDir::NoDotAndDotDot );
-    QFileInfoList::iterator it = rasterFileList.begin();
-    for ( ; it != rasterFileList.end(); ++it )
-    {
-      QFile::remove( it->absoluteFilePath() );
-    }
 
-    //remove the directory itself
-    QString dirName = rasterFileDir.dirName();
-    if ( rasterFileDir.cdUp() )
+  //running offline jobs refer to their layer by slot
+  QHash<quintptr, WebDataOfflineTask*>::const_iterator jobIt = mOfflineJobs.constBegin();
+  for ( ; jobIt != mOfflineJobs.constEnd(); ++jobIt )
+  {
+    if ( quint32( quint64( jobIt.key() ) >> SLOT_BITS ) == service->id )
     {
-      rasterFileDir.rmdir( dirName );
+      return;
     }
   }
-}
 
-QString WebDataModel::layerIdFromUrl( const QString& url, const QString& serviceType, bool online,
-                                      const QString& layerName )
-{
-  const QMap<QString, QgsMapLayer*>& layerMap = QgsProject::instance()->mapLayers();
-  QMap<QString, QgsMapLayer*>::const_iterator layerIt = layerMap.constBegin();
-  for ( ; layerIt != layerMap.constEnd(); ++layerIt )
+  //the slots of removed layers are never reused. Reading the stored layers again packs the live ones
+  if ( !service->topLevel.isEmpty() )
   {
-    const QgsMapLayer* layer = layerIt.value();
-    if ( !online )
-    {
-      if ( layer && QFileInfo( layer->source() ) == QFileInfo( url ) )
-      {
-        return layer->id();
-      }
-    }
-    else if ( serviceType == "WFS" )
-    {
-      QString layerSource = layer->source();
-      QString layerUrl = url;
-      if ( layerSource.startsWith( layerUrl )
-           && layerSource.contains( "TYPENAME=" + layerName, Qt::CaseInsensitive ) )
-      {
-        return layer->id();
-      }
-    }
-    else //for online WMS, we need to additionally consider the layer name
-    {
-      QString layerSource = layer->source();
-      if ( layerSource.contains( url ) && layerSource.contains( "&layers=" + QUrl::toPercentEncoding( layerName ),
-           Qt::CaseInsensitive ) )
-      {
-        return layer->id();
-      }
-    }
+    removeLayers( service, -1, 0, service->topLevel.size() );
   }
-  return QString();
+  service->layers = QVector<Layer>();
+  loadLayersFromStore( service );
 }
 
-void WebDataModel::loadFromXML()
+void WebDataModel::storeServiceRemoved( const Service* service )
 {
-  QFile xmlFile( xmlFilePath() );
-  if ( !xmlFile.exists() )
+  if ( mStore.isOpen() && !mStore.removeService( service->title ) )
   {
-    return;
+    QgsDebugMsg( "Error removing service " + service->title );
   }
+}
 
-  if ( !xmlFile.open( QIODevice::ReadOnly ) )
-  {
-    return;
-  }
+void WebDataModel::loadLayersFromXML( const QDomElement& parentElem, Service* service, int parentSlot )
+{
+  QString type = mStrings.string( service->type );
 
-  QDomDocument doc;
-  if ( !doc.setContent( &xmlFile ) )
+  //only direct children, sublayers are handled by the recursive call
+  QDomElement layerElem = parentElem.firstChildElement( "layer" );
+  for ( ; !layerElem.isNull(); layerElem = layerElem.nextSiblingElement( "layer" ) )
   {
-    return;
-  }
+    Layer layer;
+    layer.parent = parentSlot;
+    layer.name = layerElem.attribute( "name" );
+    QString layerId;
 
-  QDomNodeList serviceNodeList = doc.elementsByTagName( "service" );
-  for ( int i = 0; i < serviceNodeList.size(); ++i )
-  {
-    QDomElement serviceElem = serviceNodeList.at( i ).toElement();
-    QStandardItem* serviceItem = new QStandardItem( serviceElem.attribute( "serviceName" ) );
-    invisibleRootItem()->setChild( invisibleRootItem()->rowCount(), serviceItem );
-
-    QDomNodeList layerNodeList = serviceElem.elementsByTagName( "layer" );
-    QDomElement layerElem;
-    QList<QStandardItem*> childItemList;
-
-    for ( int j = 0; j < layerNodeList.size(); ++j )
-    {
-      childItemList.clear();
-      layerElem = layerNodeList.at( j ).toElement();
-      //name
-      QString layername = layerElem.attribute( "name" );
-      QStandardItem* nameItem = new QStandardItem( layername );
-      nameItem->setFlags( Qt::ItemIsEnabled | Qt::ItemIsSelectable );
-      QString url = layerElem.attribute( "url" );
-      nameItem->setData( url );
-      childItemList.push_back( nameItem );
-      //favourite
-      QStandardItem* favItem = new QStandardItem();
-      bool favChecked = layerElem.attribute( "favourite" ).compare( "1" ) == 0;
-      favItem->setCheckState( favChecked ? Qt::Checked : Qt::Unchecked );
-      favItem->setIcon( favChecked ? QIcon( ":/niwa/icons/favourite.png" ) : QIcon() );
-      favItem->setFlags( Qt::ItemIsEnabled | Qt::ItemIsSelectable | Qt::ItemIsUserCheckable );
-      childItemList.push_back( favItem );
-      //type
-      QString type = layerElem.attribute( "type" );
-      QStandardItem* typeItem = new QStandardItem( type );
-      typeItem->setFlags( Qt::ItemIsEnabled | Qt::ItemIsSelectable );
-      childItemList.push_back( typeItem );
-      //in map
-      QStandardItem* inMapItem = new QStandardItem();
-      inMapItem->setFlags( Qt::ItemIsEnabled | Qt::ItemIsSelectable | Qt::ItemIsUserCheckable );
-      childItemList.push_back( inMapItem );
-      //status
-      QStandardItem* statusItem = new QStandardItem( layerElem.attribute( "status" ) );
-      bool online = statusItem->text().compare( "online", Qt::CaseInsensitive ) == 0;
-      QString filePath = layerElem.attribute( "filePath" );
-      statusItem->setIcon( online ? QIcon( ":/niwa/icons/online.png" ) : QIcon( ":/niwa/icons/offline.png" ) );
-      statusItem->setFlags( Qt::ItemIsEnabled | Qt::ItemIsSelectable );
-      statusItem->setData( filePath );
-      childItemList.push_back( statusItem );
-      if ( !online )
-      {
-        url = filePath;
-      }
-      QString layerId = layerIdFromUrl( url, type, online, layername );
-      if ( !layerId.isEmpty() )
-      {
-        inMapItem->setCheckState( Qt::Checked );
-        inMapItem->setData( layerId );
-      }
-      else
+    //group of layers
+    if ( layerElem.attribute( "group" ) == "1" )
+    {
+      layer.flags = GroupFlag;
+    }
+    else
+    {
+      if ( layerElem.attribute( "favourite" ).compare( "1" ) == 0 )
       {
-        inMapItem->setCheckState( Qt::Unchecked );
+        layer.flags |= FavouriteFlag;
       }
-      //crs
-      QStandardItem* crsItem = new QStandardItem( layerElem.attribute( "crs" ) );
-      crsItem->setFlags( Qt::ItemIsEnabled | Qt::ItemIsSelectable );
-      childItemList.push_back( crsItem );
-      //formats
-      if ( layerElem.hasAttribute( "formats" ) )
+      bool online = layerElem.attribute( "status" ).compare( "online", Qt::CaseInsensitive ) == 0;
+      layer.filePath = layerElem.attribute( "filePath" );
+      if ( !online )
       {
-        QStandardItem* formatsItem = new QStandardItem( layerElem.attribute( "formats" ) );
-        formatsItem->setFlags( Qt::ItemIsEnabled | Qt::ItemIsSelectable );
-        childItemList.push_back( formatsItem );
+        layer.flags |= OfflineFlag;
       }
-      //styles
-      if ( layerElem.hasAttribute( "styles" ) )
+      layerId = layerIdFromUrl( online ? layerElem.attribute( "url", service->url ) : layer.filePath, type,
+                                online, layer.name );
+      if ( !layerId.isEmpty() )
       {
-        QStandardItem* stylesItem = new QStandardItem( layerElem.attribute( "styles" ) );
-        stylesItem->setFlags( Qt::ItemIsEnabled | Qt::ItemIsSelectable );
-        childItemList.push_back( stylesItem );
+        layer.flags |= InMapFlag;
       }
-      //layers
-      if ( layerElem.hasAttribute( "layers" ) )
+      layer.title = layerElem.attribute( "title" );
+      layer.abstract = layerElem.attribute( "abstract" );
+      layer.keywords = mStrings.intern( layerElem.attribute( "keywords" ) );
+      layer.crs = mStrings.intern( layerElem.attribute( "crs" ) );
+      layer.styles = mStrings.intern( layerElem.attribute( "styles" ) );
+      //formats are the same for all layers of a service
+      if ( service->formats == 0 )
       {
-        QStandardItem* layersItem = new QStandardItem( layerElem.attribute( "layers" ) );
-        layersItem->setFlags( Qt::ItemIsEnabled | Qt::ItemIsSelectable );
-        childItemList.push_back( layersItem );
+        service->formats = mStrings.intern( layerElem.attribute( "formats" ) );
       }
-      serviceItem->appendRow( childItemList );
     }
+
+    int slot = appendLoadedLayer( service, layer, layerId );
+    QStringList bbox = layerElem.attribute( "bbox" ).split( "," );
+    if ( bbox.size() == 4 )
+    {
+      setLayerExtent( service, slot, true, bbox.at( 0 ).toDouble(), bbox.at( 1 ).toDouble(), bbox.at( 2 ).toDouble(),
+                      bbox.at( 3 ).toDouble() );
+    }
+
+    //sublayers
+    loadLayersFromXML( layerElem, service, slot );
+  }
+}
+
+int WebDataModel::appendLoadedLayer( Service* service, const Layer& layer, const QString& layerId )
+{
+  int slot = service->layers.size();
+  service->layers.append( layer );
+  QVector<int>& siblings = ( layer.parent < 0 ) ? service->topLevel : service->layers[layer.parent].children;
+  service->layers[slot].row = siblings.size();
+  siblings.append( slot );
+  if ( !layerId.isEmpty() )
+  {
+    setMapLayerId( service, slot, layerId );
   }
+  indexLayer( service, slot );
+  addLayerFacets( service, slot );
+  return slot;
 }
 
-void WebDataModel::saveToXML() const
+bool WebDataModel::saveToXML( const QString& path ) const
 {
   QDomDocument doc;
   QDomElement webDataElem = doc.createElement( "webdata" );
   doc.appendChild( webDataElem );
 
-  QStandardItem* rootItem = invisibleRootItem();
-  QStandardItem* serviceItem = 0;
-  for ( int i = 0; i < rootItem->rowCount(); ++i )
+  QList<Service*>::const_iterator serviceIt = mServices.constBegin();
+  for ( ; serviceIt != mServices.constEnd(); ++serviceIt )
   {
-    serviceItem = rootItem->child( i );
-    if ( !serviceItem )
+    const Service* service = *serviceIt;
+    QDomElement serviceElem = doc.createElement( "service" );
+    serviceElem.setAttribute( "serviceName", service->title );
+    serviceElem.setAttribute( "url", service->url );
+    serviceElem.setAttribute( "type", mStrings.string( service->type ) );
+    if ( !service->version.isEmpty() )
     {
-      continue;
+      serviceElem.setAttribute( "version", service->version );
+    }
+    if ( service->maxImageSize.width() > 0 || service->maxImageSize.height() > 0 )
+    {
+      serviceElem.setAttribute( "maxWidth", service->maxImageSize.width() );
+      serviceElem.setAttribute( "maxHeight", service->maxImageSize.height() );
     }
-    QDomElement serviceElem = doc.createElement( "service" );
-    serviceElem.setAttribute( "serviceName", serviceItem->text() );
     webDataElem.appendChild( serviceElem );
 
-    for ( int j = 0; j < serviceItem->rowCount(); ++j )
+    //layers which have never been expanded are written back as they were read
+    if ( !service->pendingXml.isEmpty() )
     {
-      QDomElement layerElem = doc.createElement( "layer" );
-      serviceElem.appendChild( layerElem );
-      //name
-      QStandardItem* nameItem = serviceItem->child( j, 0 );
-      if ( nameItem )
-      {
-        layerElem.setAttribute( "name", nameItem->text() );
-        layerElem.setAttribute( "url", nameItem->data().toString() );
-      }
-      //favourite
-      QStandardItem* favItem = serviceItem->child( j, 1 );
-      if ( favItem )
-      {
-        layerElem.setAttribute( "favourite", ( favItem->checkState() == Qt::Checked ) ? "1" : "0" );
-      }
-      //type
-      QStandardItem* typeItem = serviceItem->child( j, 2 );
-      if ( typeItem )
-      {
-        layerElem.setAttribute( "type", typeItem->text() );
-      }
-      //in map
-      QStandardItem* inMapItem = serviceItem->child( j, 3 );
-      if ( inMapItem )
-      {
-        layerElem.setAttribute( "layerId", inMapItem->data().toString() );
-      }
-      //status
-      QStandardItem* statusItem = serviceItem->child( j, 4 );
-      if ( statusItem )
-      {
-        layerElem.setAttribute( "status", statusItem->text() );
-        layerElem.setAttribute( "filePath", statusItem->data().toString() );
-      }
-      //crs
-      QStandardItem* crsItem = serviceItem->child( j, 5 );
-      if ( crsItem )
-      {
-        layerElem.setAttribute( "crs", crsItem->text() );
-      }
-      //formats
-      QStandardItem* formatsItem = serviceItem->child( j, 6 );
-      if ( formatsItem )
+      QDomDocument pendingDoc;
+      if ( pendingDoc.setContent( service->pendingXml ) )
       {
-        layerElem.setAttribute( "formats", formatsItem->text() );
+        QDomElement layerElem = pendingDoc.documentElement().firstChildElement( "layer" );
+        for ( ; !layerElem.isNull(); layerElem = layerElem.nextSiblingElement( "layer" ) )
+        {
+          serviceElem.appendChild( doc.importNode( layerElem, true ) );
+        }
       }
-      //styles
-      QStandardItem* stylesItem = serviceItem->child( j, 7 );
-      if ( stylesItem )
+      continue;
+    }
+    saveLayersToXML( service, -1, serviceElem, doc );
+  }
+
+  QFile outFile( path );
+  if ( !outFile.open( QIODevice::WriteOnly ) )
+  {
+    return false;
+  }
+  QTextStream outStream( &outFile );
+  doc.save( outStream, 2 );
+  return true;
+}
+
+void WebDataModel::saveLayersToXML( const Service* service, int parentSlot, QDomElement& parentElem, QDomDocument& doc ) const
+{
+  const QVector<int>& children = childSlots( service, parentSlot );
+  QVector<int>::const_iterator childIt = children.constBegin();
+  for ( ; childIt != children.constEnd(); ++childIt )
+  {
+    const Layer& layer = service->layers.at( *childIt );
+    QDomElement layerElem = doc.createElement( "layer" );
+    parentElem.appendChild( layerElem );
+    layerElem.setAttribute( "name", layer.name );
+    layerElem.setAttribute( "url", service->url );
+
+    if ( layer.flags & GroupFlag )
+    {
+      layerElem.setAttribute( "group", "1" );
+    }
+    else
+    {
+      layerElem.setAttribute( "favourite", ( layer.flags & FavouriteFlag ) ? "1" : "0" );
+      layerElem.setAttribute( "type", mStrings.string( service->type ) );
+      layerElem.setAttribute( "layerId", ( layer.flags & InMapFlag ) ? layer.layerId : QString() );
+      layerElem.setAttribute( "status", ( layer.flags & OfflineFlag ) ? "offline" : "online" );
+      layerElem.setAttribute( "filePath", layer.filePath );
+      layerElem.setAttribute( "title", layer.title );
+      layerElem.setAttribute( "abstract", layer.abstract );
+      layerElem.setAttribute( "keywords", mStrings.string( layer.keywords ) );
+      if ( layer.flags & ExtentFlag )
       {
-        layerElem.setAttribute( "styles", stylesItem->text() );
+        layerElem.setAttribute( "bbox", QString( "%1,%2,%3,%4" ).arg( layer.west, 0, 'g', 8 ).arg( layer.south, 0, 'g', 8 )
+                                .arg( layer.east, 0, 'g', 8 ).arg( layer.north, 0, 'g', 8 ) );
       }
-      //layers
-      QStandardItem* layersItem = serviceItem->child( j, 8 );
-      if ( layersItem )
+      layerElem.setAttribute( "crs", mStrings.string( layer.crs ) );
+      //formats and styles are WMS only. Formats are stored per layer to stay readable by older versions
+      if ( mStrings.string( service->type ) == "WMS" )
       {
-        layerElem.setAttribute( "layers", layersItem->text() );
+        layerElem.setAttribute( "formats", mStrings.string( service->formats ) );
+        layerElem.setAttribute( "styles", mStrings.string( layer.styles ) );
       }
     }
 
-  }
-
-  QFile outFile( xmlFilePath() );
-  if ( outFile.open( QIODevice::WriteOnly ) )
-  {
-    QTextStream outStream( &outFile );
-    doc.save( outStream, 2 );
+    //sublayers
+    if ( !layer.children.isEmpty() )
+    {
+      saveLayersToXML( service, *childIt, layerElem, doc );
+    }
   }
 }
 
-QString WebDataModel::xmlFilePath() const
+QString WebDataModel::xmlFilePath()
 {
   QFileInfo fi( QgsApplication::qgisUserDatabaseFilePath() );
   QString path = fi.absolutePath() + "/webdata.xml";
   return path;
 }
 
+QString WebDataModel::databaseFilePath()
+{
+  QFileInfo fi( QgsApplication::qgisUserDatabaseFilePath() );
+  return fi.absolutePath() + "/webdata.sqlite";
+}
+
 void WebDataModel::legendMoveLayer( const QgsMapLayer* ml, const QgsMapLayer* after )
 {
     if( !ml || !after )
@@ -1243,11 +2986,3 @@ void WebDataModel::legendMoveLayer( const QgsMapLayer* ml, const QgsMapLayer* af
       nodeLayerParentGroup->removeChildNode( mlTreeLayer );
 }
 
-void WebDataModel::setProgressValue( double progress )
-{
-    if( mProgressDialog )
-    {
-        mProgressDialog->setValue( (int)progress );
-    }
-}
-
@@ -1,52 +1,371 @@
 #ifndef WEBDATAMODEL_H
 #define WEBDATAMODEL_H
 
+#include "qgscoordinatereferencesystem.h"
 #include "qgsdatasourceuri.h"
-#include <QStandardItemModel>
+#include "qgsrectangle.h"
+#include "qgsspatialindex.h"
+#include "webdatacapabilitiescache.h"
+#include "webdatacapabilitiesparser.h"
+#include "webdatacatalogloader.h"
+#include "webdatacatalogstore.h"
+#include "webdatafacetindex.h"
+#include "webdataofflinescheduler.h"
+#include "webdatasearchindex.h"
+#include "webdatastringpool.h"
+#include <QAbstractItemModel>
+#include <QHash>
+#include <QMap>
+#include <QIcon>
+#include <QPair>
+#include <QThread>
+#include <QVector>
 
 class QgisInterface;
 class QgsMapLayer;
+class QDomDocument;
+class QDomElement;
 class QNetworkReply;
-class QProgressDialog;
+class WebDataOfflineTask;
+class QUrlQuery;
 
 
-/**A model for storing services (WFS/WMS/WCS in future) and their layers*/
-class WebDataModel: public QStandardItemModel
+/**A model for storing services (WFS/WMS/WCS in future) and their layers. Services are the top level rows,
+  layers (and WMS sublayers) their children. The layers of a service are kept in a contiguous array of compact records,
+  values repeating on many layers (CRS, formats, styles) are interned*/
+class WebDataModel: public QAbstractItemModel
 {
     Q_OBJECT
   public:
+    enum Column
+    {
+      NameColumn = 0,
+      FavouriteColumn,
+      TypeColumn,
+      InMapColumn,
+      StatusColumn,
+      CrsColumn,
+      FormatsColumn,
+      StylesColumn,
+      ColumnCount
+    };
+
+    /**Role for the service url (name column), the map layer id (in map column) and the offline file path (status column)*/
+    static const int DataRole = Qt::UserRole + 1;
+
+    /**Restrictions of the facet filter (see facetMask())*/
+    struct FacetFilter
+    {
+      FacetFilter(): onlyInMap( false ) {}
+      bool isEmpty() const { return serviceType.isEmpty() && crs.isEmpty() && status.isEmpty() && !onlyInMap; }
+
+      /**WMS / WFS or empty for all services*/
+      QString serviceType;
+      /**Authority id of a CRS the layers need to support or empty*/
+      QString crs;
+      /**online / offline or empty*/
+      QString status;
+      bool onlyInMap;
+    };
+
     WebDataModel( QgisInterface* iface );
     ~WebDataModel();
 
+    /**Creates the services read by WebDataCatalogLoader. The model stays empty until then. Falls back to webdata.xml
+      if the database could not be opened*/
+    void setCatalogue( const WebDataCatalogData& data );
+    bool isCatalogueLoaded() const { return mCatalogueLoaded; }
+    /**Returns path to web.xml. Creates the file if not there*/
+    static QString xmlFilePath();
+    /**Returns the path of the catalogue database (webdata.sqlite next to webdata.xml)*/
+    static QString databaseFilePath();
+
+    //QAbstractItemModel
+    QModelIndex index( int row, int column, const QModelIndex& parent = QModelIndex() ) const;
+    QModelIndex parent( const QModelIndex& index ) const;
+    int rowCount( const QModelIndex& parent = QModelIndex() ) const;
+    bool hasChildren( const QModelIndex& parent = QModelIndex() ) const;
+    /**Layers of services loaded from webdata.xml are only created when the service is expanded (or searched)*/
+    bool canFetchMore( const QModelIndex& parent ) const;
+    void fetchMore( const QModelIndex& parent );
+    int columnCount( const QModelIndex& parent = QModelIndex() ) const;
+    QVariant data( const QModelIndex& index, int role = Qt::DisplayRole ) const;
+    bool setData( const QModelIndex& index, const QVariant& value, int role = Qt::EditRole );
+    Qt::ItemFlags flags( const QModelIndex& index ) const;
+    QVariant headerData( int section, Qt::Orientation orientation, int role = Qt::DisplayRole ) const;
+    bool removeRows( int row, int count, const QModelIndex& parent = QModelIndex() );
+
     /**Adds service directory and items for service layers to the model
     @param title service title (usually the service name from the combo box)
     @param url service url
-    @param serviceName WMS/WFS/WCS*/
-    void addService( const QString& title, const QString& url, const QString& service );
+    @param serviceName WMS/WFS/WCS
+    @param revalidate ask the server even if the cached capabilities are younger than the cache time to live*/
+    void addService( const QString& title, const QString& url, const QString& service, bool revalidate = false );
+    /**Requests the capabilities of all services in the model again. The requests run concurrently, limited by the
+      setting /NIWA/maxCapabilitiesRequestsPerHost*/
+    void refreshAllServices();
+    /**Returns the number of running, parsing and queued capabilities requests*/
+    int pendingCapabilitiesRequests() const;
+    /**Creates the layer rows of the services which have a layer meeting the query (asked from the database).
+      Services which are not in the database are always loaded*/
+    void fetchServicesWithLayers( const WebDataCatalogStore::LayerQuery& query );
 
     void addEntryToMap( const QModelIndex& index );
     void removeEntryFromMap( const QModelIndex& index );
+    /**Starts a background job writing the layer to the cache directory. The layer becomes offline when the job has
+      finished successfully*/
     void changeEntryToOffline( const QModelIndex& index );
+    /**Queues offline jobs for several layers. The output of WMS layers is asked for once (for the first one)*/
+    void changeEntriesToOffline( const QModelIndexList& indexes );
+    bool offlineJobRunning( const QModelIndex& index ) const;
+    /**Stops the offline job of a layer. Files written so far are removed*/
+    void cancelOfflineJob( const QModelIndex& index );
     void changeEntryToOnline( const QModelIndex& index );
+    /**Reloads the capabilities of a service or downloads an offline layer again. The new copy of an offline layer
+      replaces the old one only once it is complete, the old copy stays in use until then*/
     void reload( const QModelIndex& index );
 
+    /**Adds the services of a webdata.xml file which are not yet in the model
+      @return false if the file could not be read*/
+    bool importFromXML( const QString& path );
+    /**Writes all services and layers in the webdata.xml format*/
+    bool exportToXML( const QString& path );
+
+    /**Full text search over name, title, abstract and keywords of the layers. Returns the score of each matching
+      layer by the internal id of its model indices
+      @param candidates restricts the search to these layers (see WebDataSearchIndex::search)*/
+    QHash<quint64, double> searchLayers( const QString& query, const QHash<quint64, double>* candidates = 0 ) const;
+
+    /**Returns the layers matching the facet filter as bitset over the layer numbers (see layerNumber())*/
+    QBitArray facetMask( const FacetFilter& filter );
+    /**Changes whenever the facets of a layer change. A facet mask with an older revision is outdated*/
+    quint32 facetRevision() const { return mFacets.revision(); }
+    /**Returns the bit position of a layer in the facet masks or -1 for services and layer groups*/
+    int layerNumber( const QModelIndex& index ) const;
+
+    /**Returns the layers whose geographic extent intersects the given extent (WGS 84) with the share of the extent
+      they cover (0-1), by internal id of their model indices. Layers without advertised extent are not returned*/
+    QHash<quint64, double> layersInExtent( const QgsRectangle& extent ) const;
+
     QString layerStatus( const QModelIndex& index ) const ;
     bool layerInMap( const QModelIndex& index ) const;
+    bool layerFavourite( const QModelIndex& index ) const;
 
   private slots:
-    void wmsCapabilitiesRequestFinished();
-    void wfsCapabilitiesRequestFinished();
-    void handleItemChange( QStandardItem* item );
+    void capabilitiesReplyReadyRead();
+    void capabilitiesRequestFinished();
+    void capabilitiesParsingFinished( const QList<WebDataLayerRecord>& records, const QStringList& formats,
+                                      const QString& version, const QSize& maxImageSize, bool ok,
+                                      const QString& errorString );
     void syncLayerRemove( QStringList theLayerIds );
-    void setProgressValue( double progress );
+    void invalidateProjectLayerIndex();
+    void offlineJobProgress();
+    void offlineJobCompleted( WebDataOfflineTask* task );
+    void offlineJobTerminated( WebDataOfflineTask* task );
 
   signals:
     void serviceAdded();
+    /**Emitted if the capabilities of a service could not be retrieved or parsed
+    @param title service title
+    @param errorMessage network or parser error*/
+    void serviceRequestFailed( const QString& title, const QString& errorMessage );
+    /**A layer could not be taken offline (not emitted for cancelled jobs)*/
+    void offlineJobFailed( const QString& layerName, const QString& errorMessage );
 
   private:
-    QNetworkReply *mCapabilitiesReply;
+    enum LayerFlag
+    {
+      GroupFlag = 1,     //layer without name, only groups its sublayers
+      FavouriteFlag = 2,
+      InMapFlag = 4,
+      OfflineFlag = 8,
+      RemovedFlag = 16,  //slot of a removed layer
+      ExtentFlag = 32    //west / south / east / north are set
+    };
+
+    /**Compact record for a layer row*/
+    struct Layer
+    {
+      Layer(): parent( -1 ), row( 0 ), crs( 0 ), styles( 0 ), keywords( 0 ), west( 0 ), south( 0 ), east( 0 ), north( 0 ),
+        flags( 0 ), number( -1 ) {}
+
+      /**Layer name (title for groups)*/
+      QString name;
+      QString title;
+      QString abstract;
+      /**Slot of the parent layer in the layer array of the service (-1 for top level layers)*/
+      int parent;
+      /**Position in the parent's children*/
+      int row;
+      /**Slots of the sublayers*/
+      QVector<int> children;
+      /**Interned comma separated lists*/
+      quint32 crs;
+      quint32 styles;
+      quint32 keywords;
+      /**Geographic extent (WGS 84) if ExtentFlag is set*/
+      float west;
+      float south;
+      float east;
+      float north;
+      quint8 flags;
+      /**Position in the facet bitsets (-1 for layer groups)*/
+      int number;
+      /**Id of the map layer if the layer is in the map*/
+      QString layerId;
+      /**Path of the offline data source*/
+      QString filePath;
+    };
+
+    /**A service with its layers. Layer slots never move, so model indices can refer to them. Removed layers only
+      get the RemovedFlag, until compactLayers() reads the layers of the service again*/
+    struct Service
+    {
+      Service(): id( 0 ), type( 0 ), formats( 0 ), pendingLayerCount( 0 ) {}
+
+      /**Stable id used in the internal id of model indices*/
+      quint32 id;
+      QString title;
+      QString url;
+      /**Interned service type (WMS/WFS)*/
+      quint32 type;
+      /**Interned comma separated GetMap formats*/
+      quint32 formats;
+      /**Version of the capabilities document, used for GetMap requests*/
+      QString version;
+      /**Largest GetMap image the server accepts (0 if not advertised)*/
+      QSize maxImageSize;
+      QVector<Layer> layers;
+      QVector<int> topLevel;
+      /**Saved XML of the service element as long as its layers have not been created (see fetchMore())*/
+      QString pendingXml;
+      /**Number of layers of the service in the database as long as its layers have not been created*/
+      int pendingLayerCount;
+    };
+
+    QList<Service*> mServices;
+    QHash<quint32, Service*> mServiceById;
+    /**Service id and layer slot of the catalogue rows which are in the map, by map layer id*/
+    typedef QPair<quint32, int> MapLayerRow;
+    QHash<QString, MapLayerRow> mMapLayerRows;
+    /**Map layer ids by source key (see buildProjectLayerIndex()). Rebuilt after map layers are added / removed*/
+    QHash<QString, QString> mProjectLayerIndex;
+    bool mProjectLayerIndexValid;
+    quint32 mNextServiceId;
+    WebDataStringPool mStrings;
+    WebDataSearchIndex mSearchIndex;
+    WebDataFacetIndex mFacets;
+    /**Database with the services and layers. Layers are read from it on demand, changes are written immediately*/
+    WebDataCatalogStore mStore;
+    /**True once setCatalogue() has been called*/
+    bool mCatalogueLoaded;
+    /**R-tree over the geographic extents of the layers. Feature ids are the internal ids of the layer indices*/
+    QgsSpatialIndex mExtentIndex;
+
+    QIcon mFavouriteIcon;
+    QIcon mOnlineIcon;
+    QIcon mOfflineIcon;
+
+    /**State of a GetCapabilities request*/
+    struct CapabilitiesRequest
+    {
+      QString title;
+      QString url;
+      QString service;
+      QString host;
+      /**Complete GetCapabilities url, also the key in the capabilities cache*/
+      QString requestUrl;
+      /**Validators sent with the request (from the cache) or received with the response*/
+      QString eTag;
+      QString lastModified;
+      /**Parses the document in mParserThread*/
+      WebDataCapabilitiesWorker* worker;
+    };
+
+    /**Running requests by network reply*/
+    QHash<QNetworkReply*, CapabilitiesRequest> mCapabilitiesRequests;
+    /**Downloaded requests waiting for the parser to finish*/
+    QHash<WebDataCapabilitiesWorker*, CapabilitiesRequest> mParsingRequests;
+    /**Thread for parsing capabilities documents*/
+    QThread mParserThread;
+    /**Waiting and running offline jobs by internal id of the layer index*/
+    QHash<quintptr, WebDataOfflineTask*> mOfflineJobs;
+    /**Reverse of mOfflineJobs: internal id of the layer index by job*/
+    QHash<const WebDataOfflineTask*, quintptr> mOfflineJobIds;
+    WebDataOfflineScheduler mOfflineScheduler;
+    /**Offline data source replaced by a reload job, by job*/
+    QHash<WebDataOfflineTask*, QString> mReloadJobs;
+    /**Requests waiting for a free slot on their host*/
+    QList<CapabilitiesRequest> mQueuedCapabilitiesRequests;
+    QHash<QString, int> mRunningRequestsPerHost;
+    WebDataCapabilitiesCache mCapabilitiesCache;
     QgisInterface* mIface;
-    QProgressDialog* mProgressDialog;
+
+    /**Inserts the cached layer records for the request into the model. Returns false if there are none*/
+    bool insertCachedServiceLayers( const CapabilitiesRequest& request );
+    /**Starts queued requests as long as their host has less than the maximum number of running requests*/
+    void startQueuedCapabilitiesRequests();
+    /**Returns true if a request for the service with the given title is running or queued*/
+    bool capabilitiesRequestPending( const QString& title ) const;
+
+    /**Layer records of a capabilities document with their parent / child relations*/
+    struct LayerRecordTree
+    {
+      const QList<WebDataLayerRecord>* records;
+      /**Sublayer record indices for each record*/
+      QVector< QList<int> > children;
+      QList<int> topLevel;
+      /**Interned comma separated GetMap formats*/
+      quint32 formats;
+      bool wms;
+    };
+
+    /**Creates the service with a row for each layer record and adds it to the model. If the service is already
+      in the model, the existing rows are updated instead*/
+    void insertServiceLayers( const QString& serviceTitle, const QString& url, const QString& serviceType,
+                              const QList<WebDataLayerRecord>& records, const QStringList& formats,
+                              const QString& version, const QSize& maxImageSize );
+    /**Appends the layer of a record (and its sublayers) to the layer array of the service. Returns the slot*/
+    int createLayer( Service* service, int parentSlot, int recordIndex, const LayerRecordTree& tree );
+    /**Matches the children of parentSlot (-1: top level) with the records by layer name. Rows of known layers keep their
+      state and only get their metadata updated, rows are inserted / removed only for new / vanished layers*/
+    void mergeLayers( Service* service, int parentSlot, const QList<int>& recordIndices, const LayerRecordTree& tree );
+    /**Layer name or title of a layer group, used to match rows with capabilities records*/
+    static QString layerKey( const Layer& layer );
+    /**True if the layer or one of its sublayers is offline or in the map*/
+    static bool layerInUse( const Service* service, int slot );
+    quint32 internCrs( const WebDataLayerRecord& record, bool wms );
+
+    /**Removes the layer rows [row, row + count) below parentSlot (-1: top level). Emits the remove signals*/
+    void removeLayers( Service* service, int parentSlot, int row, int count );
+    /**Adds the texts of a layer to the search index (or updates them)*/
+    void indexLayer( const Service* service, int slot );
+    /**Gives a new layer its number in the facet index and sets its facets*/
+    void addLayerFacets( Service* service, int slot );
+    /**Sets the extent of a layer and updates the R-tree*/
+    void setLayerExtent( Service* service, int slot, bool hasExtent, double west, double south, double east, double north );
+    static QgsRectangle layerExtent( const Layer& layer );
+    /**Sets or clears InMapFlag / OfflineFlag and updates the corresponding facet*/
+    void setLayerFlag( Layer& layer, LayerFlag flag, bool on );
+    /**Clears a layer slot and all sublayer slots and sets their RemovedFlag*/
+    void markLayerRemoved( Service* service, int slot );
+
+    //access to services and layers by model index
+    QModelIndex serviceIndex( const Service* service, int column = 0 ) const;
+    QModelIndex layerIndex( const Service* service, int slot, int column = 0 ) const;
+    /**Returns the service of a service or layer index*/
+    Service* serviceFromIndex( const QModelIndex& index ) const;
+    /**Returns the layer slot of an index or -1 for service rows / invalid indices*/
+    static int slotFromIndex( const QModelIndex& index );
+    Layer* layerFromIndex( const QModelIndex& index ) const;
+    Service* serviceByTitle( const QString& title ) const;
+    /**Children slots of a layer or the top level layers of the service if slot is -1*/
+    static const QVector<int>& childSlots( const Service* service, int slot );
+    quintptr internalId( const Service* service, int slot ) const;
+    /**Sets the map layer id of a layer and keeps mMapLayerRows up to date (empty id: not in map)*/
+    void setMapLayerId( Service* service, int slot, const QString& layerId );
+    /**Emits dataChanged for the given columns of a layer row*/
+    void emitLayerChanged( const QModelIndex& index, int firstColumn, int lastColumn );
 
     QString wfsUrlFromLayerIndex( const QModelIndex& index ) const;
     QgsDataSourceUri wmsUriFromIndex( const QModelIndex& index ) const;
@@ -57,16 +376,90 @@ class WebDataModel: public QStandardItemModel
     /**Exchanges a layer in the map canvas (and copies the style of the new layer to the old one)*/
     bool exchangeLayer( const QString& layerId, QgsMapLayer* newLayer );
     void deleteOfflineDatasource( const QString& serviceType, const QString& offlinePath );
+    /**Output of WMS layers taken offline together*/
+    struct RasterOfflineSettings
+    {
+      RasterOfflineSettings(): columns( 0 ), rows( 0 ), tiled( false ), tileWidth( 0 ), tileHeight( 0 ) {}
+
+      QgsRectangle extent;
+      QgsCoordinateReferenceSystem crs;
+      int columns;
+      int rows;
+      bool tiled;
+      int tileWidth;
+      int tileHeight;
+    };
+
+    void startVectorOfflineJob( const QModelIndex& index );
+    /**Asks for the output with the save as dialog unless settingsValid is set. Returns false if the dialog is cancelled*/
+    bool startRasterOfflineJob( const QModelIndex& index, RasterOfflineSettings& settings, bool& settingsValid );
+    /**Reads extent, CRS and size of an offline raster, so it can be downloaded again without the save dialog*/
+    static bool rasterOfflineSettings( const QString& filePath, RasterOfflineSettings& settings );
+    /**Starts the raster job of a checkpoint (new or interrupted)*/
+    void startRasterOfflineJob( const QModelIndex& index, const QString& manifestPath,
+                                const QMap<QString, QString>& parameters );
+    /**Directory of the offline data sources and the checkpoints*/
+    static QString offlineDirectory();
+    /**Identifies the layer in offline checkpoints*/
+    QString offlineSource( const QModelIndex& index ) const;
+    /**Deletes a checkpoint and the output of its job*/
+    static void removeCheckpoint( const QString& manifestPath );
+    /**Downloads an offline layer again into a new directory, offlineJobCompleted() swaps it with the old copy*/
+    void startOfflineReload( const QModelIndex& index );
+    /**Applies the changes of an offline WFS layer to a copy in a new directory, swapped in like a reload*/
+    void startVectorSyncJob( const QModelIndex& index );
+    /**Queues an offline job and shows its progress in the status column*/
+    void startOfflineJob( const QModelIndex& index, WebDataOfflineTask* task, qint64 estimatedSize );
+    /**Returns the layer index of an offline job (invalid if the layer has been removed)*/
+    QModelIndex offlineJobIndex( const WebDataOfflineTask* task ) const;
+    void takeOfflineJob( const WebDataOfflineTask* task );
 
     /**Returns id of layer in current map with given url (or empty string if no such layer)*/
-    static QString layerIdFromUrl( const QString& url, const QString& serviceType, bool online,
-                                   const QString& layerName );
+    QString layerIdFromUrl( const QString& url, const QString& serviceType, bool online,
+                            const QString& layerName );
+    /**Indexes the layers of the project by normalised source, so catalogue rows can be matched with map layers
+      without scanning the project for each row*/
+    void buildProjectLayerIndex();
+    /**Source key for a file based layer. Does not access the file system*/
+    static QString fileSourceKey( const QString& source );
+    /**Source key for a WMS / WFS layer: service type, service url without request parameters and layer name*/
+    static QString serviceSourceKey( const QString& serviceType, const QString& url, const QString& layerName );
+    /**Returns the value of a query item, the key is compared case insensitive*/
+    static QString queryItemValue( const QUrlQuery& query, const QString& key );
 
-    void loadFromXML();
-    void saveToXML() const;
+    /**Appends the database records of the layers below parentSlot (-1: top level) in depth first order*/
+    void catalogueLayerRecords( const Service* service, int parentSlot, int parentPosition,
+                                QVector<WebDataCatalogStore::LayerRecord>& records ) const;
+    /**Creates the layers of a service from database records without emitting signals*/
+    void createLayersFromRecords( Service* service, const QVector<WebDataCatalogStore::LayerRecord>& records );
+    //write changes of the catalogue to the database
+    void storeLayerState( const Service* service, int slot );
+    /**Writes a service with all its layers. Returns false if the database is not open or the write failed*/
+    bool storeService( const Service* service );
+    /**Reads the layers of a service again from the database if most of its slots belong to removed layers and no
+      offline job runs for the service. The service needs to be stored*/
+    void compactLayers( Service* service );
+    void storeServiceRemoved( const Service* service );
+    /**Removes a service from the indices and deletes it. The service must already be taken from mServices*/
+    void deleteService( Service* service );
+    /**Writes a service read from webdata.xml to the database. Its layers are then read from there*/
+    void storeXMLService( Service* service );
+    /**Returns true if the layers of a service have not been created yet (see fetchMore())*/
+    static bool hasPendingLayers( const Service* service );
+    /**Reads the services from a webdata.xml file. Services already in the model are skipped. The layers are kept as
+      unparsed XML until they are needed*/
+    bool loadFromXML( const QString& path );
+    /**Creates the layer rows from the pending XML or catalogue records of a service (if any)*/
+    void fetchServiceLayers( Service* service );
+    /**Creates the layers of a service from its records in the database*/
+    void loadLayersFromStore( Service* service );
+    /**Creates the layers (and sublayers) for the layer elements below parentElem*/
+    void loadLayersFromXML( const QDomElement& parentElem, Service* service, int parentSlot );
+    /**Appends a layer read from file to its parent's children and adds it to the indices. Returns the slot*/
+    int appendLoadedLayer( Service* service, const Layer& layer, const QString& layerId );
+    bool saveToXML( const QString& path ) const;
+    void saveLayersToXML( const Service* service, int parentSlot, QDomElement& parentElem, QDomDocument& doc ) const;
 
-    /**Returns path to web.xml. Creates the file if not there*/
-    QString xmlFilePath() const;
 
     /**Modes a layer after ml in the legend tree*/
     void legendMoveLayer( const QgsMapLayer* ml, const QgsMapLayer* after );
@@ -0,0 +1,208 @@
+#include "webdataofflinecheckpoint.h"
+#include "qgslogger.h"
+#include <QCryptographicHash>
+#include <QDir>
+#include <QSaveFile>
+#include <QUrl>
+
+static const QByteArray MANIFEST_HEADER = "webdata-checkpoint 1";
+
+WebDataOfflineCheckpoint::WebDataOfflineCheckpoint( const QString& manifestPath, const QString& outputPath ):
+  mManifestPath( manifestPath ), mOutputPath( outputPath )
+{
+}
+
+WebDataOfflineCheckpoint::~WebDataOfflineCheckpoint()
+{
+}
+
+bool WebDataOfflineCheckpoint::open()
+{
+  mFile.close();
+  mCompletedUnits.clear();
+
+  QList<Unit> units;
+  QMap<QString, QString> manifestParameters;
+  if ( !QFile::exists( mManifestPath ) || !readManifest( mManifestPath, manifestParameters, &units )
+       || manifestParameters != mParameters )
+  {
+    units.clear();
+  }
+
+  //rewritten with the intact units only, so a line broken off by a crash does not stay in the manifest
+  QSaveFile saveFile( mManifestPath );
+  if ( !saveFile.open( QIODevice::WriteOnly ) )
+  {
+    QgsDebugMsg( "Cannot write " + mManifestPath );
+    return false;
+  }
+  saveFile.write( MANIFEST_HEADER + "\n" );
+  QMap<QString, QString>::const_iterator parameterIt = mParameters.constBegin();
+  for ( ; parameterIt != mParameters.constEnd(); ++parameterIt )
+  {
+    saveFile.write( "param " + QUrl::toPercentEncoding( parameterIt.key() ) + " "
+                    + QUrl::toPercentEncoding( parameterIt.value() ) + "\n" );
+  }
+
+  QList<Unit>::const_iterator unitIt = units.constBegin();
+  for ( ; unitIt != units.constEnd(); ++unitIt )
+  {
+    qint64 size;
+    QByteArray md5;
+    if ( checksum( unitIt->files, size, md5 ) && size == unitIt->size && md5 == unitIt->md5 )
+    {
+      saveFile.write( unitLine( *unitIt ) );
+      mCompletedUnits.insert( unitIt->id );
+    }
+    else
+    {
+      QgsDebugMsg( "Checkpoint unit " + unitIt->id + " is damaged and written again" );
+    }
+  }
+  if ( !saveFile.commit() )
+  {
+    return false;
+  }
+
+  mFile.setFileName( mManifestPath );
+  return mFile.open( QIODevice::WriteOnly | QIODevice::Append );
+}
+
+bool WebDataOfflineCheckpoint::addParameter( const QString& key, const QString& value )
+{
+  if ( !mFile.isOpen() )
+  {
+    return false;
+  }
+
+  //read back by readParameters() only as long as no unit has been written
+  bool ok = ( mFile.write( "param " + QUrl::toPercentEncoding( key ) + " " + QUrl::toPercentEncoding( value ) + "\n" ) > 0 )
+            && mFile.flush();
+  if ( ok )
+  {
+    mParameters.insert( key, value );
+  }
+  return ok;
+}
+
+bool WebDataOfflineCheckpoint::addUnit( const QString& id, const QStringList& files )
+{
+  Unit unit;
+  unit.id = id;
+  unit.files = files;
+  if ( !mFile.isOpen() || !checksum( files, unit.size, unit.md5 ) )
+  {
+    return false;
+  }
+
+  //flushed at once, the next line may never be written
+  bool ok = ( mFile.write( unitLine( unit ) ) > 0 ) && mFile.flush();
+  if ( ok )
+  {
+    mCompletedUnits.insert( id );
+  }
+  return ok;
+}
+
+void WebDataOfflineCheckpoint::remove()
+{
+  mFile.close();
+  QFile::remove( mManifestPath );
+}
+
+QString WebDataOfflineCheckpoint::findManifest( const QString& directory, const QString& source )
+{
+  QFileInfoList manifests = QDir( directory ).entryInfoList( QStringList( "*.checkpoint" ), QDir::Files );
+  QFileInfoList::const_iterator manifestIt = manifests.constBegin();
+  for ( ; manifestIt != manifests.constEnd(); ++manifestIt )
+  {
+    QMap<QString, QString> parameters;
+    if ( readParameters( manifestIt->absoluteFilePath(), parameters ) && parameters.value( "source" ) == source )
+    {
+      return manifestIt->absoluteFilePath();
+    }
+  }
+  return QString();
+}
+
+bool WebDataOfflineCheckpoint::readParameters( const QString& manifestPath, QMap<QString, QString>& parameters )
+{
+  return readManifest( manifestPath, parameters, 0 );
+}
+
+bool WebDataOfflineCheckpoint::readManifest( const QString& manifestPath, QMap<QString, QString>& parameters,
+    QList<Unit>* units )
+{
+  QFile manifestFile( manifestPath );
+  if ( !manifestFile.open( QIODevice::ReadOnly ) || manifestFile.readLine().trimmed() != MANIFEST_HEADER )
+  {
+    return false;
+  }
+
+  while ( !manifestFile.atEnd() )
+  {
+    QByteArray line = manifestFile.readLine();
+    //the last line may have been broken off
+    if ( !line.endsWith( '\n' ) )
+    {
+      break;
+    }
+
+    line.chop( 1 );
+    QList<QByteArray> fields = line.split( ' ' );
+    if ( fields.size() == 3 && fields.at( 0 ) == "param" )
+    {
+      parameters.insert( QUrl::fromPercentEncoding( fields.at( 1 ) ), QUrl::fromPercentEncoding( fields.at( 2 ) ) );
+    }
+    else if ( !units )
+    {
+      //units come after the parameters
+      break;
+    }
+    else if ( fields.size() == 5 && fields.at( 0 ) == "unit" )
+    {
+      Unit unit;
+      unit.id = QUrl::fromPercentEncoding( fields.at( 1 ) );
+      unit.size = fields.at( 2 ).toLongLong();
+      unit.md5 = QByteArray::fromHex( fields.at( 3 ) );
+      QList<QByteArray> files = fields.at( 4 ).split( ',' );
+      QList<QByteArray>::const_iterator fileIt = files.constBegin();
+      for ( ; fileIt != files.constEnd(); ++fileIt )
+      {
+        unit.files.append( QUrl::fromPercentEncoding( *fileIt ) );
+      }
+      units->append( unit );
+    }
+  }
+  return true;
+}
+
+bool WebDataOfflineCheckpoint::checksum( const QStringList& files, qint64& size, QByteArray& md5 ) const
+{
+  size = 0;
+  QCryptographicHash hash( QCryptographicHash::Md5 );
+  QStringList::const_iterator fileIt = files.constBegin();
+  for ( ; fileIt != files.constEnd(); ++fileIt )
+  {
+    QFile file( mOutputPath + "/" + *fileIt );
+    if ( !file.open( QIODevice::ReadOnly ) || !hash.addData( &file ) )
+    {
+      return false;
+    }
+    size += file.size();
+  }
+  md5 = hash.result();
+  return true;
+}
+
+QByteArray WebDataOfflineCheckpoint::unitLine( const Unit& unit )
+{
+  QList<QByteArray> files;
+  QStringList::const_iterator fileIt = unit.files.constBegin();
+  for ( ; fileIt != unit.files.constEnd(); ++fileIt )
+  {
+    files.append( QUrl::toPercentEncoding( *fileIt ) );
+  }
+  return "unit " + QUrl::toPercentEncoding( unit.id ) + " " + QByteArray::number( unit.size ) + " " + unit.md5.toHex()
+         + " " + files.join( ',' ) + "\n";
+}
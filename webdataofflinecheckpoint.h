@@ -0,0 +1,70 @@
+#ifndef WEBDATAOFFLINECHECKPOINT_H
+#define WEBDATAOFFLINECHECKPOINT_H
+
+#include <QFile>
+#include <QMap>
+#include <QSet>
+#include <QStringList>
+
+/**Manifest of the completed units (raster tiles, vector pages) of an offline job. A unit is appended and flushed as
+  soon as its files have been written, so a job interrupted by a crash or a network failure can resume where it
+  stopped. The manifest lies next to the output directory (<output>.checkpoint) and also keeps the parameters of the
+  job. On resume, the files of each unit are checked against the size and MD5 sum in the manifest*/
+class WebDataOfflineCheckpoint
+{
+  public:
+    /**@param manifestPath path of the manifest file
+      @param outputPath directory with the files of the units*/
+    WebDataOfflineCheckpoint( const QString& manifestPath, const QString& outputPath );
+    ~WebDataOfflineCheckpoint();
+
+    /**Parameters of the job. The 'source' parameter identifies the layer (see findManifest())*/
+    void setParameters( const QMap<QString, QString>& parameters ) { mParameters = parameters; }
+    QMap<QString, QString> parameters() const { return mParameters; }
+    /**Appends a parameter the job determines itself (after open(), before the first unit), so a resumed job
+      gets the same value*/
+    bool addParameter( const QString& key, const QString& value );
+
+    /**Reads an existing manifest with the same source and keeps the units whose files are intact. Starts a new
+      manifest otherwise. Returns false if the manifest cannot be written*/
+    bool open();
+    /**Ids of the verified units*/
+    QSet<QString> completedUnits() const { return mCompletedUnits; }
+    /**Appends a unit to the manifest
+      @param files names of the files of the unit, relative to the output directory*/
+    bool addUnit( const QString& id, const QStringList& files );
+    /**Closes and deletes the manifest (after the job has finished or has been cancelled)*/
+    void remove();
+
+    QString manifestPath() const { return mManifestPath; }
+
+    /**Returns the manifest of an interrupted job for the source in directory (empty if there is none)*/
+    static QString findManifest( const QString& directory, const QString& source );
+    /**Reads the parameters of a manifest*/
+    static bool readParameters( const QString& manifestPath, QMap<QString, QString>& parameters );
+
+  private:
+    /**A line of the manifest: unit id, size and MD5 sum of the files*/
+    struct Unit
+    {
+      QString id;
+      qint64 size;
+      QByteArray md5;
+      QStringList files;
+    };
+
+    QString mManifestPath;
+    QString mOutputPath;
+    QMap<QString, QString> mParameters;
+    QSet<QString> mCompletedUnits;
+    /**Opened for appending units*/
+    QFile mFile;
+
+    /**Reads parameters and units of a manifest*/
+    static bool readManifest( const QString& manifestPath, QMap<QString, QString>& parameters, QList<Unit>* units );
+    /**Computes size and MD5 sum of files in the output directory. Returns false if a file cannot be read*/
+    bool checksum( const QStringList& files, qint64& size, QByteArray& md5 ) const;
+    static QByteArray unitLine( const Unit& unit );
+};
+
+#endif // WEBDATAOFFLINECHECKPOINT_H
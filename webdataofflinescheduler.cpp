@@ -0,0 +1,140 @@
+#include "webdataofflinescheduler.h"
+#include "webdataofflinetask.h"
+#include "qgsapplication.h"
+#include <QSettings>
+
+WebDataOfflineScheduler::WebDataOfflineScheduler( QObject* parent ): QObject( parent )
+{
+}
+
+WebDataOfflineScheduler::~WebDataOfflineScheduler()
+{
+  QList<Job>::const_iterator waitingIt = mWaitingJobs.constBegin();
+  for ( ; waitingIt != mWaitingJobs.constEnd(); ++waitingIt )
+  {
+    delete waitingIt->task;
+  }
+
+  //the task manager outlives the scheduler, running jobs would write files nobody takes over
+  QHash<WebDataOfflineTask*, QString>::const_iterator runningIt = mRunningJobs.constBegin();
+  for ( ; runningIt != mRunningJobs.constEnd(); ++runningIt )
+  {
+    runningIt.key()->disconnect( this );
+    runningIt.key()->cancel();
+  }
+}
+
+void WebDataOfflineScheduler::addJob( WebDataOfflineTask* task, const QString& host, qint64 estimatedSize )
+{
+  Job job;
+  job.task = task;
+  job.host = host;
+  job.estimatedSize = estimatedSize;
+
+  //behind the jobs of the same size, so jobs without estimate keep their order
+  QList<Job>::iterator waitingIt = mWaitingJobs.begin();
+  while ( waitingIt != mWaitingJobs.end() && waitingIt->estimatedSize <= estimatedSize )
+  {
+    ++waitingIt;
+  }
+  mWaitingJobs.insert( waitingIt, job );
+  startJobs();
+}
+
+void WebDataOfflineScheduler::cancelJob( WebDataOfflineTask* task )
+{
+  if ( mRunningJobs.contains( task ) )
+  {
+    //ends with taskTerminated()
+    task->cancel();
+    return;
+  }
+
+  QList<Job>::iterator waitingIt = mWaitingJobs.begin();
+  for ( ; waitingIt != mWaitingJobs.end(); ++waitingIt )
+  {
+    if ( waitingIt->task == task )
+    {
+      mWaitingJobs.erase( waitingIt );
+      emit jobTerminated( task );
+      task->deleteLater();
+      return;
+    }
+  }
+}
+
+bool WebDataOfflineScheduler::isWaiting( const WebDataOfflineTask* task ) const
+{
+  QList<Job>::const_iterator waitingIt = mWaitingJobs.constBegin();
+  for ( ; waitingIt != mWaitingJobs.constEnd(); ++waitingIt )
+  {
+    if ( waitingIt->task == task )
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void WebDataOfflineScheduler::taskCompleted()
+{
+  WebDataOfflineTask* task = qobject_cast<WebDataOfflineTask*>( sender() );
+  if ( finishJob( task ) )
+  {
+    emit jobCompleted( task );
+    startJobs();
+  }
+}
+
+void WebDataOfflineScheduler::taskTerminated()
+{
+  WebDataOfflineTask* task = qobject_cast<WebDataOfflineTask*>( sender() );
+  if ( finishJob( task ) )
+  {
+    emit jobTerminated( task );
+    startJobs();
+  }
+}
+
+void WebDataOfflineScheduler::startJobs()
+{
+  QSettings s;
+  int maxJobs = qMax( 1, s.value( "/NIWA/maxOfflineJobs", 4 ).toInt() );
+  int maxJobsPerHost = qMax( 1, s.value( "/NIWA/maxOfflineJobsPerHost", 2 ).toInt() );
+
+  QList<Job>::iterator waitingIt = mWaitingJobs.begin();
+  while ( waitingIt != mWaitingJobs.end() && mRunningJobs.size() < maxJobs )
+  {
+    if ( mRunningJobsPerHost.value( waitingIt->host, 0 ) >= maxJobsPerHost )
+    {
+      ++waitingIt;
+      continue;
+    }
+
+    Job job = *waitingIt;
+    waitingIt = mWaitingJobs.erase( waitingIt );
+    mRunningJobs.insert( job.task, job.host );
+    mRunningJobsPerHost[job.host] += 1;
+    connect( job.task, SIGNAL( taskCompleted() ), this, SLOT( taskCompleted() ) );
+    connect( job.task, SIGNAL( taskTerminated() ), this, SLOT( taskTerminated() ) );
+    //the task manager deletes the task when it has finished
+    QgsApplication::taskManager()->addTask( job.task );
+  }
+}
+
+bool WebDataOfflineScheduler::finishJob( WebDataOfflineTask* task )
+{
+  QHash<WebDataOfflineTask*, QString>::iterator runningIt = mRunningJobs.find( task );
+  if ( runningIt == mRunningJobs.end() )
+  {
+    return false;
+  }
+
+  QString host = runningIt.value();
+  mRunningJobs.erase( runningIt );
+  if ( --mRunningJobsPerHost[host] < 1 )
+  {
+    mRunningJobsPerHost.remove( host );
+  }
+  return true;
+}
@@ -0,0 +1,58 @@
+#ifndef WEBDATAOFFLINESCHEDULER_H
+#define WEBDATAOFFLINESCHEDULER_H
+
+#include <QHash>
+#include <QList>
+#include <QObject>
+
+class WebDataOfflineTask;
+
+/**Queue for offline jobs. Jobs are handed to the QGIS task manager as long as fewer than /NIWA/maxOfflineJobs jobs
+  are running in total and fewer than /NIWA/maxOfflineJobsPerHost on the job's host. Waiting jobs start smallest
+  first, so many small layers are not held up by a large one*/
+class WebDataOfflineScheduler: public QObject
+{
+    Q_OBJECT
+  public:
+    WebDataOfflineScheduler( QObject* parent = 0 );
+    /**Deletes the waiting jobs and cancels the running ones (without signals)*/
+    ~WebDataOfflineScheduler();
+
+    /**Queues a job. The scheduler owns the task until it is started, then the task manager does
+      @param host host of the service (the per host limit protects the servers)
+      @param estimatedSize estimated size of the output in bytes (0 if unknown)*/
+    void addJob( WebDataOfflineTask* task, const QString& host, qint64 estimatedSize );
+    /**Cancels a running job or removes a waiting one. Both end with jobTerminated()*/
+    void cancelJob( WebDataOfflineTask* task );
+    bool isWaiting( const WebDataOfflineTask* task ) const;
+
+  signals:
+    void jobCompleted( WebDataOfflineTask* task );
+    /**A job has failed or has been cancelled. The task is deleted afterwards*/
+    void jobTerminated( WebDataOfflineTask* task );
+
+  private slots:
+    void taskCompleted();
+    void taskTerminated();
+
+  private:
+    struct Job
+    {
+      WebDataOfflineTask* task;
+      QString host;
+      qint64 estimatedSize;
+    };
+
+    /**Waiting jobs by ascending estimated size*/
+    QList<Job> mWaitingJobs;
+    /**Host of the running jobs*/
+    QHash<WebDataOfflineTask*, QString> mRunningJobs;
+    QHash<QString, int> mRunningJobsPerHost;
+
+    /**Starts waiting jobs as far as the limits allow*/
+    void startJobs();
+    /**Removes a finished job from the running jobs. Returns false if it is not a job of the scheduler*/
+    bool finishJob( WebDataOfflineTask* task );
+};
+
+#endif // WEBDATAOFFLINESCHEDULER_H
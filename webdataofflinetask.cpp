@@ -0,0 +1,1169 @@
+#include "webdataofflinetask.h"
+#include "webdataofflinecheckpoint.h"
+#include "webdatasyncstate.h"
+#include "qgsexpression.h"
+#include "qgsfeedback.h"
+#include "qgslogger.h"
+#include "qgsnetworkaccessmanager.h"
+#include "qgsvectorfilewriter.h"
+#include "qgsvectorlayer.h"
+#include <QDir>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QImage>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QUrlQuery>
+#include <QXmlStreamReader>
+#include <cmath>
+#include <limits>
+#include <cpl_string.h>
+#include <gdal.h>
+#include <gdal_utils.h>
+
+/**Requests per tile before the job fails*/
+static const int MAX_TILE_ATTEMPTS = 3;
+/**Smallest size tiles are reduced to after failed or slow requests*/
+static const int MIN_TILE_SIZE = 256;
+//ms after which a GetMap request counts as slow (close to the timeouts of servers and proxies)
+static const qint64 SLOW_TILE_MS = 20000;
+/**Successive fast requests before the tile size is doubled*/
+static const int FAST_TILES_TO_GROW = 8;
+/**Default names of the key and last modified fields of offline WFS layers (see WebDataSyncState::findField())*/
+static const char* SYNC_KEY_FIELDS = "id,fid,gid,objectid,ogc_fid";
+static const char* SYNC_MODIFIED_FIELDS = "last_modified,lastmodified,modified,updated,last_edited_date";
+
+WebDataOfflineTask::WebDataOfflineTask( const QString& description, const QString& filePath, const QString& outputPath,
+                                        QgsFeedback* feedback ): QgsTask( description, QgsTask::CanCancel ),
+  mFilePath( filePath ), mOutputPath( outputPath ), mFeedback( feedback ), mCheckpoint( 0 ), mBytesWritten( 0 ),
+  mLastPercent( -1 )
+{
+  connect( mFeedback, SIGNAL( progressChanged( double ) ), this, SLOT( updateProgress( double ) ), Qt::DirectConnection );
+}
+
+WebDataOfflineTask::~WebDataOfflineTask()
+{
+  delete mFeedback;
+  delete mCheckpoint;
+}
+
+void WebDataOfflineTask::setCheckpoint( WebDataOfflineCheckpoint* checkpoint )
+{
+  delete mCheckpoint;
+  mCheckpoint = checkpoint;
+}
+
+void WebDataOfflineTask::cancel()
+{
+  //stops the writer at the next block / feature
+  mFeedback->cancel();
+  QgsTask::cancel();
+}
+
+bool WebDataOfflineTask::run()
+{
+  //verifying the files of an interrupted job takes a while
+  if ( mCheckpoint && !mCheckpoint->open() )
+  {
+    QgsDebugMsg( "The offline job cannot be resumed: " + mCheckpoint->manifestPath() );
+    mCheckpoint->remove();
+    delete mCheckpoint;
+    mCheckpoint = 0;
+  }
+
+  bool ok = write();
+  bool resumable = ( mCheckpoint != 0 );
+  if ( ok && !mFeedback->isCanceled() && !validate() )
+  {
+    //the units are intact, but do not make a readable data source
+    ok = false;
+    resumable = false;
+  }
+  if ( mFeedback->isCanceled() )
+  {
+    ok = false;
+    mErrorMessage.clear();
+  }
+
+  if ( !ok && resumable && !mFeedback->isCanceled() )
+  {
+    mErrorMessage += tr( ". The download continues when the layer is taken offline again" );
+    return false;
+  }
+
+  if ( mCheckpoint )
+  {
+    mCheckpoint->remove();
+  }
+  if ( !ok )
+  {
+    if ( !mOutputPath.isEmpty() )
+    {
+      removeOutput( mOutputPath );
+    }
+    mBytesWritten.store( 0 );
+    return false;
+  }
+
+  mBytesWritten.store( outputSize( mOutputPath ) );
+  emit bytesWrittenChanged( mBytesWritten.load() );
+  return true;
+}
+
+void WebDataOfflineTask::updateProgress( double progress )
+{
+  setProgress( progress );
+
+  //measuring the files for each block would slow down the writer
+  int percent = static_cast<int>( progress );
+  if ( percent == mLastPercent )
+  {
+    return;
+  }
+  mLastPercent = percent;
+  mBytesWritten.store( outputSize( mOutputPath ) );
+  emit bytesWrittenChanged( mBytesWritten.load() );
+}
+
+qint64 WebDataOfflineTask::outputSize( const QString& path )
+{
+  qint64 size = 0;
+  if ( path.isEmpty() )
+  {
+    return size;
+  }
+  if ( QFileInfo( path ).isDir() )
+  {
+    QDirIterator fileIt( path, QDir::Files, QDirIterator::Subdirectories );
+    while ( fileIt.hasNext() )
+    {
+      fileIt.next();
+      size += fileIt.fileInfo().size();
+    }
+    return size;
+  }
+
+  QFileInfoList files = outputFiles( path );
+  QFileInfoList::const_iterator fileIt = files.constBegin();
+  for ( ; fileIt != files.constEnd(); ++fileIt )
+  {
+    size += fileIt->size();
+  }
+  return size;
+}
+
+void WebDataOfflineTask::removeOutput( const QString& path )
+{
+  if ( QFileInfo( path ).isDir() )
+  {
+    QDir( path ).removeRecursively();
+    return;
+  }
+
+  QFileInfoList files = outputFiles( path );
+  QFileInfoList::const_iterator fileIt = files.constBegin();
+  for ( ; fileIt != files.constEnd(); ++fileIt )
+  {
+    QFile::remove( fileIt->absoluteFilePath() );
+  }
+}
+
+QFileInfoList WebDataOfflineTask::outputFiles( const QString& path )
+{
+  QFileInfo outputInfo( path );
+  QFileInfoList files;
+  QFileInfoList dirFiles = outputInfo.absoluteDir().entryInfoList( QDir::Files | QDir::NoDotAndDotDot );
+  QFileInfoList::const_iterator fileIt = dirFiles.constBegin();
+  for ( ; fileIt != dirFiles.constEnd(); ++fileIt )
+  {
+    if ( fileIt->completeBaseName() == outputInfo.completeBaseName() )
+    {
+      files.append( *fileIt );
+    }
+  }
+  return files;
+}
+
+WebDataVectorOfflineTask::WebDataVectorOfflineTask( const QString& description, const QString& wfsUrl,
+    const QString& layerName, const QString& filePath, const QString& outputPath, int pageGrid ):
+  WebDataOfflineTask( description, filePath, outputPath, new QgsFeedback() ), mWfsUrl( wfsUrl ), mLayerName( layerName ),
+  mOutputPath( outputPath ), mPageGrid( qMax( 1, pageGrid ) ), mKeyIndex( -1 ), mModifiedIndex( -1 )
+{
+}
+
+WebDataVectorOfflineTask::~WebDataVectorOfflineTask()
+{
+}
+
+bool WebDataVectorOfflineTask::write()
+{
+  //a layer of its own, the map layer must not be used outside of the GUI thread
+  QgsVectorLayer wfsLayer( mWfsUrl, mLayerName, "WFS", QgsVectorLayer::LayerOptions( false ) );
+  if ( !wfsLayer.isValid() )
+  {
+    mErrorMessage = tr( "The WFS layer %1 could not be loaded" ).arg( mLayerName );
+    return false;
+  }
+
+  //the sync state of the download lets a reload request only the changed features (see WebDataVectorSyncTask)
+  QgsFields fields = wfsLayer.fields();
+  mKeyIndex = WebDataSyncState::findField( fields, "/NIWA/syncKeyFields", SYNC_KEY_FIELDS );
+  mModifiedIndex = WebDataSyncState::findField( fields, "/NIWA/syncModifiedFields", SYNC_MODIFIED_FIELDS );
+  mSyncState = WebDataSyncState();
+  if ( mKeyIndex >= 0 )
+  {
+    mSyncState.keyField = fields.at( mKeyIndex ).name();
+    mSyncState.modifiedField = ( mModifiedIndex >= 0 ) ? fields.at( mModifiedIndex ).name() : QString();
+  }
+
+  //a resumed job keeps the grid of its completed pages, even if the advertised extent has changed meanwhile
+  QgsRectangle gridExtent = wfsLayer.extent();
+  QStringList gridExtentValues;
+  if ( checkpoint() )
+  {
+    gridExtentValues = checkpoint()->parameters().value( "gridExtent" ).split( "," );
+  }
+  if ( gridExtentValues.size() == 4 )
+  {
+    gridExtent = QgsRectangle( gridExtentValues.at( 0 ).toDouble(), gridExtentValues.at( 1 ).toDouble(),
+                               gridExtentValues.at( 2 ).toDouble(), gridExtentValues.at( 3 ).toDouble() );
+  }
+  else if ( checkpoint() && !checkpoint()->addParameter( "gridExtent", QString( "%1,%2,%3,%4" )
+            .arg( qgsDoubleToString( gridExtent.xMinimum() ) ).arg( qgsDoubleToString( gridExtent.yMinimum() ) )
+            .arg( qgsDoubleToString( gridExtent.xMaximum() ) ).arg( qgsDoubleToString( gridExtent.yMaximum() ) ) ) )
+  {
+    QgsDebugMsg( "Cannot add the grid extent to the checkpoint" );
+  }
+
+  //features without geometry are only found without BBOX filter
+  int grid = mPageGrid;
+  if ( wfsLayer.geometryType() == QgsWkbTypes::NullGeometry || gridExtent.isEmpty() )
+  {
+    grid = 1;
+  }
+
+  QSet<QString> completedPages;
+  if ( checkpoint() )
+  {
+    completedPages = checkpoint()->completedUnits();
+  }
+  //with more than one page, a last page may take the features without geometry
+  int nPages = ( grid > 1 ) ? grid * grid + 1 : 1;
+  QStringList pagePaths;
+  qint64 nWritten = 0;
+  for ( int row = 0; row < grid; ++row )
+  {
+    for ( int column = 0; column < grid; ++column )
+    {
+      QString pageName = QString( "page_%1_%2" ).arg( row ).arg( column );
+      QString pagePath = mOutputPath + "/" + pageName + ".shp";
+      pagePaths.append( pagePath );
+      qint64 pageFeatureCount = 0;
+      if ( completedPages.contains( pageName ) )
+      {
+        QgsVectorLayer pageLayer( pagePath, pageName, "ogr", QgsVectorLayer::LayerOptions( false ) );
+        pageFeatureCount = pageLayer.featureCount();
+      }
+      else
+      {
+        if ( !writePage( wfsLayer, gridExtent, grid, row, column, pagePath, pageFeatureCount ) )
+        {
+          return false;
+        }
+        QStringList pageFiles = QDir( mOutputPath ).entryList( QStringList( pageName + ".*" ), QDir::Files, QDir::Name );
+        if ( checkpoint() && !checkpoint()->addUnit( pageName, pageFiles ) )
+        {
+          QgsDebugMsg( "Cannot add page to checkpoint: " + pageName );
+        }
+      }
+      nWritten += pageFeatureCount;
+      //the rest is for the merge
+      feedback()->setProgress( 90.0 * pagePaths.size() / nPages );
+    }
+  }
+
+  //features without geometry never match the BBOX filter of a page. The extra request is only needed if the pages
+  //did not get all the features the server reports (or the server does not report a count)
+  qint64 nFeatures = wfsLayer.featureCount();
+  if ( grid > 1 && ( nFeatures < 0 || nFeatures > nWritten ) )
+  {
+    QString pageName = "page_nogeometry";
+    QString pagePath = mOutputPath + "/" + pageName + ".shp";
+    pagePaths.append( pagePath );
+    if ( !completedPages.contains( pageName ) )
+    {
+      qint64 pageFeatureCount = 0;
+      if ( !writePage( wfsLayer, gridExtent, grid, -1, -1, pagePath, pageFeatureCount ) )
+      {
+        return false;
+      }
+      QStringList pageFiles = QDir( mOutputPath ).entryList( QStringList( pageName + ".*" ), QDir::Files, QDir::Name );
+      if ( checkpoint() && !checkpoint()->addUnit( pageName, pageFiles ) )
+      {
+        QgsDebugMsg( "Cannot add page to checkpoint: " + pageName );
+      }
+    }
+    feedback()->setProgress( 90.0 );
+  }
+
+  if ( !mergePages( wfsLayer, pagePaths ) )
+  {
+    return false;
+  }
+
+  //the pages written before an interruption may have changed meanwhile, so the first sync after a resumed job
+  //compares all features
+  if ( !completedPages.isEmpty() )
+  {
+    mSyncState.lastModified = QVariant();
+  }
+  QString statePath = WebDataSyncState::statePath( filePath() );
+  if ( mKeyIndex >= 0 && !mSyncState.save( statePath ) )
+  {
+    QgsDebugMsg( "Cannot write " + statePath );
+  }
+  QStringList::const_iterator pageIt = pagePaths.constBegin();
+  for ( ; pageIt != pagePaths.constEnd(); ++pageIt )
+  {
+    QgsVectorFileWriter::deleteShapeFile( *pageIt );
+  }
+  feedback()->setProgress( 100.0 );
+  return true;
+}
+
+bool WebDataVectorOfflineTask::validate()
+{
+  QgsVectorLayer offlineLayer( filePath(), mLayerName, "ogr", QgsVectorLayer::LayerOptions( false ) );
+  if ( !offlineLayer.isValid() )
+  {
+    mErrorMessage = tr( "The shapefile of %1 cannot be read" ).arg( mLayerName );
+    return false;
+  }
+  return true;
+}
+
+bool WebDataVectorOfflineTask::writePage( QgsVectorLayer& wfsLayer, const QgsRectangle& gridExtent, int grid, int row,
+    int column, const QString& pagePath, qint64& featureCount )
+{
+  featureCount = 0;
+  QgsVectorFileWriter writer( pagePath, "UTF-8", wfsLayer.fields(), wfsLayer.wkbType(), wfsLayer.crs(), "ESRI Shapefile" );
+  if ( writer.hasError() != QgsVectorFileWriter::NoError )
+  {
+    mErrorMessage = writer.errorMessage();
+    return false;
+  }
+
+  QgsFeatureRequest request;
+  double pageWidth = gridExtent.width() / grid;
+  double pageHeight = gridExtent.height() / grid;
+  if ( row < 0 )
+  {
+    request.setFilterExpression( "$geometry IS NULL" );
+  }
+  else if ( grid > 1 )
+  {
+    //the advertised extent is often outdated, so the outer pages are unbounded on their open side
+    QgsRectangle requestExtent( gridExtent.xMinimum() + column * pageWidth, gridExtent.yMaximum() - ( row + 1 ) * pageHeight,
+                                gridExtent.xMinimum() + ( column + 1 ) * pageWidth, gridExtent.yMaximum() - row * pageHeight );
+    if ( column == 0 )
+    {
+      requestExtent.setXMinimum( -std::numeric_limits<double>::max() );
+    }
+    if ( column == grid - 1 )
+    {
+      requestExtent.setXMaximum( std::numeric_limits<double>::max() );
+    }
+    if ( row == 0 )
+    {
+      requestExtent.setYMaximum( std::numeric_limits<double>::max() );
+    }
+    if ( row == grid - 1 )
+    {
+      requestExtent.setYMinimum( -std::numeric_limits<double>::max() );
+    }
+    request.setFilterRect( requestExtent );
+  }
+
+  QgsFeatureIterator featureIt = wfsLayer.getFeatures( request );
+  QgsFeature feature;
+  while ( featureIt.nextFeature( feature ) )
+  {
+    if ( feedback()->isCanceled() )
+    {
+      return false;
+    }
+
+    //features crossing the page border are returned for several pages, but belong to the page of their centre
+    if ( grid > 1 && row >= 0 )
+    {
+      QgsPointXY centre = feature.geometry().boundingBox().center();
+      int featureColumn = qBound( 0, static_cast<int>( std::floor( ( centre.x() - gridExtent.xMinimum() ) / pageWidth ) ), grid - 1 );
+      int featureRow = qBound( 0, static_cast<int>( std::floor( ( gridExtent.yMaximum() - centre.y() ) / pageHeight ) ), grid - 1 );
+      if ( featureColumn != column || featureRow != row )
+      {
+        continue;
+      }
+    }
+
+    if ( !writer.addFeature( feature ) )
+    {
+      mErrorMessage = writer.errorMessage();
+      return false;
+    }
+    ++featureCount;
+
+    if ( mKeyIndex >= 0 )
+    {
+      mSyncState.hashes.insert( feature.attribute( mKeyIndex ).toString(), WebDataSyncState::featureHash( feature ) );
+      if ( mModifiedIndex >= 0 && WebDataSyncState::isNewer( feature.attribute( mModifiedIndex ), mSyncState.lastModified ) )
+      {
+        mSyncState.lastModified = feature.attribute( mModifiedIndex );
+      }
+    }
+  }
+  return true;
+}
+
+bool WebDataVectorOfflineTask::mergePages( QgsVectorLayer& wfsLayer, const QStringList& pagePaths )
+{
+  QgsVectorFileWriter writer( filePath(), "UTF-8", wfsLayer.fields(), wfsLayer.wkbType(), wfsLayer.crs(), "ESRI Shapefile" );
+  if ( writer.hasError() != QgsVectorFileWriter::NoError )
+  {
+    mErrorMessage = writer.errorMessage();
+    return false;
+  }
+
+  QStringList::const_iterator pageIt = pagePaths.constBegin();
+  for ( ; pageIt != pagePaths.constEnd(); ++pageIt )
+  {
+    QgsVectorLayer pageLayer( *pageIt, QFileInfo( *pageIt ).baseName(), "ogr", QgsVectorLayer::LayerOptions( false ) );
+    if ( !pageLayer.isValid() )
+    {
+      mErrorMessage = tr( "The page %1 could not be read" ).arg( *pageIt );
+      return false;
+    }
+
+    //the attributes of the pages are in the order of the WFS fields
+    QgsFeatureIterator featureIt = pageLayer.getFeatures();
+    QgsFeature feature;
+    while ( featureIt.nextFeature( feature ) )
+    {
+      if ( feedback()->isCanceled() )
+      {
+        return false;
+      }
+      if ( !writer.addFeature( feature ) )
+      {
+        mErrorMessage = writer.errorMessage();
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+WebDataVectorSyncTask::WebDataVectorSyncTask( const QString& description, const QString& wfsUrl, const QString& layerName,
+    const QString& sourceFilePath, const QString& filePath, const QString& outputPath ):
+  WebDataOfflineTask( description, filePath, outputPath, new QgsFeedback() ), mWfsUrl( wfsUrl ), mLayerName( layerName ),
+  mSourceFilePath( sourceFilePath ), mFullReloadRequired( false )
+{
+}
+
+WebDataVectorSyncTask::~WebDataVectorSyncTask()
+{
+}
+
+bool WebDataVectorSyncTask::write()
+{
+  //the map layer keeps reading the current shapefile, an interrupted sync only leaves an incomplete copy
+  if ( !copySource() )
+  {
+    mErrorMessage = tr( "The shapefile of %1 could not be copied" ).arg( mLayerName );
+    return false;
+  }
+
+  QgsVectorLayer offlineLayer( filePath(), mLayerName, "ogr", QgsVectorLayer::LayerOptions( false ) );
+  QgsVectorLayer wfsLayer( mWfsUrl, mLayerName, "WFS", QgsVectorLayer::LayerOptions( false ) );
+  if ( !offlineLayer.isValid() || !wfsLayer.isValid() )
+  {
+    mErrorMessage = tr( "The layer %1 could not be loaded" ).arg( mLayerName );
+    return false;
+  }
+
+  //the shapefile has the fields of the WFS layer in the same order (names may be shortened)
+  QgsFields fields = wfsLayer.fields();
+  int keyIndex = WebDataSyncState::findField( fields, "/NIWA/syncKeyFields", SYNC_KEY_FIELDS );
+  if ( keyIndex < 0 || offlineLayer.fields().count() != fields.count() )
+  {
+    mFullReloadRequired = true;
+    mErrorMessage = tr( "%1 has no key field to synchronise the features" ).arg( mLayerName );
+    return false;
+  }
+  int modifiedIndex = WebDataSyncState::findField( fields, "/NIWA/syncModifiedFields", SYNC_MODIFIED_FIELDS );
+
+  WebDataSyncState state;
+  QString statePath = WebDataSyncState::statePath( filePath() );
+  bool stateOk = state.load( statePath ) && state.keyField == fields.at( keyIndex ).name();
+  if ( !stateOk )
+  {
+    state = WebDataSyncState();
+    state.keyField = fields.at( keyIndex ).name();
+  }
+  state.modifiedField = ( modifiedIndex >= 0 ) ? fields.at( modifiedIndex ).name() : QString();
+
+  //taken from the shapefile, so features added by an interrupted sync are not added twice
+  QHash<QString, QgsFeatureId> offlineIds;
+  QgsFeatureRequest offlineRequest;
+  offlineRequest.setFlags( QgsFeatureRequest::NoGeometry );
+  offlineRequest.setSubsetOfAttributes( QgsAttributeList() << keyIndex );
+  QgsFeatureIterator offlineIt = offlineLayer.getFeatures( offlineRequest );
+  QgsFeature feature;
+  while ( offlineIt.nextFeature( feature ) )
+  {
+    offlineIds.insert( feature.attribute( keyIndex ).toString(), feature.id() );
+  }
+
+  //the server only sends the changed features if it can filter on the last modified field
+  bool incremental = stateOk && modifiedIndex >= 0 && state.lastModified.isValid()
+                     && wfsLayer.setSubsetString( QString( "%1 >= %2" ).arg( QgsExpression::quotedColumnRef( state.modifiedField ),
+                         QgsExpression::quotedValue( state.lastModified ) ) );
+  QSet<QString> serverKeys;
+  if ( incremental && !fetchServerKeys( state.keyField, serverKeys ) )
+  {
+    if ( !feedback()->isCanceled() )
+    {
+      mErrorMessage = tr( "The feature keys of %1 could not be downloaded" ).arg( mLayerName );
+    }
+    return false;
+  }
+  feedback()->setProgress( 10.0 );
+
+  QgsChangedAttributesMap changedAttributes;
+  QgsGeometryMap changedGeometries;
+  QgsFeatureList addedFeatures;
+  QSet<QString> addedKeys;
+  QVariant newestModified = state.lastModified;
+  qint64 nServerFeatures = 0;
+  QgsFeatureIterator wfsIt = wfsLayer.getFeatures();
+  while ( wfsIt.nextFeature( feature ) )
+  {
+    if ( feedback()->isCanceled() )
+    {
+      return false;
+    }
+
+    QString key = feature.attribute( keyIndex ).toString();
+    if ( !incremental )
+    {
+      serverKeys.insert( key );
+      ++nServerFeatures;
+    }
+    if ( modifiedIndex >= 0 && WebDataSyncState::isNewer( feature.attribute( modifiedIndex ), newestModified ) )
+    {
+      newestModified = feature.attribute( modifiedIndex );
+    }
+
+    QByteArray hash = WebDataSyncState::featureHash( feature );
+    QHash<QString, QgsFeatureId>::const_iterator offlineIdIt = offlineIds.constFind( key );
+    if ( ( offlineIdIt != offlineIds.constEnd() && state.hashes.value( key ) == hash ) || addedKeys.contains( key ) )
+    {
+      continue;
+    }
+    state.hashes.insert( key, hash );
+
+    if ( offlineIdIt != offlineIds.constEnd() )
+    {
+      QgsAttributeMap attributes;
+      for ( int i = 0; i < fields.count(); ++i )
+      {
+        attributes.insert( i, feature.attribute( i ) );
+      }
+      changedAttributes.insert( offlineIdIt.value(), attributes );
+      changedGeometries.insert( offlineIdIt.value(), feature.geometry() );
+    }
+    else
+    {
+      QgsFeature addedFeature( offlineLayer.fields() );
+      addedFeature.setAttributes( feature.attributes() );
+      addedFeature.setGeometry( feature.geometry() );
+      addedFeatures.append( addedFeature );
+      addedKeys.insert( key );
+    }
+  }
+  feedback()->setProgress( 80.0 );
+
+  //an empty key set is an error of the server rather than a feature type without features
+  if ( serverKeys.isEmpty() && !offlineIds.isEmpty() )
+  {
+    mErrorMessage = tr( "The server has not returned any feature keys of %1" ).arg( mLayerName );
+    return false;
+  }
+
+  //the features of a response cut by a feature limit of the server are not deleted. Without a feature count, the
+  //key-only request tells if the key set is complete
+  bool keysComplete = incremental;
+  if ( !incremental )
+  {
+    qint64 nFeatures = wfsLayer.featureCount();
+    keysComplete = ( nFeatures >= 0 ) ? ( nServerFeatures >= nFeatures ) : fetchServerKeys( state.keyField, serverKeys );
+  }
+  if ( !keysComplete )
+  {
+    QgsDebugMsg( "Incomplete key set, no features of " + mLayerName + " are deleted" );
+  }
+
+  QgsFeatureIds deletedIds;
+  QHash<QString, QgsFeatureId>::const_iterator offlineIdIt = offlineIds.constBegin();
+  for ( ; keysComplete && offlineIdIt != offlineIds.constEnd(); ++offlineIdIt )
+  {
+    if ( !serverKeys.contains( offlineIdIt.key() ) )
+    {
+      deletedIds.insert( offlineIdIt.value() );
+      state.hashes.remove( offlineIdIt.key() );
+    }
+  }
+
+  //deleting renumbers the features of a shapefile, so it comes last
+  QgsVectorDataProvider* provider = offlineLayer.dataProvider();
+  bool ok = ( changedAttributes.isEmpty() || provider->changeAttributeValues( changedAttributes ) )
+            && ( changedGeometries.isEmpty() || provider->changeGeometryValues( changedGeometries ) )
+            && ( addedFeatures.isEmpty() || provider->addFeatures( addedFeatures ) )
+            && ( deletedIds.isEmpty() || provider->deleteFeatures( deletedIds ) );
+  if ( !ok )
+  {
+    mErrorMessage = tr( "The changes could not be written to %1" ).arg( filePath() );
+    return false;
+  }
+  QgsDebugMsg( QString( "Synchronised %1: %2 changed, %3 added, %4 deleted" ).arg( mLayerName )
+               .arg( changedAttributes.size() ).arg( addedFeatures.size() ).arg( deletedIds.size() ) );
+
+  //written after the changes, an interrupted sync is applied again
+  state.lastModified = newestModified;
+  if ( !state.save( statePath ) )
+  {
+    QgsDebugMsg( "Cannot write " + statePath );
+  }
+  feedback()->setProgress( 100.0 );
+  return true;
+}
+
+bool WebDataVectorSyncTask::validate()
+{
+  QgsVectorLayer offlineLayer( filePath(), mLayerName, "ogr", QgsVectorLayer::LayerOptions( false ) );
+  if ( !offlineLayer.isValid() )
+  {
+    mErrorMessage = tr( "The shapefile of %1 cannot be read" ).arg( mLayerName );
+    return false;
+  }
+  return true;
+}
+
+bool WebDataVectorSyncTask::copySource()
+{
+  //.shp, .shx, .dbf, .prj, .cpg and the sync state, renamed to the base name of the copy
+  QFileInfo targetInfo( filePath() );
+  QFileInfoList sourceFiles = outputFiles( mSourceFilePath );
+  if ( sourceFiles.isEmpty() || !QDir().mkpath( targetInfo.absolutePath() ) )
+  {
+    return false;
+  }
+  QFileInfoList::const_iterator fileIt = sourceFiles.constBegin();
+  for ( ; fileIt != sourceFiles.constEnd(); ++fileIt )
+  {
+    QString targetPath = targetInfo.absolutePath() + "/" + targetInfo.completeBaseName() + "." + fileIt->suffix();
+    if ( !QFile::copy( fileIt->absoluteFilePath(), targetPath ) )
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool WebDataVectorSyncTask::fetchServerKeys( const QString& keyField, QSet<QString>& keys )
+{
+  //per thread instance, the reply is handled in the worker thread
+  QNetworkRequest request( QUrl( mWfsUrl + "&PROPERTYNAME=" + keyField ) );
+  QNetworkReply* reply = QgsNetworkAccessManager::instance()->get( request );
+  QEventLoop loop;
+  connect( reply, SIGNAL( finished() ), &loop, SLOT( quit() ) );
+  connect( feedback(), SIGNAL( canceled() ), &loop, SLOT( quit() ) );
+  loop.exec();
+
+  bool ok = reply->isFinished() && reply->error() == QNetworkReply::NoError;
+  if ( ok )
+  {
+    //GML feature members: <ns:typename><ns:keyField>value</ns:keyField></ns:typename>. Exception reports and
+    //collections cut by a feature limit of the server must not count as the key set
+    QXmlStreamReader reader( reply );
+    qint64 expectedFeatures = -1;
+    qint64 receivedFeatures = 0;
+    if ( reader.readNextStartElement() && reader.name() == "FeatureCollection" )
+    {
+      //WFS 2.0: numberMatched (may be 'unknown') / numberReturned, WFS 1.1: numberOfFeatures, WFS 1.0: none
+      QXmlStreamAttributes attributes = reader.attributes();
+      QStringList countAttributes;
+      countAttributes << "numberMatched" << "numberOfFeatures" << "numberReturned";
+      QStringList::const_iterator attributeIt = countAttributes.constBegin();
+      for ( ; attributeIt != countAttributes.constEnd() && expectedFeatures < 0; ++attributeIt )
+      {
+        bool countOk = false;
+        qint64 count = attributes.value( *attributeIt ).toString().toLongLong( &countOk );
+        if ( countOk )
+        {
+          expectedFeatures = count;
+        }
+      }
+
+      while ( !reader.atEnd() )
+      {
+        if ( reader.readNext() == QXmlStreamReader::StartElement && reader.name() == keyField )
+        {
+          keys.insert( reader.readElementText().trimmed() );
+          ++receivedFeatures;
+        }
+      }
+      ok = !reader.hasError() && ( expectedFeatures < 0 || expectedFeatures == receivedFeatures );
+    }
+    else
+    {
+      ok = false;
+    }
+    if ( !ok )
+    {
+      QgsDebugMsg( QString( "Incomplete key set for %1: %2 of %3 features" ).arg( mLayerName ).arg( receivedFeatures )
+                   .arg( expectedFeatures ) );
+    }
+  }
+  else
+  {
+    reply->disconnect( &loop );
+    reply->abort();
+  }
+  //no event loop after run() for deleteLater()
+  delete reply;
+  return ok;
+}
+
+WebDataRasterOfflineTask::WebDataRasterOfflineTask( const QString& description, const GetMapParameters& parameters,
+    const QgsRectangle& extent, int columns, int rows, int maxTileWidth, int maxTileHeight, int maxRequests,
+    const QString& filePath, const QString& outputPath ): WebDataOfflineTask( description, filePath, outputPath, new QgsFeedback() ),
+  mParameters( parameters ), mCrsWkt( parameters.crs.toWkt() ), mExtent( extent ), mColumns( columns ), mRows( rows ),
+  mMaxTileWidth( qMax( 1, maxTileWidth ) ), mMaxTileHeight( qMax( 1, maxTileHeight ) ), mMaxRequests( qMax( 1, maxRequests ) ),
+  mOutputPath( outputPath ), mTileLevel( 0 ), mMaxTileLevel( 0 ), mFastTiles( 0 )
+{
+  while ( ( mMaxTileWidth >> ( mMaxTileLevel + 1 ) ) >= MIN_TILE_SIZE && ( mMaxTileHeight >> ( mMaxTileLevel + 1 ) ) >= MIN_TILE_SIZE )
+  {
+    ++mMaxTileLevel;
+  }
+  mLevelThroughput.fill( 0.0, mMaxTileLevel + 1 );
+}
+
+WebDataRasterOfflineTask::~WebDataRasterOfflineTask()
+{
+}
+
+bool WebDataRasterOfflineTask::write()
+{
+  QList<Tile> coarseTiles = tiles();
+  if ( coarseTiles.isEmpty() )
+  {
+    mErrorMessage = tr( "The output extent is empty" );
+    return false;
+  }
+
+  //tiles of an interrupted export are not requested again
+  QList<QRect> completedTiles;
+  if ( checkpoint() )
+  {
+    QSet<QString> units = checkpoint()->completedUnits();
+    QSet<QString>::const_iterator unitIt = units.constBegin();
+    for ( ; unitIt != units.constEnd(); ++unitIt )
+    {
+      QStringList values = unitIt->split( "_" );
+      if ( values.size() == 4 )
+      {
+        completedTiles.append( QRect( values.at( 0 ).toInt(), values.at( 1 ).toInt(), values.at( 2 ).toInt(),
+                                      values.at( 3 ).toInt() ) );
+      }
+    }
+  }
+  QList<Tile> pendingTiles;
+  QStringList tilePaths;
+  double totalPixels = double( mColumns ) * mRows;
+  double writtenPixels = 0;
+  QList<Tile>::const_iterator coarseIt = coarseTiles.constBegin();
+  for ( ; coarseIt != coarseTiles.constEnd(); ++coarseIt )
+  {
+    collectTiles( *coarseIt, completedTiles, pendingTiles, tilePaths, writtenPixels );
+  }
+  feedback()->setProgress( 100.0 * writtenPixels / totalPixels );
+
+  //per thread instance, the replies are handled in the worker thread
+  QgsNetworkAccessManager* nam = QgsNetworkAccessManager::instance();
+  QHash<QNetworkReply*, Tile> runningTiles;
+  QElapsedTimer clock;
+  clock.start();
+  QEventLoop loop;
+  connect( feedback(), SIGNAL( canceled() ), &loop, SLOT( quit() ) );
+
+  bool ok = true;
+  while ( ok && !feedback()->isCanceled() && ( !pendingTiles.isEmpty() || !runningTiles.isEmpty() ) )
+  {
+    while ( runningTiles.size() < mMaxRequests && !pendingTiles.isEmpty() )
+    {
+      Tile tile = pendingTiles.takeFirst();
+      if ( tile.width > tileWidth() || tile.height > tileHeight() )
+      {
+        //split as far as the current tile size requires
+        QList<Tile> quarters = splitTile( tile );
+        for ( int i = quarters.size() - 1; i >= 0; --i )
+        {
+          pendingTiles.prepend( quarters.at( i ) );
+        }
+        continue;
+      }
+
+      tile.level = mTileLevel;
+      tile.started = clock.elapsed();
+      QNetworkRequest request( getMapUrl( tile ) );
+      //the tiles are written to disk anyway
+      request.setAttribute( QNetworkRequest::CacheSaveControlAttribute, false );
+      QNetworkReply* reply = nam->get( request );
+      connect( reply, SIGNAL( finished() ), &loop, SLOT( quit() ) );
+      runningTiles.insert( reply, tile );
+    }
+
+    loop.exec();
+
+    //several replies may have finished since the loop was left
+    QHash<QNetworkReply*, Tile>::iterator tileIt = runningTiles.begin();
+    while ( tileIt != runningTiles.end() )
+    {
+      QNetworkReply* reply = tileIt.key();
+      if ( !reply->isFinished() )
+      {
+        ++tileIt;
+        continue;
+      }
+
+      Tile tile = tileIt.value();
+      tileIt = runningTiles.erase( tileIt );
+      QString tileError;
+      if ( reply->error() != QNetworkReply::NoError )
+      {
+        tileError = reply->errorString();
+      }
+      else if ( !writeTile( tile, reply->readAll() ) )
+      {
+        //e.g. a service exception
+        tileError = tr( "the response is not an image" );
+      }
+      //no event loop after run() for deleteLater()
+      delete reply;
+      adaptTileSize( tile, tileError.isEmpty(), clock.elapsed() - tile.started );
+
+      if ( tileError.isEmpty() )
+      {
+        if ( checkpoint() && !checkpoint()->addUnit( tileId( tile ), QStringList( QFileInfo( tilePath( tile ) ).fileName() ) ) )
+        {
+          QgsDebugMsg( "Cannot add tile to checkpoint: " + tileId( tile ) );
+        }
+        tilePaths.append( tilePath( tile ) );
+        writtenPixels += double( tile.width ) * tile.height;
+        feedback()->setProgress( 100.0 * writtenPixels / totalPixels );
+      }
+      else if ( ++tile.attempts >= MAX_TILE_ATTEMPTS )
+      {
+        mErrorMessage = tr( "The tile at pixel %1/%2 could not be downloaded: %3" ).arg( tile.x ).arg( tile.y ).arg( tileError );
+        ok = false;
+      }
+      else if ( tile.width >= 2 * MIN_TILE_SIZE || tile.height >= 2 * MIN_TILE_SIZE )
+      {
+        //smaller requests are more likely to succeed
+        QList<Tile> quarters = splitTile( tile );
+        for ( int i = quarters.size() - 1; i >= 0; --i )
+        {
+          pendingTiles.prepend( quarters.at( i ) );
+        }
+      }
+      else
+      {
+        pendingTiles.append( tile );
+      }
+    }
+  }
+
+  //cancelled or failed
+  QHash<QNetworkReply*, Tile>::const_iterator runningIt = runningTiles.constBegin();
+  for ( ; runningIt != runningTiles.constEnd(); ++runningIt )
+  {
+    runningIt.key()->disconnect( &loop );
+    runningIt.key()->abort();
+    delete runningIt.key();
+  }
+
+  if ( !ok || feedback()->isCanceled() )
+  {
+    return false;
+  }
+  if ( !writeVrt( tilePaths ) )
+  {
+    mErrorMessage = tr( "The VRT could not be written" );
+    return false;
+  }
+  return true;
+}
+
+bool WebDataRasterOfflineTask::validate()
+{
+  GDALDatasetH dataset = GDALOpen( filePath().toUtf8().constData(), GA_ReadOnly );
+  bool valid = ( dataset && GDALGetRasterXSize( dataset ) == mColumns && GDALGetRasterYSize( dataset ) == mRows );
+  if ( dataset )
+  {
+    GDALClose( dataset );
+  }
+  if ( !valid )
+  {
+    mErrorMessage = tr( "The VRT does not cover the output" );
+  }
+  return valid;
+}
+
+QList<WebDataRasterOfflineTask::Tile> WebDataRasterOfflineTask::tiles() const
+{
+  QList<Tile> tileList;
+  if ( mColumns < 1 || mRows < 1 || mExtent.isEmpty() )
+  {
+    return tileList;
+  }
+
+  for ( int y = 0; y < mRows; y += mMaxTileHeight )
+  {
+    for ( int x = 0; x < mColumns; x += mMaxTileWidth )
+    {
+      Tile tile;
+      tile.x = x;
+      tile.y = y;
+      tile.width = qMin( mMaxTileWidth, mColumns - x );
+      tile.height = qMin( mMaxTileHeight, mRows - y );
+      tileList.append( tile );
+    }
+  }
+  return tileList;
+}
+
+void WebDataRasterOfflineTask::collectTiles( const Tile& tile, const QList<QRect>& completedTiles, QList<Tile>& pendingTiles,
+    QStringList& tilePaths, double& writtenPixels ) const
+{
+  QRect tileRect( tile.x, tile.y, tile.width, tile.height );
+  bool intersects = false;
+  QList<QRect>::const_iterator completedIt = completedTiles.constBegin();
+  for ( ; completedIt != completedTiles.constEnd(); ++completedIt )
+  {
+    if ( *completedIt == tileRect )
+    {
+      tilePaths.append( tilePath( tile ) );
+      writtenPixels += double( tile.width ) * tile.height;
+      return;
+    }
+    intersects = intersects || completedIt->intersects( tileRect );
+  }
+
+  //completed tiles are quarters of quarters of the coarse tiles
+  if ( !intersects || ( tile.width < 2 && tile.height < 2 ) )
+  {
+    pendingTiles.append( tile );
+    return;
+  }
+  QList<Tile> quarters = splitTile( tile );
+  QList<Tile>::const_iterator quarterIt = quarters.constBegin();
+  for ( ; quarterIt != quarters.constEnd(); ++quarterIt )
+  {
+    collectTiles( *quarterIt, completedTiles, pendingTiles, tilePaths, writtenPixels );
+  }
+}
+
+QList<WebDataRasterOfflineTask::Tile> WebDataRasterOfflineTask::splitTile( const Tile& tile )
+{
+  int leftWidth = ( tile.width + 1 ) / 2;
+  int topHeight = ( tile.height + 1 ) / 2;
+  QList<Tile> quarters;
+  for ( int row = 0; row < 2; ++row )
+  {
+    for ( int column = 0; column < 2; ++column )
+    {
+      Tile quarter = tile;
+      quarter.x = tile.x + column * leftWidth;
+      quarter.y = tile.y + row * topHeight;
+      quarter.width = column == 0 ? leftWidth : tile.width - leftWidth;
+      quarter.height = row == 0 ? topHeight : tile.height - topHeight;
+      if ( quarter.width > 0 && quarter.height > 0 )
+      {
+        quarters.append( quarter );
+      }
+    }
+  }
+  return quarters;
+}
+
+void WebDataRasterOfflineTask::adaptTileSize( const Tile& tile, bool ok, qint64 elapsed )
+{
+  if ( ok )
+  {
+    double throughput = double( tile.width ) * tile.height / qMax( elapsed, qint64( 1 ) );
+    double& measured = mLevelThroughput[tile.level];
+    measured = ( measured > 0 ) ? 0.7 * measured + 0.3 * throughput : throughput;
+  }
+
+  //requests of an earlier tile size say nothing about the current one
+  if ( tile.level != mTileLevel )
+  {
+    return;
+  }
+
+  int level = mTileLevel;
+  if ( !ok || elapsed > SLOW_TILE_MS )
+  {
+    ++level;
+  }
+  else if ( elapsed < SLOW_TILE_MS / 4 && ++mFastTiles >= FAST_TILES_TO_GROW && mTileLevel > 0 )
+  {
+    double largerThroughput = mLevelThroughput.at( mTileLevel - 1 );
+    if ( largerThroughput <= 0 || largerThroughput >= mLevelThroughput.at( mTileLevel ) )
+    {
+      --level;
+    }
+    mFastTiles = 0;
+  }
+
+  level = qBound( 0, level, mMaxTileLevel );
+  if ( level != mTileLevel )
+  {
+    mTileLevel = level;
+    mFastTiles = 0;
+  }
+}
+
+QgsRectangle WebDataRasterOfflineTask::tileExtent( const Tile& tile ) const
+{
+  double pixelWidth = mExtent.width() / mColumns;
+  double pixelHeight = mExtent.height() / mRows;
+  double xMin = mExtent.xMinimum() + tile.x * pixelWidth;
+  double yMax = mExtent.yMaximum() - tile.y * pixelHeight;
+  return QgsRectangle( xMin, yMax - tile.height * pixelHeight, xMin + tile.width * pixelWidth, yMax );
+}
+
+QUrl WebDataRasterOfflineTask::getMapUrl( const Tile& tile ) const
+{
+  //WMS 1.3.0 takes the axis order of the CRS (e.g. lat/lon for EPSG:4326), 1.1.x always x/y with SRS instead of CRS
+  QString version = mParameters.version.isEmpty() ? QString( "1.3.0" ) : mParameters.version;
+  bool wms13 = !( version.startsWith( "1.0" ) || version.startsWith( "1.1" ) );
+  QgsRectangle extent = tileExtent( tile );
+  QString bbox;
+  if ( wms13 && mParameters.crs.hasAxisInverted() )
+  {
+    bbox = QString( "%1,%2,%3,%4" ).arg( qgsDoubleToString( extent.yMinimum() ) ).arg( qgsDoubleToString( extent.xMinimum() ) )
+           .arg( qgsDoubleToString( extent.yMaximum() ) ).arg( qgsDoubleToString( extent.xMaximum() ) );
+  }
+  else
+  {
+    bbox = QString( "%1,%2,%3,%4" ).arg( qgsDoubleToString( extent.xMinimum() ) ).arg( qgsDoubleToString( extent.yMinimum() ) )
+           .arg( qgsDoubleToString( extent.xMaximum() ) ).arg( qgsDoubleToString( extent.yMaximum() ) );
+  }
+
+  QUrl url( mParameters.url );
+  QUrlQuery query( url );
+  query.addQueryItem( "SERVICE", "WMS" );
+  query.addQueryItem( "VERSION", version );
+  query.addQueryItem( "REQUEST", "GetMap" );
+  query.addQueryItem( "LAYERS", mParameters.layers );
+  query.addQueryItem( "STYLES", mParameters.styles );
+  query.addQueryItem( "FORMAT", mParameters.format );
+  query.addQueryItem( wms13 ? "CRS" : "SRS", mParameters.crs.authid() );
+  query.addQueryItem( "BBOX", bbox );
+  query.addQueryItem( "WIDTH", QString::number( tile.width ) );
+  query.addQueryItem( "HEIGHT", QString::number( tile.height ) );
+  query.addQueryItem( "TRANSPARENT", "TRUE" );
+  url.setQuery( query );
+  return url;
+}
+
+QString WebDataRasterOfflineTask::tileId( const Tile& tile )
+{
+  return QString( "%1_%2_%3_%4" ).arg( tile.x ).arg( tile.y ).arg( tile.width ).arg( tile.height );
+}
+
+QString WebDataRasterOfflineTask::tilePath( const Tile& tile ) const
+{
+  return QString( "%1/%2_%3.tif" ).arg( mOutputPath ).arg( tile.y ).arg( tile.x );
+}
+
+bool WebDataRasterOfflineTask::writeTile( const Tile& tile, const QByteArray& data ) const
+{
+  QImage image;
+  if ( !image.loadFromData( data ) )
+  {
+    return false;
+  }
+  if ( image.width() != tile.width || image.height() != tile.height )
+  {
+    image = image.scaled( tile.width, tile.height, Qt::IgnoreAspectRatio, Qt::SmoothTransformation );
+  }
+  //byte order R, G, B, A independent of the platform. Converted after scaling, because smooth scaling returns
+  //premultiplied ARGB32 (B, G, R, A in memory on little endian machines)
+  image = image.convertToFormat( QImage::Format_RGBA8888 );
+
+  GDALDriverH driver = GDALGetDriverByName( "GTiff" );
+  if ( !driver )
+  {
+    return false;
+  }
+  char** options = 0;
+  options = CSLSetNameValue( options, "COMPRESS", "DEFLATE" );
+  GDALDatasetH dataset = GDALCreate( driver, tilePath( tile ).toUtf8().constData(), tile.width, tile.height, 4, GDT_Byte,
+                                     options );
+  CSLDestroy( options );
+  if ( !dataset )
+  {
+    return false;
+  }
+
+  QgsRectangle extent = tileExtent( tile );
+  double geoTransform[6] = { extent.xMinimum(), extent.width() / tile.width, 0.0,
+                             extent.yMaximum(), 0.0, -extent.height() / tile.height
+                           };
+  GDALSetGeoTransform( dataset, geoTransform );
+  GDALSetProjection( dataset, mCrsWkt.toUtf8().constData() );
+  GDALSetRasterColorInterpretation( GDALGetRasterBand( dataset, 4 ), GCI_AlphaBand );
+
+  int bandMap[4] = { 1, 2, 3, 4 };
+  CPLErr error = GDALDatasetRasterIO( dataset, GF_Write, 0, 0, tile.width, tile.height, image.bits(), tile.width,
+                                      tile.height, GDT_Byte, 4, bandMap, 4, image.bytesPerLine(), 1 );
+  GDALClose( dataset );
+  return ( error == CE_None );
+}
+
+bool WebDataRasterOfflineTask::writeVrt( const QStringList& tilePaths ) const
+{
+  QList<QByteArray> pathData;
+  QVector<const char*> paths;
+  QStringList::const_iterator pathIt = tilePaths.constBegin();
+  for ( ; pathIt != tilePaths.constEnd(); ++pathIt )
+  {
+    pathData.append( pathIt->toUtf8() );
+    paths.append( pathData.last().constData() );
+  }
+
+  GDALBuildVRTOptions* options = GDALBuildVRTOptionsNew( 0, 0 );
+  int usageError = 0;
+  GDALDatasetH vrt = GDALBuildVRT( filePath().toUtf8().constData(), paths.size(), 0, paths.constData(), options,
+                                   &usageError );
+  GDALBuildVRTOptionsFree( options );
+  if ( !vrt )
+  {
+    return false;
+  }
+  GDALClose( vrt );
+  return true;
+}
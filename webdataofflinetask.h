@@ -0,0 +1,253 @@
+#ifndef WEBDATAOFFLINETASK_H
+#define WEBDATAOFFLINETASK_H
+
+#include "webdatasyncstate.h"
+#include "qgscoordinatereferencesystem.h"
+#include "qgsrectangle.h"
+#include "qgstaskmanager.h"
+#include <QAtomicInteger>
+#include <QFileInfo>
+#include <QRect>
+#include <QSet>
+#include <QUrl>
+#include <QVector>
+
+class QgsFeedback;
+class QgsVectorLayer;
+class WebDataOfflineCheckpoint;
+
+/**Takes a layer offline in a worker thread of the QGIS task manager, which shows the progress and a cancel button in
+  the status bar. Everything the job needs is prepared in the GUI thread, run() only uses objects owned by the job.
+  A cancelled job removes what it has written. A failed job does the same unless it has a checkpoint, then the
+  output is kept so the next attempt can resume*/
+class WebDataOfflineTask: public QgsTask
+{
+    Q_OBJECT
+  public:
+    /**@param filePath offline data source
+      @param outputPath file or directory with everything the job writes
+      @param feedback progress and cancellation of the writer (the task takes ownership)*/
+    WebDataOfflineTask( const QString& description, const QString& filePath, const QString& outputPath,
+                        QgsFeedback* feedback );
+    ~WebDataOfflineTask();
+
+    QString filePath() const { return mFilePath; }
+    /**Size of the files written so far*/
+    qint64 bytesWritten() const { return mBytesWritten.load(); }
+    /**Reason of a failure (empty if cancelled). Valid once the task has finished*/
+    QString errorMessage() const { return mErrorMessage; }
+    /**Makes the job resumable. The task takes ownership, the checkpoint is opened in the worker thread*/
+    void setCheckpoint( WebDataOfflineCheckpoint* checkpoint );
+
+    void cancel();
+
+  signals:
+    /**Emitted from the worker thread*/
+    void bytesWrittenChanged( qint64 bytes );
+
+  protected:
+    QString mErrorMessage;
+
+    bool run();
+    /**Writes the offline data source, reporting to feedback()*/
+    virtual bool write() = 0;
+    /**Checks that the written data source can be read, before the job counts as completed*/
+    virtual bool validate() = 0;
+    QgsFeedback* feedback() const { return mFeedback; }
+    /**Manifest of the completed units (0 if the job is not resumable)*/
+    WebDataOfflineCheckpoint* checkpoint() const { return mCheckpoint; }
+    /**Files of a file output (the file and its sidecar files)*/
+    static QFileInfoList outputFiles( const QString& path );
+
+  private slots:
+    /**Called from the worker thread by the feedback*/
+    void updateProgress( double progress );
+
+  private:
+    QString mFilePath;
+    QString mOutputPath;
+    QgsFeedback* mFeedback;
+    WebDataOfflineCheckpoint* mCheckpoint;
+    QAtomicInteger<qint64> mBytesWritten;
+    /**Last whole percentage the written size was computed for*/
+    int mLastPercent;
+
+    /**Size of a directory or of a file with its sidecar files (same base name, e.g. .shp / .dbf / .shx)*/
+    static qint64 outputSize( const QString& path );
+    static void removeOutput( const QString& path );
+};
+
+/**Copies a WFS layer into a shapefile. The layer is created in the worker thread. The extent of the layer is divided
+  into a grid of pages, each page is downloaded with a BBOX filter and written to a shapefile of its own. A page
+  holds the features whose bounding box centre lies in it (the outer pages reach beyond the advertised extent), so
+  no feature is written twice. The pages are merged into the shapefile at the end. If the feature type has a key
+  field, the hashes of the features are written as sync state for the next reload (see WebDataVectorSyncTask)*/
+class WebDataVectorOfflineTask: public WebDataOfflineTask
+{
+    Q_OBJECT
+  public:
+    /**@param filePath shapefile
+      @param outputPath directory of the shapefile and the pages
+      @param pageGrid pages per row / column of the grid*/
+    WebDataVectorOfflineTask( const QString& description, const QString& wfsUrl, const QString& layerName,
+                              const QString& filePath, const QString& outputPath, int pageGrid );
+    ~WebDataVectorOfflineTask();
+
+  protected:
+    bool write();
+    bool validate();
+
+  private:
+    QString mWfsUrl;
+    QString mLayerName;
+    QString mOutputPath;
+    int mPageGrid;
+    /**Key and last modified field of the sync state (-1 if the feature type has none)*/
+    int mKeyIndex;
+    int mModifiedIndex;
+    /**Hashes of the downloaded features, written next to the shapefile*/
+    WebDataSyncState mSyncState;
+
+    /**Downloads the features of a page into a shapefile
+      @param gridExtent extent divided into the pages
+      @param grid pages per row / column (1: the whole layer without BBOX filter)
+      @param row row of the page, -1 for the page of the features without geometry
+      @param featureCount number of features written to the page*/
+    bool writePage( QgsVectorLayer& wfsLayer, const QgsRectangle& gridExtent, int grid, int row, int column,
+                    const QString& pagePath, qint64& featureCount );
+    /**Copies the features of the pages into the shapefile*/
+    bool mergePages( QgsVectorLayer& wfsLayer, const QStringList& pagePaths );
+};
+
+/**Updates a copy of an offline WFS shapefile. The shapefile the map layer reads is not touched, the copy replaces it
+  when the job has completed. Features are matched by a key field (/NIWA/syncKeyFields). If the feature type has a
+  last modified field (/NIWA/syncModifiedFields), only the features changed since the last sync are requested with a
+  filter, plus the keys of all features to find the deleted ones. Otherwise all features are requested and compared
+  with the hashes of the sync state. Only changed, new and deleted features are written. Features are only deleted
+  if the server has returned a complete key set*/
+class WebDataVectorSyncTask: public WebDataOfflineTask
+{
+    Q_OBJECT
+  public:
+    /**@param sourceFilePath current shapefile of the offline layer
+      @param filePath copy of the shapefile the changes are written to
+      @param outputPath directory of the copy*/
+    WebDataVectorSyncTask( const QString& description, const QString& wfsUrl, const QString& layerName,
+                           const QString& sourceFilePath, const QString& filePath, const QString& outputPath );
+    ~WebDataVectorSyncTask();
+
+    /**True if the job has failed because the layer cannot be synchronised (no key field)*/
+    bool fullReloadRequired() const { return mFullReloadRequired; }
+
+  protected:
+    bool write();
+    bool validate();
+
+  private:
+    QString mWfsUrl;
+    QString mLayerName;
+    QString mSourceFilePath;
+    bool mFullReloadRequired;
+
+    /**Copies the shapefile of the offline layer with its sidecar files and sync state to filePath()*/
+    bool copySource();
+    /**Requests the key field of all features (PROPERTYNAME) to find the deleted features. Fails unless the reply is a
+      feature collection with as many features as the server reports*/
+    bool fetchServerKeys( const QString& keyField, QSet<QString>& keys );
+};
+
+/**Writes a WMS layer as GeoTIFF tiles with a VRT. The tiles are requested with concurrent GetMap requests and written
+  as they arrive, so the export is limited by the bandwidth rather than by the round trips to the server.
+  Requests start with the largest tile size allowed. Failed or slow requests halve the tile size of the remaining
+  tiles, a run of fast requests doubles it again unless the larger tiles have been measured to be slower*/
+class WebDataRasterOfflineTask: public WebDataOfflineTask
+{
+    Q_OBJECT
+  public:
+    /**Layer and output of the GetMap requests*/
+    struct GetMapParameters
+    {
+      QString url;
+      QString layers;
+      QString styles;
+      QString format;
+      /**WMS version of the service (1.3.0 if empty)*/
+      QString version;
+      QgsCoordinateReferenceSystem crs;
+    };
+
+    /**@param extent output extent in the CRS of the parameters
+      @param columns / rows size of the output in pixels
+      @param maxTileWidth / maxTileHeight largest tile (and GetMap image) size, e.g. MaxWidth / MaxHeight of the server
+      @param maxRequests number of GetMap requests running at the same time
+      @param filePath VRT
+      @param outputPath directory for the tiles and the VRT*/
+    WebDataRasterOfflineTask( const QString& description, const GetMapParameters& parameters, const QgsRectangle& extent,
+                              int columns, int rows, int maxTileWidth, int maxTileHeight, int maxRequests,
+                              const QString& filePath, const QString& outputPath );
+    ~WebDataRasterOfflineTask();
+
+  protected:
+    bool write();
+    bool validate();
+
+  private:
+    /**Pixel rectangle of the output*/
+    struct Tile
+    {
+      Tile(): x( 0 ), y( 0 ), width( 0 ), height( 0 ), level( 0 ), attempts( 0 ), started( 0 ) {}
+
+      int x;
+      int y;
+      int width;
+      int height;
+      /**Tile level when the tile was requested*/
+      int level;
+      /**Failed requests for the tile (or the tile it was split from)*/
+      int attempts;
+      /**Time of the request (ms since the start of the export)*/
+      qint64 started;
+    };
+
+    GetMapParameters mParameters;
+    /**WKT of the CRS, taken in the GUI thread*/
+    QString mCrsWkt;
+    QgsRectangle mExtent;
+    int mColumns;
+    int mRows;
+    int mMaxTileWidth;
+    int mMaxTileHeight;
+    int mMaxRequests;
+    QString mOutputPath;
+
+    /**Current tiles are the largest ones divided by 2^mTileLevel*/
+    int mTileLevel;
+    int mMaxTileLevel;
+    /**Successive fast requests since the last change of the tile size*/
+    int mFastTiles;
+    /**Measured pixels per ms and tile level (0 if not measured)*/
+    QVector<double> mLevelThroughput;
+
+    /**Output divided into tiles of the largest size*/
+    QList<Tile> tiles() const;
+    /**Adds the tile to the pending tiles, or to the tile paths if it has been written before an interruption. Tiles
+      partly written are split*/
+    void collectTiles( const Tile& tile, const QList<QRect>& completedTiles, QList<Tile>& pendingTiles,
+                       QStringList& tilePaths, double& writtenPixels ) const;
+    /**Splits a tile into (up to) four quarters*/
+    static QList<Tile> splitTile( const Tile& tile );
+    int tileWidth() const { return qMax( mMaxTileWidth >> mTileLevel, 1 ); }
+    int tileHeight() const { return qMax( mMaxTileHeight >> mTileLevel, 1 ); }
+    /**Adapts the tile size to the duration / result of a finished request*/
+    void adaptTileSize( const Tile& tile, bool ok, qint64 elapsed );
+    QgsRectangle tileExtent( const Tile& tile ) const;
+    QUrl getMapUrl( const Tile& tile ) const;
+    /**Checkpoint unit id of a tile (x_y_width_height)*/
+    static QString tileId( const Tile& tile );
+    QString tilePath( const Tile& tile ) const;
+    /**Decodes the image of a GetMap response and writes it as GeoTIFF (RGBA)*/
+    bool writeTile( const Tile& tile, const QByteArray& data ) const;
+    bool writeVrt( const QStringList& tilePaths ) const;
+};
+
+#endif // WEBDATAOFFLINETASK_H
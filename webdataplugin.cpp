@@ -4,6 +4,7 @@
 #include "qgisinterface.h"
 #include <QAction>
 #include <QObject>
+#include <QSettings>
 
 static const QString name_ = QObject::tr( "Web data plugin" );
 static const QString description_ = QObject::tr( "A plugin to access and manage layers from OWS services in a unified way" );
@@ -11,13 +12,18 @@ static const QString version_ = QObject::tr( "Version 1.0" );
 static const QString icon_ = ":/niwa/icons/nqmap.png";
 static const QString category_ = QObject::tr( "Web" );
 
-WebDataPlugin::WebDataPlugin( QgisInterface* iface ): mIface( iface ), mAction( 0 ), mDialog( 0 )
+WebDataPlugin::WebDataPlugin( QgisInterface* iface ): mIface( iface ), mAction( 0 ), mDialog( 0 ), mCatalogueLoader( 0 ),
+    mCatalogueLoaded( false )
 {
 
 }
 
 WebDataPlugin::~WebDataPlugin()
 {
+  //a running load finishes first
+  mLoaderThread.quit();
+  mLoaderThread.wait();
+  delete mCatalogueLoader;
   delete mAction;
   delete mDialog;
 }
@@ -31,6 +37,23 @@ void WebDataPlugin::initGui()
     mIface->addWebToolBarIcon( mAction );
     mIface->addPluginToMenu( name_, mAction );
   }
+
+  //read the catalogue while QGIS starts up, so the dialog opens without waiting for it
+  if ( !mCatalogueLoader )
+  {
+    qRegisterMetaType<WebDataCatalogData>( "WebDataCatalogData" );
+    mCatalogueLoader = new WebDataCatalogLoader();
+    mCatalogueLoader->moveToThread( &mLoaderThread );
+    connect( mCatalogueLoader, SIGNAL( loadingFinished( const WebDataCatalogData& ) ), this,
+             SLOT( setCatalogue( const WebDataCatalogData& ) ) );
+    mLoaderThread.start();
+
+    QSettings s;
+    QMetaObject::invokeMethod( mCatalogueLoader, "load", Qt::QueuedConnection,
+                               Q_ARG( QString, WebDataModel::databaseFilePath() ),
+                               Q_ARG( QString, WebDataModel::xmlFilePath() ),
+                               Q_ARG( QStringList, s.value( "/NIWA/expandedServices" ).toStringList() ) );
+  }
 }
 
 void WebDataPlugin::unload()
@@ -46,10 +69,29 @@ void WebDataPlugin::showWebDataDialog()
   if ( !mDialog && mIface )
   {
     mDialog = new WebDataDialog( mIface, mIface->mainWindow() );
+    if ( mCatalogueLoaded )
+    {
+      mDialog->setCatalogue( mCatalogue );
+      mCatalogue = WebDataCatalogData();
+    }
   }
   mDialog->show();
 }
 
+void WebDataPlugin::setCatalogue( const WebDataCatalogData& data )
+{
+  mCatalogueLoaded = true;
+  mLoaderThread.quit();
+  if ( mDialog )
+  {
+    mDialog->setCatalogue( data );
+  }
+  else
+  {
+    mCatalogue = data;
+  }
+}
+
 
 //global methods for the plugin manager
 QGISEXTERN QgisPlugin* classFactory( QgisInterface * ifacePointer )
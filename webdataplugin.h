@@ -2,7 +2,9 @@
 #define WEBDATAPLUGIN_H
 
 #include "qgisplugin.h"
+#include "webdatacatalogloader.h"
 #include <QObject>
+#include <QThread>
 
 class QgisInterface;
 class QAction;
@@ -20,11 +22,18 @@ class WebDataPlugin: public QObject, public QgisPlugin
 
   private slots:
     void showWebDataDialog();
+    /**Passes the catalogue read in the background to the dialog (or keeps it until the dialog is shown)*/
+    void setCatalogue( const WebDataCatalogData& data );
 
   private:
     QgisInterface* mIface;
     QAction* mAction;
     WebDataDialog* mDialog;
+    /**Reads the catalogue in mLoaderThread, started from initGui()*/
+    WebDataCatalogLoader* mCatalogueLoader;
+    QThread mLoaderThread;
+    WebDataCatalogData mCatalogue;
+    bool mCatalogueLoaded;
 };
 
 #endif // WEBDATAPLUGIN_H
@@ -0,0 +1,228 @@
+#include "webdatasearchindex.h"
+#include <QRegExp>
+
+WebDataSearchIndex::WebDataSearchIndex()
+{
+}
+
+WebDataSearchIndex::~WebDataSearchIndex()
+{
+}
+
+void WebDataSearchIndex::addDocument( quint64 key, const QString& name, const QString& title, const QString& abstract,
+                                      const QStringList& keywords )
+{
+  removeDocument( key );
+
+  QSet<quint32> documentWords;
+  addField( key, name, NameField, documentWords );
+  addField( key, title, TitleField, documentWords );
+  addField( key, keywords.join( " " ), KeywordsField, documentWords );
+  addField( key, abstract, AbstractField, documentWords );
+  if ( !documentWords.isEmpty() )
+  {
+    mDocumentWords.insert( key, documentWords.toList().toVector() );
+  }
+}
+
+void WebDataSearchIndex::removeDocument( quint64 key )
+{
+  QHash<quint64, QVector<quint32> >::iterator documentIt = mDocumentWords.find( key );
+  if ( documentIt == mDocumentWords.end() )
+  {
+    return;
+  }
+
+  QVector<quint32>::const_iterator wordIt = documentIt->constBegin();
+  for ( ; wordIt != documentIt->constEnd(); ++wordIt )
+  {
+    mPostings[*wordIt].remove( key );
+  }
+  mDocumentWords.erase( documentIt );
+}
+
+QHash<quint64, double> WebDataSearchIndex::search( const QString& query, const QHash<quint64, double>* candidates ) const
+{
+  QHash<quint64, double> result;
+  QStringList terms = tokenize( query );
+  for ( int i = 0; i < terms.size(); ++i )
+  {
+    //best score of the term for each document. Whole word matches count more than matches inside a word
+    QHash<quint64, double> termScores;
+    QVector<quint32> words = matchingWords( terms.at( i ) );
+    QVector<quint32>::const_iterator wordIt = words.constBegin();
+    for ( ; wordIt != words.constEnd(); ++wordIt )
+    {
+      double wordFactor = ( mWords.at( *wordIt ) == terms.at( i ) ) ? 1.0 : 0.5;
+      const QHash<quint64, quint8>& postings = mPostings.at( *wordIt );
+      QHash<quint64, quint8>::const_iterator postingIt = postings.constBegin();
+      for ( ; postingIt != postings.constEnd(); ++postingIt )
+      {
+        if ( candidates && !candidates->contains( postingIt.key() ) )
+        {
+          continue;
+        }
+        double score = fieldWeight( postingIt.value() ) * wordFactor;
+        double& termScore = termScores[postingIt.key()];
+        termScore = qMax( termScore, score );
+      }
+    }
+
+    //all terms need to match
+    if ( i == 0 )
+    {
+      result = termScores;
+    }
+    else
+    {
+      QHash<quint64, double>::iterator resultIt = result.begin();
+      while ( resultIt != result.end() )
+      {
+        QHash<quint64, double>::const_iterator termIt = termScores.constFind( resultIt.key() );
+        if ( termIt == termScores.constEnd() )
+        {
+          resultIt = result.erase( resultIt );
+        }
+        else
+        {
+          resultIt.value() += termIt.value();
+          ++resultIt;
+        }
+      }
+    }
+
+    if ( result.isEmpty() )
+    {
+      break;
+    }
+  }
+  return result;
+}
+
+bool WebDataSearchIndex::narrowsQuery( const QString& oldQuery, const QString& newQuery )
+{
+  QStringList oldTerms = tokenize( oldQuery );
+  QStringList newTerms = tokenize( newQuery );
+  if ( oldTerms.isEmpty() || newTerms.size() < oldTerms.size() )
+  {
+    return false;
+  }
+
+  for ( int i = 0; i < oldTerms.size(); ++i )
+  {
+    //short terms match word beginnings, longer ones any part of a word (see matchingWords)
+    const QString& oldTerm = oldTerms.at( i );
+    if ( oldTerm.size() < 3 ? ( newTerms.at( i ) != oldTerm ) : !newTerms.at( i ).contains( oldTerm ) )
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+QStringList WebDataSearchIndex::tokenize( const QString& text )
+{
+  //underscores and wildcard characters separate words as well
+  return text.toLower().split( QRegExp( "[\\W_]+" ), QString::SkipEmptyParts );
+}
+
+quint32 WebDataSearchIndex::wordId( const QString& word )
+{
+  QHash<QString, quint32>::const_iterator idIt = mWordIds.constFind( word );
+  if ( idIt != mWordIds.constEnd() )
+  {
+    return idIt.value();
+  }
+
+  quint32 id = mWords.size();
+  mWords.append( word );
+  mWordIds.insert( word, id );
+  mPostings.append( QHash<quint64, quint8>() );
+
+  QSet<QString> trigrams;
+  for ( int i = 0; i + 3 <= word.size(); ++i )
+  {
+    trigrams.insert( word.mid( i, 3 ) );
+  }
+  QSet<QString>::const_iterator trigramIt = trigrams.constBegin();
+  for ( ; trigramIt != trigrams.constEnd(); ++trigramIt )
+  {
+    mTrigrams[*trigramIt].append( id );
+  }
+  return id;
+}
+
+void WebDataSearchIndex::addField( quint64 key, const QString& text, Field field, QSet<quint32>& documentWords )
+{
+  QStringList words = tokenize( text );
+  QStringList::const_iterator wordIt = words.constBegin();
+  for ( ; wordIt != words.constEnd(); ++wordIt )
+  {
+    quint32 id = wordId( *wordIt );
+    mPostings[id][key] |= field;
+    documentWords.insert( id );
+  }
+}
+
+QVector<quint32> WebDataSearchIndex::matchingWords( const QString& term ) const
+{
+  QVector<quint32> words;
+  if ( term.size() < 3 )
+  {
+    for ( int i = 0; i < mWords.size(); ++i )
+    {
+      if ( mWords.at( i ).startsWith( term ) )
+      {
+        words.append( i );
+      }
+    }
+    return words;
+  }
+
+  //candidates from the rarest trigram of the term, then verify the whole term
+  const QVector<quint32>* candidates = 0;
+  for ( int i = 0; i + 3 <= term.size(); ++i )
+  {
+    QHash<QString, QVector<quint32> >::const_iterator trigramIt = mTrigrams.constFind( term.mid( i, 3 ) );
+    if ( trigramIt == mTrigrams.constEnd() )
+    {
+      return words;
+    }
+    if ( !candidates || trigramIt->size() < candidates->size() )
+    {
+      candidates = &( trigramIt.value() );
+    }
+  }
+
+  QVector<quint32>::const_iterator candidateIt = candidates->constBegin();
+  for ( ; candidateIt != candidates->constEnd(); ++candidateIt )
+  {
+    if ( mWords.at( *candidateIt ).contains( term ) )
+    {
+      words.append( *candidateIt );
+    }
+  }
+  return words;
+}
+
+double WebDataSearchIndex::fieldWeight( quint8 fields )
+{
+  double weight = 0;
+  if ( fields & NameField )
+  {
+    weight += 8;
+  }
+  if ( fields & TitleField )
+  {
+    weight += 4;
+  }
+  if ( fields & KeywordsField )
+  {
+    weight += 2;
+  }
+  if ( fields & AbstractField )
+  {
+    weight += 1;
+  }
+  return weight;
+}
@@ -0,0 +1,59 @@
+#ifndef WEBDATASEARCHINDEX_H
+#define WEBDATASEARCHINDEX_H
+
+#include <QHash>
+#include <QSet>
+#include <QStringList>
+#include <QVector>
+
+/**In-memory inverted index over the texts of the catalogue layers (name, title, abstract, keywords). Documents are
+  listed per word. The dictionary of words is additionally indexed by trigram, so query terms also match inside
+  words (e.g. 'river' finds 'nz_rivers')*/
+class WebDataSearchIndex
+{
+  public:
+    enum Field
+    {
+      NameField = 1,
+      TitleField = 2,
+      KeywordsField = 4,
+      AbstractField = 8
+    };
+
+    WebDataSearchIndex();
+    ~WebDataSearchIndex();
+
+    /**Adds the texts of a document. Replaces the texts if the document is already in the index*/
+    void addDocument( quint64 key, const QString& name, const QString& title, const QString& abstract,
+                      const QStringList& keywords );
+    void removeDocument( quint64 key );
+
+    /**Returns the documents containing all terms of the query with their score (higher is better)
+      @param candidates if not null, only these documents are considered (e.g. the result of a previous, shorter query)*/
+    QHash<quint64, double> search( const QString& query, const QHash<quint64, double>* candidates = 0 ) const;
+    /**Returns true if every document matching newQuery also matches oldQuery, so the search for newQuery can be
+      restricted to the result of oldQuery*/
+    static bool narrowsQuery( const QString& oldQuery, const QString& newQuery );
+
+    /**Splits a text into lower case words*/
+    static QStringList tokenize( const QString& text );
+
+  private:
+    QVector<QString> mWords;
+    QHash<QString, quint32> mWordIds;
+    /**Documents containing a word, with the fields it occurs in*/
+    QVector< QHash<quint64, quint8> > mPostings;
+    /**Ids of the words containing a trigram*/
+    QHash<QString, QVector<quint32> > mTrigrams;
+    /**Word ids of each document (for removal)*/
+    QHash<quint64, QVector<quint32> > mDocumentWords;
+
+    /**Returns the id of a word, adding it to the dictionary if necessary*/
+    quint32 wordId( const QString& word );
+    void addField( quint64 key, const QString& text, Field field, QSet<quint32>& documentWords );
+    /**Ids of the dictionary words containing the term (starting with the term for terms shorter than three characters)*/
+    QVector<quint32> matchingWords( const QString& term ) const;
+    static double fieldWeight( quint8 fields );
+};
+
+#endif // WEBDATASEARCHINDEX_H
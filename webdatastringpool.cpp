@@ -0,0 +1,38 @@
+#include "webdatastringpool.h"
+
+WebDataStringPool::WebDataStringPool()
+{
+  mStrings.append( QString() );
+}
+
+WebDataStringPool::~WebDataStringPool()
+{
+}
+
+quint32 WebDataStringPool::intern( const QString& string )
+{
+  if ( string.isEmpty() )
+  {
+    return 0;
+  }
+
+  QHash<QString, quint32>::const_iterator idIt = mIds.constFind( string );
+  if ( idIt != mIds.constEnd() )
+  {
+    return idIt.value();
+  }
+
+  quint32 id = mStrings.size();
+  mStrings.append( string );
+  mIds.insert( string, id );
+  return id;
+}
+
+const QString& WebDataStringPool::string( quint32 id ) const
+{
+  if ( id >= ( quint32 )mStrings.size() )
+  {
+    return mStrings.at( 0 );
+  }
+  return mStrings.at( id );
+}
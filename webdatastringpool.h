@@ -0,0 +1,26 @@
+#ifndef WEBDATASTRINGPOOL_H
+#define WEBDATASTRINGPOOL_H
+
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+/**Stores each distinct string once and hands out small integer ids for it. Used for values which repeat on many layers
+  (CRS / format / style lists)*/
+class WebDataStringPool
+{
+  public:
+    WebDataStringPool();
+    ~WebDataStringPool();
+
+    /**Returns the id of the string, adding it to the pool if necessary. The empty string has id 0*/
+    quint32 intern( const QString& string );
+    /**Returns the string for an id (empty string for unknown ids)*/
+    const QString& string( quint32 id ) const;
+
+  private:
+    QVector<QString> mStrings;
+    QHash<QString, quint32> mIds;
+};
+
+#endif // WEBDATASTRINGPOOL_H
@@ -0,0 +1,111 @@
+#include "webdatasyncstate.h"
+#include "qgsfeature.h"
+#include "qgsfields.h"
+#include "qgsgeometry.h"
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QSettings>
+#include <QStringList>
+
+static const quint32 SYNC_MAGIC = 0x57445353; //WDSS
+static const quint32 SYNC_VERSION = 1;
+
+WebDataSyncState::WebDataSyncState()
+{
+}
+
+WebDataSyncState::~WebDataSyncState()
+{
+}
+
+bool WebDataSyncState::load( const QString& path )
+{
+  QFile stateFile( path );
+  if ( !stateFile.open( QIODevice::ReadOnly ) )
+  {
+    return false;
+  }
+
+  QDataStream stream( &stateFile );
+  stream.setVersion( QDataStream::Qt_5_0 );
+  quint32 magic, version;
+  stream >> magic >> version;
+  if ( magic != SYNC_MAGIC || version != SYNC_VERSION )
+  {
+    return false;
+  }
+  stream >> keyField >> modifiedField >> lastModified >> hashes;
+  return ( stream.status() == QDataStream::Ok );
+}
+
+bool WebDataSyncState::save( const QString& path ) const
+{
+  QSaveFile stateFile( path );
+  if ( !stateFile.open( QIODevice::WriteOnly ) )
+  {
+    return false;
+  }
+
+  QDataStream stream( &stateFile );
+  stream.setVersion( QDataStream::Qt_5_0 );
+  stream << SYNC_MAGIC << SYNC_VERSION;
+  stream << keyField << modifiedField << lastModified << hashes;
+  return ( stream.status() == QDataStream::Ok && stateFile.commit() );
+}
+
+QString WebDataSyncState::statePath( const QString& shapeFilePath )
+{
+  QFileInfo shapeFileInfo( shapeFilePath );
+  return shapeFileInfo.absolutePath() + "/" + shapeFileInfo.completeBaseName() + ".sync";
+}
+
+QByteArray WebDataSyncState::featureHash( const QgsFeature& feature )
+{
+  QByteArray data;
+  QDataStream stream( &data, QIODevice::WriteOnly );
+  stream.setVersion( QDataStream::Qt_5_0 );
+  stream << static_cast<const QVector<QVariant>&>( feature.attributes() );
+  data.append( feature.geometry().asWkb() );
+  return QCryptographicHash::hash( data, QCryptographicHash::Md5 );
+}
+
+int WebDataSyncState::findField( const QgsFields& fields, const QString& settingKey, const QString& defaultNames )
+{
+  QStringList names = QSettings().value( settingKey, defaultNames ).toString().split( ",", QString::SkipEmptyParts );
+  QStringList::const_iterator nameIt = names.constBegin();
+  for ( ; nameIt != names.constEnd(); ++nameIt )
+  {
+    for ( int i = 0; i < fields.count(); ++i )
+    {
+      if ( fields.at( i ).name().compare( nameIt->trimmed(), Qt::CaseInsensitive ) == 0 )
+      {
+        return i;
+      }
+    }
+  }
+  return -1;
+}
+
+bool WebDataSyncState::isNewer( const QVariant& value, const QVariant& than )
+{
+  if ( !value.isValid() || value.isNull() )
+  {
+    return false;
+  }
+  if ( !than.isValid() || than.isNull() )
+  {
+    return true;
+  }
+
+  QDateTime valueTime = value.toDateTime();
+  QDateTime thanTime = than.toDateTime();
+  if ( valueTime.isValid() && thanTime.isValid() )
+  {
+    return valueTime > thanTime;
+  }
+  return value.toString() > than.toString();
+}
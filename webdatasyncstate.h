@@ -0,0 +1,43 @@
+#ifndef WEBDATASYNCSTATE_H
+#define WEBDATASYNCSTATE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <QVariant>
+
+class QgsFeature;
+class QgsFields;
+
+/**Sync state of an offline WFS layer, kept next to its shapefile (<shapefile>.sync). Features are identified by the
+  value of a key field. For each key, the state has a hash of the feature as the server sent it, so unchanged
+  features are recognised although the shapefile does not store them exactly (shortened field names, converted types)*/
+class WebDataSyncState
+{
+  public:
+    WebDataSyncState();
+    ~WebDataSyncState();
+
+    /**Key field (WFS field name)*/
+    QString keyField;
+    /**Last modified field (empty if the feature type has none)*/
+    QString modifiedField;
+    /**Newest value of the last modified field seen so far*/
+    QVariant lastModified;
+    /**Content hash by feature key*/
+    QHash<QString, QByteArray> hashes;
+
+    bool load( const QString& path );
+    /**Replaces the state file atomically*/
+    bool save( const QString& path ) const;
+
+    static QString statePath( const QString& shapeFilePath );
+    /**Hash of attributes and geometry*/
+    static QByteArray featureHash( const QgsFeature& feature );
+    /**Returns the first field named in a comma separated list of the setting (case insensitive), -1 if none*/
+    static int findField( const QgsFields& fields, const QString& settingKey, const QString& defaultNames );
+    /**Compares values of a last modified field (date / time or ISO text)*/
+    static bool isNewer( const QVariant& value, const QVariant& than );
+};
+
+#endif // WEBDATASYNCSTATE_H